@@ -0,0 +1,443 @@
+#pragma comment(lib, "OpenCl.lib")
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <climits>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "TempData.h"
+#include "my_kernels_3.cl.h"
+// MY_KERNELS_3_CL, generated by the custom build step of Tutorial 3, which this project depends on
+
+// benchmark of the Tutorial 3 kernels: every variant is run over a matrix of input sizes and work group sizes,
+// after some warmup runs its device time is measured over a number of repetitions and summarised, so runs of
+// different commits on the same machine can be compared
+
+// one kernel variant: enqueues a whole run over the first n values of the inputs with the given work group size
+// and adds the events of its kernels
+struct BenchmarkVariant {
+	string name;
+	string type;
+	size_t bytesPerElement;		// bytes of input the variant reads per element
+	std::function<void(size_t n, size_t local_size, vector<cl::Event>& events)> run;
+};
+
+// summary of the repetitions of one variant, size and work group size, times in ns
+struct BenchmarkResult {
+	string variant;
+	string type;
+	size_t elements;
+	size_t localSize;
+	cl_ulong median;
+	cl_ulong p95;
+	cl_ulong min;
+	double mean;
+	double stddev;
+	double elementsPerSecond;
+	double gbPerSecond;
+};
+
+// nearest-rank percentile of sorted times
+cl_ulong Percentile(const vector<cl_ulong>& sorted, double p) {
+	size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+	return sorted[std::max(rank, (size_t)1) - 1];
+}
+
+BenchmarkResult Summarise(const BenchmarkVariant& variant, size_t n, size_t local_size, vector<cl_ulong> times) {
+	BenchmarkResult result;
+	std::sort(times.begin(), times.end());
+
+	result.variant = variant.name;
+	result.type = variant.type;
+	result.elements = n;
+	result.localSize = local_size;
+	result.median = times.size() % 2 ? times[times.size() / 2] : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+	result.p95 = Percentile(times, 95);
+	result.min = times[0];
+
+	double sum = 0;
+	for (size_t i = 0; i < times.size(); i++)
+		sum += (double)times[i];
+	result.mean = sum / times.size();
+
+	double squares = 0;
+	for (size_t i = 0; i < times.size(); i++)
+		squares += ((double)times[i] - result.mean) * ((double)times[i] - result.mean);
+	result.stddev = times.size() > 1 ? sqrt(squares / (times.size() - 1)) : 0.0;
+
+	result.elementsPerSecond = n / (std::max(result.median, (cl_ulong)1) * 1e-9);
+	result.gbPerSecond = (double)n * variant.bytesPerElement / std::max(result.median, (cl_ulong)1);
+	// bytes per ns is GB/s
+
+	return result;
+}
+
+// comma separated list of sizes, e.g. 65536,1048576
+vector<size_t> ParseSizes(const string& text) {
+	vector<size_t> sizes;
+	stringstream list(text);
+	string item;
+
+	while (getline(list, item, ','))
+	{
+		size_t size = (size_t)strtoull(item.c_str(), 0, 10);
+		if (size)
+			sizes.push_back(size);
+	}
+
+	return sizes;
+}
+
+string FormatCsv(const DeviceInfo& device, int warmups, int repetitions, const vector<BenchmarkResult>& results) {
+	stringstream sstream;
+
+	sstream << "device,variant,type,elements,local_size,warmups,repetitions,median_ns,p95_ns,min_ns,mean_ns,stddev_ns,elements_per_s,gb_per_s" << endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& r = results[i];
+		sstream << "\"" << device.name << "\"," << r.variant << "," << r.type << "," << r.elements << "," << r.localSize << "," << warmups << "," << repetitions;
+		sstream << "," << r.median << "," << r.p95 << "," << r.min << "," << r.mean << "," << r.stddev << "," << r.elementsPerSecond << "," << r.gbPerSecond << endl;
+	}
+
+	return sstream.str();
+}
+
+string FormatJson(const DeviceInfo& device, int warmups, int repetitions, const vector<BenchmarkResult>& results) {
+	stringstream sstream;
+
+	sstream << "{" << endl;
+	sstream << "\t\"platform\": \"" << device.platformName << "\"," << endl;
+	sstream << "\t\"device\": \"" << device.name << "\"," << endl;
+	sstream << "\t\"driver\": \"" << device.driverVersion << "\"," << endl;
+	sstream << "\t\"warmups\": " << warmups << "," << endl;
+	sstream << "\t\"repetitions\": " << repetitions << "," << endl;
+	sstream << "\t\"results\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& r = results[i];
+		sstream << "\t\t{ \"variant\": \"" << r.variant << "\", \"type\": \"" << r.type << "\", \"elements\": " << r.elements << ", \"local_size\": " << r.localSize;
+		sstream << ", \"median_ns\": " << r.median << ", \"p95_ns\": " << r.p95 << ", \"min_ns\": " << r.min << ", \"mean_ns\": " << r.mean << ", \"stddev_ns\": " << r.stddev;
+		sstream << ", \"elements_per_s\": " << r.elementsPerSecond << ", \"gb_per_s\": " << r.gbPerSecond << " }" << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	sstream << "\t]" << endl << "}" << endl;
+
+	return sstream.str();
+}
+
+void print_help()
+{
+	std::cerr << "Application usage:" << std::endl;
+
+	std::cerr << "  -p : select platform " << std::endl;
+	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  --sizes : input sizes, e.g. 65536,1048576,16777216 (the default), rounded down to the work group size" << std::endl;
+	std::cerr << "  --local-sizes : work group sizes, e.g. 64,128,256 (the default), sizes the device cannot run are skipped" << std::endl;
+	std::cerr << "  --warmups : runs of every configuration before it is measured (default 3)" << std::endl;
+	std::cerr << "  --reps : measured runs of every configuration (default 20)" << std::endl;
+	std::cerr << "  --only : only the variants whose name contains this text, e.g. reduce_add" << std::endl;
+	std::cerr << "  --csv : write the results as CSV to this file" << std::endl;
+	std::cerr << "  --json : write the results as JSON to this file" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	int platform_id = 0;
+	int device_id = 0;
+	vector<size_t> sizes = { 1 << 16, 1 << 20, 1 << 24 };
+	vector<size_t> local_sizes = { 64, 128, 256 };
+	int warmups = 3;
+	int repetitions = 20;
+	string only;
+	string csv_file;
+	string json_file;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1)))
+		{
+			platform_id = atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1)))
+		{
+			device_id = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-l") == 0)
+		{
+			std::cout << ListPlatformsDevices() << std::endl;
+		}
+		else if ((strcmp(argv[i], "--sizes") == 0) && (i < (argc - 1)))
+		{
+			sizes = ParseSizes(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--local-sizes") == 0) && (i < (argc - 1)))
+		{
+			local_sizes = ParseSizes(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--warmups") == 0) && (i < (argc - 1)))
+		{
+			warmups = std::max(atoi(argv[++i]), 0);
+		}
+		else if ((strcmp(argv[i], "--reps") == 0) && (i < (argc - 1)))
+		{
+			repetitions = std::max(atoi(argv[++i]), 1);
+		}
+		else if ((strcmp(argv[i], "--only") == 0) && (i < (argc - 1)))
+		{
+			only = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--csv") == 0) && (i < (argc - 1)))
+		{
+			csv_file = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--json") == 0) && (i < (argc - 1)))
+		{
+			json_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-h") == 0)
+		{
+			print_help();
+			return 0;
+		}
+	}
+
+	if (sizes.empty() || local_sizes.empty())
+	{
+		std::cerr << "No input or work group sizes given" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		cl::Context context = GetContext(platform_id, device_id);
+		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		const DeviceInfo& device_info = GetDeviceInfo(platform_id, device_id);
+
+		std::cout << "Benchmarking on " << device_info.platformName << ", " << device_info.name << std::endl;
+
+		// the same program, build options and binary cache as Tutorial 3
+		cl::Program::Sources sources;
+		sources.push_back(make_pair((const char*)MY_KERNELS_3_CL, sizeof(MY_KERNELS_3_CL)));
+
+		cl_ulong kernels_hash = HashBytes(MY_KERNELS_3_CL, sizeof(MY_KERNELS_3_CL));
+		string build_options = "-DTOPK=10";
+		string program_cache_file = "my_kernels_3." + ProgramCacheKey(kernels_hash, build_options, device) + ".bin";
+
+		cl::Program program;
+		if (!LoadProgramBinary(context, device, program_cache_file, build_options, program))
+		{
+			program = cl::Program(context, sources);
+
+			try
+			{
+				program.build(build_options.c_str());
+			}
+			catch (const cl::Error& err)
+			{
+				std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+				throw err;
+			}
+
+			SaveProgramBinary(program, program_cache_file);
+		}
+
+		// inputs of the largest size, every run reads its first n values
+		size_t max_size = *std::max_element(sizes.begin(), sizes.end());
+		const int station_count = 5;
+
+		std::mt19937 generator(42);
+		std::uniform_real_distribution<float> temperature(-20.0f, 35.0f);
+		std::uniform_int_distribution<cl_int> station(0, station_count - 1);
+
+		vector<float> floats(max_size);
+		vector<cl_int> ints(max_size);
+		vector<cl_int> stations(max_size);
+		for (size_t i = 0; i < max_size; i++)
+		{
+			floats[i] = temperature(generator);
+			ints[i] = (cl_int)(floats[i] * 10); // tenths of a degree
+			stations[i] = station(generator);
+		}
+
+		cl::Buffer buffer_float(context, CL_MEM_READ_ONLY, max_size * sizeof(float));
+		cl::Buffer buffer_int(context, CL_MEM_READ_ONLY, max_size * sizeof(cl_int));
+		cl::Buffer buffer_station(context, CL_MEM_READ_ONLY, max_size * sizeof(cl_int));
+		queue.enqueueWriteBuffer(buffer_float, CL_TRUE, 0, max_size * sizeof(float), &floats[0]);
+		queue.enqueueWriteBuffer(buffer_int, CL_TRUE, 0, max_size * sizeof(cl_int), &ints[0]);
+		queue.enqueueWriteBuffer(buffer_station, CL_TRUE, 0, max_size * sizeof(cl_int), &stations[0]);
+
+		// sum of the float inputs for the mean of reduce_standDev_4, set for every size before it is run
+		cl::Buffer buffer_sum(context, CL_MEM_READ_ONLY, sizeof(float));
+
+		cl::Buffer buffer_scan(context, CL_MEM_READ_WRITE, max_size * sizeof(float));
+		cl::Buffer buffer_station_stats(context, CL_MEM_READ_WRITE, station_count * MOMENTS * sizeof(float));
+		cl::Buffer buffer_station_counts(context, CL_MEM_READ_WRITE, station_count * sizeof(cl_int));
+
+		BufferPool pool(context);
+		vector<cl::Event> no_wait;
+
+		// a whole tree reduction of the given kernels, the level buffers come from the pool
+		// first_count/next_count are the argument of the number of values the kernel reads, -1 for the unbounded ones
+		auto reduction = [&](const char* first_name, const char* next_name, const cl::Buffer& input, auto identity, bool mean, int first_count, int next_count) {
+			return [&, first_name, next_name, input, identity, mean, first_count, next_count](size_t n, size_t local_size, vector<cl::Event>& events) {
+				cl::Kernel first(program, first_name);
+				cl::Kernel next(program, next_name);
+				first.setArg(0, input);
+				first.setArg(mean ? 3 : 2, cl::Local(local_size * sizeof(identity)));
+				next.setArg(2, cl::Local(local_size * sizeof(identity)));
+				if (mean)
+					first.setArg(2, buffer_sum);
+
+				size_t level_values = ReductionLevelSize(n, local_size);
+				if (first_count >= 0)
+					first.setArg(first_count, (cl_int)n);
+				if (next_count >= 0)
+					next.setArg(next_count, (cl_int)level_values);
+
+				size_t level_size = level_values * sizeof(identity);
+				cl::Buffer levels[2] = { pool.Acquire(level_size), pool.Acquire(level_size) };
+				cl::Buffer result;
+
+				EnqueueReduction(queue, first, 1, next, levels, n, local_size, identity, no_wait, result, &events);
+
+				pool.Release(levels[0]);
+				pool.Release(levels[1]);
+			};
+		};
+
+		vector<BenchmarkVariant> variants = {
+			{ "reduce_add_4", "float", sizeof(float), reduction("reduce_add_4", "reduce_add_4", buffer_float, 0.0f, false, -1, -1) },
+			{ "reduce_max_4", "float", sizeof(float), reduction("reduce_max_4", "reduce_max_4", buffer_float, -INFINITY, false, 3, 3) },
+			{ "reduce_min_4", "float", sizeof(float), reduction("reduce_min_4", "reduce_min_4", buffer_float, INFINITY, false, 3, 3) },
+			{ "reduce_standDev_4", "float", sizeof(float), reduction("reduce_standDev_4", "reduce_add_4", buffer_float, 0.0f, true, 4, -1) },
+			{ "reduce_add_int_4", "int", sizeof(cl_int), reduction("reduce_add_int_4", "reduce_add_int_4", buffer_int, (cl_int)0, false, -1, -1) },
+			{ "reduce_max_int_4", "int", sizeof(cl_int), reduction("reduce_max_int_4", "reduce_max_int_4", buffer_int, (cl_int)INT_MIN, false, -1, -1) },
+			{ "reduce_min_int_4", "int", sizeof(cl_int), reduction("reduce_min_int_4", "reduce_min_int_4", buffer_int, (cl_int)INT_MAX, false, -1, -1) },
+			{ "scan_add_float", "float", 2 * sizeof(float), [&](size_t n, size_t local_size, vector<cl::Event>& events) {
+				EnqueueScan(pool, queue, program, "add_float", buffer_float, buffer_scan, n, sizeof(float), local_size, true, &events);
+			} },
+			{ "scan_add_int", "int", 2 * sizeof(cl_int), [&](size_t n, size_t local_size, vector<cl::Event>& events) {
+				EnqueueScan(pool, queue, program, "add_int", buffer_int, buffer_scan, n, sizeof(cl_int), local_size, true, &events);
+			} },
+			{ "reduce_station_stats", "float", sizeof(float) + sizeof(cl_int), [&](size_t n, size_t local_size, vector<cl::Event>& events) {
+				cl::Event event;
+
+				cl::Kernel kernel_init(program, "init_group_stats");
+				kernel_init.setArg(0, buffer_station_stats);
+				kernel_init.setArg(1, buffer_station_counts);
+				queue.enqueueNDRangeKernel(kernel_init, cl::NullRange, cl::NDRange(station_count), cl::NullRange, NULL, &event);
+				events.push_back(event);
+
+				cl::Kernel kernel_stats(program, "reduce_station_stats");
+				kernel_stats.setArg(0, buffer_float);
+				kernel_stats.setArg(1, buffer_station);
+				kernel_stats.setArg(2, buffer_station_stats);
+				kernel_stats.setArg(3, buffer_station_counts);
+				kernel_stats.setArg(4, cl::Local(station_count * MOMENTS * sizeof(float)));
+				kernel_stats.setArg(5, cl::Local(station_count * sizeof(cl_int)));
+				kernel_stats.setArg(6, (cl_int)n);
+				kernel_stats.setArg(7, station_count);
+				queue.enqueueNDRangeKernel(kernel_stats, cl::NullRange, cl::NDRange(n), cl::NDRange(local_size), NULL, &event);
+				events.push_back(event);
+			} },
+		};
+
+		vector<BenchmarkResult> results;
+
+		std::cout << "variant			type	elements	local	median [ns]	p95 [ns]	min [ns]	stddev [ns]	elements/s	GB/s" << std::endl;
+
+		for (size_t v = 0; v < variants.size(); v++)
+		{
+			const BenchmarkVariant& variant = variants[v];
+			if (!only.empty() && variant.name.find(only) == string::npos)
+				continue;
+
+			for (size_t s = 0; s < sizes.size(); s++)
+			{
+				for (size_t l = 0; l < local_sizes.size(); l++)
+				{
+					size_t local_size = local_sizes[l];
+					size_t n = (sizes[s] / local_size) * local_size;
+					// the reductions need a whole number of work groups
+
+					if (!n || local_size > device_info.maxWorkGroupSize)
+						continue;
+
+					if (variant.name == "reduce_standDev_4")
+					{
+						float sum = 0;
+						for (size_t i = 0; i < n; i++)
+							sum += floats[i];
+						queue.enqueueWriteBuffer(buffer_sum, CL_TRUE, 0, sizeof(float), &sum);
+					}
+
+					vector<cl_ulong> times;
+
+					try
+					{
+						for (int r = 0; r < warmups + repetitions; r++)
+						{
+							vector<cl::Event> events;
+							variant.run(n, local_size, events);
+							queue.finish();
+
+							if (r >= warmups)
+								times.push_back(GetKernelTime(events));
+						}
+					}
+					catch (const cl::Error& err)
+					{
+						// e.g. a work group size one of the kernels cannot run with
+						std::cerr << variant.name << ", " << n << " x " << local_size << " skipped: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+						continue;
+					}
+
+					BenchmarkResult result = Summarise(variant, n, local_size, times);
+					results.push_back(result);
+
+					std::cout << std::left << std::setw(24) << result.variant << std::right << "\t" << result.type << "\t" << result.elements << "\t" << result.localSize;
+					std::cout << "\t" << result.median << "\t\t" << result.p95 << "\t\t" << result.min << "\t\t" << result.stddev;
+					std::cout << "\t\t" << result.elementsPerSecond << "\t" << result.gbPerSecond << std::endl;
+				}
+			}
+		}
+
+		if (!csv_file.empty())
+		{
+			std::ofstream csv(csv_file);
+			csv << FormatCsv(device_info, warmups, repetitions, results);
+			std::cout << "Results written to " << csv_file << std::endl;
+		}
+
+		if (!json_file.empty())
+		{
+			std::ofstream json(json_file);
+			json << FormatJson(device_info, warmups, repetitions, results);
+			std::cout << "Results written to " << json_file << std::endl;
+		}
+	}
+	catch (cl::Error err)
+	{
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <chrono>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "TempData.h"
+
+using namespace std;
+
+// multi-device mode (-a): the records are split into one contiguous shard per device, sized by the throughput
+// each device reaches on a calibration sample, every device reduces its shard into per-station moments and the
+// partial tables are merged on the host
+
+// rows of the calibration sample every device reduces before the records are split
+const size_t MULTI_CALIBRATION_ROWS = 1 << 20;
+
+// one device of a multi-device run and the shard it reduces
+struct DeviceShard {
+	const DeviceInfo* info;
+	cl::Context context;
+	cl::CommandQueue queue;
+	cl::Program program;
+	bool programLoaded;
+	size_t localSize;
+
+	double throughput;		// calibration rows per ns, upload included
+	size_t first;
+	size_t count;
+
+	vector<float> stats;
+	vector<cl_int> counts;
+	vector<cl::Event> kernelEvents;
+	vector<cl::Event> memoryEvents;
+};
+
+// "all" or a list of platform:device pairs such as 0:0,1:0
+bool ParseDeviceList(const string& text, vector<const DeviceInfo*>& devices) {
+	const vector<DeviceInfo>& registry = GetDeviceRegistry();
+
+	if (text == "all")
+	{
+		for (unsigned int i = 0; i < registry.size(); i++)
+			devices.push_back(&registry[i]);
+		return !devices.empty();
+	}
+
+	stringstream list(text);
+	string item;
+
+	while (getline(list, item, ','))
+	{
+		size_t colon = item.find(':');
+		if (colon == string::npos)
+			return false;
+
+		int platform_id = atoi(item.substr(0, colon).c_str());
+		int device_id = atoi(item.substr(colon + 1).c_str());
+		const DeviceInfo* found = 0;
+
+		for (unsigned int i = 0; i < registry.size(); i++)
+		{
+			if (registry[i].platform_id == platform_id && registry[i].device_id == device_id)
+				found = &registry[i];
+		}
+
+		if (!found)
+			return false;
+
+		devices.push_back(found);
+	}
+
+	return !devices.empty();
+}
+
+// context, queue and program of one device, the program goes through the same binary cache as the single device run
+DeviceShard OpenDeviceShard(const DeviceInfo& info, const cl::Program::Sources& sources, cl_ulong source_hash, const string& options) {
+	DeviceShard shard;
+	shard.info = &info;
+	shard.context = cl::Context({ info.device });
+	shard.queue = cl::CommandQueue(shard.context, CL_QUEUE_PROFILING_ENABLE);
+	shard.localSize = std::min((size_t)128, info.maxWorkGroupSize);
+	shard.throughput = 0;
+	shard.first = 0;
+	shard.count = 0;
+
+	string binary_file = "my_kernels_3." + ProgramCacheKey(source_hash, options, info.device) + ".bin";
+	shard.programLoaded = LoadProgramBinary(shard.context, info.device, binary_file, options, shard.program);
+
+	if (!shard.programLoaded)
+	{
+		shard.program = cl::Program(shard.context, sources);
+
+		try
+		{
+			shard.program.build(options.c_str());
+		}
+		catch (const cl::Error& err)
+		{
+			cout << "Build Log (" << info.name << "):\t " << shard.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(info.device) << endl;
+			throw err;
+		}
+
+		SaveProgramBinary(shard.program, binary_file);
+	}
+
+	return shard;
+}
+
+// uploads rows [first, first + count) of the temperature and station columns and enqueues their per-station reduction,
+// nothing is waited for, the moments land in shard.stats/shard.counts once the queue is finished
+void EnqueueShardStats(DeviceShard& shard, const TempColumns& columns, size_t first, size_t count) {
+	int nStations = (int)columns.stationNames.size();
+
+	shard.stats.assign(nStations * MOMENTS, 0.0f);
+	shard.counts.assign(nStations, 0);
+
+	cl::Buffer buffer_temp(shard.context, CL_MEM_READ_ONLY, count * sizeof(float));
+	cl::Buffer buffer_station(shard.context, CL_MEM_READ_ONLY, count * sizeof(cl_int));
+	cl::Buffer buffer_stats(shard.context, CL_MEM_READ_WRITE, shard.stats.size() * sizeof(float));
+	cl::Buffer buffer_counts(shard.context, CL_MEM_READ_WRITE, shard.counts.size() * sizeof(cl_int));
+
+	cl::Event prof_event;
+
+	shard.queue.enqueueWriteBuffer(buffer_temp, CL_FALSE, 0, count * sizeof(float), &columns.temperature[first], NULL, &prof_event);
+	shard.memoryEvents.push_back(prof_event);
+	shard.queue.enqueueWriteBuffer(buffer_station, CL_FALSE, 0, count * sizeof(cl_int), &columns.station[first], NULL, &prof_event);
+	shard.memoryEvents.push_back(prof_event);
+
+	cl::Kernel kernel_init = cl::Kernel(shard.program, "init_group_stats");
+	kernel_init.setArg(0, buffer_stats);
+	kernel_init.setArg(1, buffer_counts);
+
+	shard.queue.enqueueNDRangeKernel(kernel_init, cl::NullRange, cl::NDRange(nStations), cl::NullRange, NULL, &prof_event);
+	shard.kernelEvents.push_back(prof_event);
+
+	cl::Kernel kernel_stats = cl::Kernel(shard.program, "reduce_station_stats");
+	kernel_stats.setArg(0, buffer_temp);
+	kernel_stats.setArg(1, buffer_station);
+	kernel_stats.setArg(2, buffer_stats);
+	kernel_stats.setArg(3, buffer_counts);
+	kernel_stats.setArg(4, cl::Local(nStations * MOMENTS * sizeof(float)));
+	kernel_stats.setArg(5, cl::Local(nStations * sizeof(cl_int)));
+	kernel_stats.setArg(6, (cl_int)count);
+	kernel_stats.setArg(7, nStations);
+
+	shard.queue.enqueueNDRangeKernel(kernel_stats, cl::NullRange, cl::NDRange(((count + shard.localSize - 1) / shard.localSize) * shard.localSize), cl::NDRange(shard.localSize), NULL, &prof_event);
+	shard.kernelEvents.push_back(prof_event);
+
+	shard.queue.enqueueReadBuffer(buffer_stats, CL_FALSE, 0, shard.stats.size() * sizeof(float), &shard.stats[0], NULL, &prof_event);
+	shard.memoryEvents.push_back(prof_event);
+	shard.queue.enqueueReadBuffer(buffer_counts, CL_FALSE, 0, shard.counts.size() * sizeof(cl_int), &shard.counts[0], NULL, &prof_event);
+	shard.memoryEvents.push_back(prof_event);
+}
+
+// splits n rows over the shards in proportion to their throughput, every shard but the last starts on a multiple of align
+void PartitionShards(vector<DeviceShard>& shards, size_t n, size_t align) {
+	double total = 0;
+	for (unsigned int i = 0; i < shards.size(); i++)
+		total += shards[i].throughput;
+
+	size_t first = 0;
+	for (unsigned int i = 0; i < shards.size(); i++)
+	{
+		size_t count = (size_t)(n * (shards[i].throughput / total));
+		count = (count / align) * align;
+
+		if (i == shards.size() - 1 || first + count > n)
+			count = n - first;
+
+		shards[i].first = first;
+		shards[i].count = count;
+		first += count;
+	}
+}
+
+// runs the per-station reductions over every record on all devices and prints the merged statistics and the load balance
+void RunMultiDevice(const vector<const DeviceInfo*>& devices, const TempColumns& columns, const cl::Program::Sources& sources,
+	cl_ulong source_hash, const string& options) {
+	size_t n = columns.temperature.size();
+	vector<DeviceShard> shards;
+
+	// nothing to shard, and buffers of zero size cannot be created
+	if (!n)
+	{
+		cout << "Multi-device run skipped, no records" << endl;
+		return;
+	}
+
+	for (unsigned int i = 0; i < devices.size(); i++)
+		shards.push_back(OpenDeviceShard(*devices[i], sources, source_hash, options));
+
+	// ********** CALIBRATION **********
+	// every device reduces the same sample, its rows per ns (upload and kernels) weight its shard
+	size_t sample = std::min(n, MULTI_CALIBRATION_ROWS);
+
+	for (unsigned int i = 0; i < shards.size(); i++)
+	{
+		EnqueueShardStats(shards[i], columns, 0, sample);
+		shards[i].queue.finish();
+
+		cl_ulong time = GetKernelTime(shards[i].kernelEvents) + GetKernelTime(shards[i].memoryEvents);
+		shards[i].throughput = sample / (double)std::max(time, (cl_ulong)1);
+
+		shards[i].kernelEvents.clear();
+		shards[i].memoryEvents.clear();
+	}
+
+	size_t align = 1;
+	for (unsigned int i = 0; i < shards.size(); i++)
+		align = std::max(align, shards[i].localSize);
+
+	PartitionShards(shards, n, align);
+
+	// ********** SHARDED REDUCTION **********
+	// every queue is filled before any is waited for, so the devices run at the same time
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	for (unsigned int i = 0; i < shards.size(); i++)
+	{
+		if (shards[i].count)
+			EnqueueShardStats(shards[i], columns, shards[i].first, shards[i].count);
+	}
+
+	for (unsigned int i = 0; i < shards.size(); i++)
+		shards[i].queue.finish();
+
+	double wall_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+	int nStations = (int)columns.stationNames.size();
+	vector<GroupStats> stations(nStations, GroupStats());
+	GroupStats all = GroupStats();
+
+	for (unsigned int i = 0; i < shards.size(); i++)
+	{
+		if (!shards[i].count)
+			continue;
+
+		vector<GroupStats> partial = ToGroupStats(shards[i].stats, shards[i].counts);
+
+		for (int s = 0; s < nStations; s++)
+		{
+			stations[s] = MergeGroupStats(stations[s], partial[s]);
+			all = MergeGroupStats(all, partial[s]);
+		}
+	}
+
+	cout << "Multi-device run over " << shards.size() << " device(s)" << endl << endl;
+
+	cout << FormatGroupStats("All Stations:", all) << endl << endl;
+	cout << "Per Station:" << endl;
+	for (int s = 0; s < nStations; s++)
+	{
+		if (stations[s].count)
+			cout << FormatGroupStats(columns.stationNames[s], stations[s]) << endl;
+	}
+	cout << endl;
+
+	for (unsigned int i = 0; i < shards.size(); i++)
+	{
+		const DeviceShard& shard = shards[i];
+		float kernel_time = shard.count ? GetKernelTime(shard.kernelEvents) : 0;
+		float memory_time = shard.count ? GetKernelTime(shard.memoryEvents) : 0;
+
+		cout << "Device " << shard.info->platform_id << ":" << shard.info->device_id << ", " << shard.info->name << endl;
+		cout << "		rows: " << shard.count << " (" << 100.0 * shard.count / n << "%),		calibration rows/ns: " << shard.throughput;
+		cout << ",		program " << (shard.programLoaded ? "loaded from binary cache" : "built from source") << endl;
+		cout << "		execution time [ns]: " << kernel_time << ",		total memory transfer [ns]: " << memory_time << endl << endl;
+	}
+
+	cout << "Sharded reduction wall time [ms]: " << wall_time << endl << endl;
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+using namespace std;
+
+// per-stage profiling of the statistics pipeline: every command is recorded with the stage it was enqueued in,
+// what it was and the bytes it moved, its queued/submit/start/end times are read once all of them are done
+// the host phases and the device commands can also be written as a Chrome trace_event file (chrome://tracing,
+// ui.perfetto.dev), with the device timestamps moved onto the host clock
+
+enum ProfiledKind {
+	PROFILED_KERNEL,
+	PROFILED_TRANSFER
+};
+
+// one enqueued command, the times are 64-bit device ns filled in by Profiler::Collect
+struct ProfiledCommand {
+	string stage;
+	string name;
+	ProfiledKind kind;
+	cl::Event event;
+	cl_ulong bytes;
+
+	cl_ulong queued;
+	cl_ulong submit;
+	cl_ulong start;
+	cl_ulong end;
+};
+
+// host time spent inside one ProfileScope
+struct ProfiledPhase {
+	string stage;
+	std::chrono::high_resolution_clock::time_point start;
+	std::chrono::high_resolution_clock::time_point end;
+};
+
+class Profiler {
+public:
+	Profiler() : stage("SETUP"), collected_count(0), device_sync(0) {
+		created = std::chrono::high_resolution_clock::now();
+		host_sync = created;
+	}
+
+	// pairs a device timestamp with the host clock: a marker is waited for and its end is taken to be halfway
+	// through the round trip, so the trace is off by at most half of it (OpenCL 1.2 has no shared host/device timer)
+	void SyncClock(const cl::CommandQueue& queue) {
+		cl::Event marker;
+
+		std::chrono::high_resolution_clock::time_point before = std::chrono::high_resolution_clock::now();
+		queue.enqueueMarkerWithWaitList(NULL, &marker);
+		marker.wait();
+		std::chrono::high_resolution_clock::time_point after = std::chrono::high_resolution_clock::now();
+
+		host_sync = before + (after - before) / 2;
+		device_sync = marker.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	}
+
+	// records a kernel launch under the current stage, bytes is what it reads and writes (0 if not known)
+	void Kernel(const string& name, const cl::Event& event, cl_ulong bytes = 0) {
+		Add(name, PROFILED_KERNEL, event, bytes);
+	}
+
+	void Kernel(const cl::Kernel& kernel, const cl::Event& event, cl_ulong bytes = 0) {
+		Add(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), PROFILED_KERNEL, event, bytes);
+	}
+
+	// the launches appended to events from index first on, for the helpers that enqueue several kernels
+	void Kernels(const string& name, const vector<cl::Event>& events, size_t first = 0) {
+		for (size_t i = first; i < events.size(); i++)
+			Add(name, PROFILED_KERNEL, events[i], 0);
+	}
+
+	void Transfer(const string& name, const cl::Event& event, cl_ulong bytes) {
+		Add(name, PROFILED_TRANSFER, event, bytes);
+	}
+
+	const string& Stage() const {
+		return stage;
+	}
+
+	// waits for every recorded command and reads its times, later calls only pick up new commands
+	void Collect() {
+		vector<cl::Event> pending;
+		for (size_t i = collected_count; i < commands.size(); i++)
+			pending.push_back(commands[i].event);
+
+		if (!pending.empty())
+			cl::WaitForEvents(pending);
+
+		for (size_t i = collected_count; i < commands.size(); i++)
+		{
+			ProfiledCommand& command = commands[i];
+			command.queued = command.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+			command.submit = command.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+			command.start = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			command.end = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		}
+
+		collected_count = commands.size();
+	}
+
+	// execution time [ns] of the kernels (or transfers) of one stage, all stages if stage is empty
+	cl_ulong Total(const string& stage_name, ProfiledKind kind) {
+		Collect();
+
+		cl_ulong total = 0;
+		for (size_t i = 0; i < commands.size(); i++)
+		{
+			if (commands[i].kind == kind && (stage_name.empty() || commands[i].stage == stage_name))
+				total += commands[i].end - commands[i].start;
+		}
+
+		return total;
+	}
+
+	// per stage totals followed by every launch, times in us relative to the first queued command
+	string Report() {
+		Collect();
+		stringstream sstream;
+
+		if (commands.empty())
+			return "";
+
+		cl_ulong origin = Origin();
+		vector<string> stages = Stages();
+
+		sstream << "stage		launches	kernels [us]	transfers [us]	host [ms]" << endl;
+		for (size_t s = 0; s < stages.size(); s++)
+		{
+			sstream << stages[s] << "\t\t" << Launches(stages[s]) << "\t\t" << Total(stages[s], PROFILED_KERNEL) / 1000.0;
+			sstream << "\t\t" << Total(stages[s], PROFILED_TRANSFER) / 1000.0 << "\t\t" << HostTime(stages[s]) << endl;
+		}
+		sstream << "total\t\t" << commands.size() << "\t\t" << Total("", PROFILED_KERNEL) / 1000.0 << "\t\t" << Total("", PROFILED_TRANSFER) / 1000.0 << endl << endl;
+
+		sstream << "stage		command					queued [us]	wait [us]	start [us]	duration [us]	GB/s" << endl;
+		for (size_t i = 0; i < commands.size(); i++)
+		{
+			const ProfiledCommand& command = commands[i];
+			sstream << command.stage << "\t\t" << std::left << std::setw(24) << command.name << std::right << "\t";
+			sstream << (command.queued - origin) / 1000.0 << "\t\t" << (command.start - command.queued) / 1000.0 << "\t\t";
+			sstream << (command.start - origin) / 1000.0 << "\t\t" << (command.end - command.start) / 1000.0 << "\t\t" << Bandwidth(command) << endl;
+		}
+
+		return sstream.str();
+	}
+
+	// the same report as a JSON document, times in ns relative to the first queued command
+	string JsonReport() {
+		Collect();
+		stringstream sstream;
+
+		cl_ulong origin = Origin();
+		vector<string> stages = Stages();
+
+		sstream << "{" << endl << "\t\"stages\": [" << endl;
+		for (size_t s = 0; s < stages.size(); s++)
+		{
+			sstream << "\t\t{ \"name\": \"" << stages[s] << "\", \"launches\": " << Launches(stages[s]);
+			sstream << ", \"kernel_ns\": " << Total(stages[s], PROFILED_KERNEL) << ", \"transfer_ns\": " << Total(stages[s], PROFILED_TRANSFER);
+			sstream << ", \"host_ms\": " << HostTime(stages[s]) << " }" << (s + 1 < stages.size() ? "," : "") << endl;
+		}
+		sstream << "\t]," << endl;
+
+		sstream << "\t\"kernel_ns\": " << Total("", PROFILED_KERNEL) << "," << endl;
+		sstream << "\t\"transfer_ns\": " << Total("", PROFILED_TRANSFER) << "," << endl;
+
+		sstream << "\t\"commands\": [" << endl;
+		for (size_t i = 0; i < commands.size(); i++)
+		{
+			const ProfiledCommand& command = commands[i];
+			sstream << "\t\t{ \"stage\": \"" << command.stage << "\", \"name\": \"" << command.name << "\", \"kind\": \"";
+			sstream << (command.kind == PROFILED_KERNEL ? "kernel" : "transfer") << "\", \"queued\": " << command.queued - origin;
+			sstream << ", \"submit\": " << command.submit - origin << ", \"start\": " << command.start - origin << ", \"end\": " << command.end - origin;
+			sstream << ", \"bytes\": " << command.bytes << ", \"gbps\": " << JsonBandwidth(command) << " }" << (i + 1 < commands.size() ? "," : "") << endl;
+		}
+		sstream << "\t]" << endl << "}" << endl;
+
+		return sstream.str();
+	}
+
+	// Chrome trace_event JSON: the host phases on one track, the commands of every queue on a track of their own and
+	// the time each command waited between being queued and starting as an async slice, times in us from the start
+	string ChromeTrace() {
+		Collect();
+		stringstream sstream;
+		sstream << std::fixed << std::setprecision(3);
+
+		map<cl_command_queue, int> tracks;
+		for (size_t i = 0; i < commands.size(); i++)
+		{
+			cl_command_queue queue = commands[i].event.getInfo<CL_EVENT_COMMAND_QUEUE>()();
+			if (!tracks.count(queue))
+			{
+				int track = (int)tracks.size() + 1;
+				tracks[queue] = track;
+			}
+		}
+
+		sstream << "{" << endl << "\t\"displayTimeUnit\": \"ms\"," << endl << "\t\"traceEvents\": [" << endl;
+		sstream << "\t\t{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": { \"name\": \"host\" } }";
+
+		for (map<cl_command_queue, int>::const_iterator i = tracks.begin(); i != tracks.end(); i++)
+		{
+			sstream << "," << endl << "\t\t{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << i->second;
+			sstream << ", \"args\": { \"name\": \"queue " << i->second << "\" } }";
+		}
+
+		for (size_t i = 0; i < phases.size(); i++)
+		{
+			double start = TraceTime(phases[i].start);
+			sstream << "," << endl << "\t\t{ \"name\": \"" << phases[i].stage << "\", \"cat\": \"host\", \"ph\": \"X\", \"ts\": " << start;
+			sstream << ", \"dur\": " << TraceTime(phases[i].end) - start << ", \"pid\": 1, \"tid\": 0 }";
+		}
+
+		for (size_t i = 0; i < commands.size(); i++)
+		{
+			const ProfiledCommand& command = commands[i];
+			int track = tracks[command.event.getInfo<CL_EVENT_COMMAND_QUEUE>()()];
+			const char* category = command.kind == PROFILED_KERNEL ? "kernel" : "transfer";
+
+			sstream << "," << endl << "\t\t{ \"name\": \"" << command.name << "\", \"cat\": \"" << category << "\", \"ph\": \"X\", \"ts\": " << DeviceTraceTime(command.start);
+			sstream << ", \"dur\": " << (command.end - command.start) / 1000.0 << ", \"pid\": 1, \"tid\": " << track;
+			sstream << ", \"args\": { \"stage\": \"" << command.stage << "\", \"bytes\": " << command.bytes << ", \"GB/s\": \"" << Bandwidth(command) << "\" } }";
+
+			if (command.start > command.queued)
+			{
+				sstream << "," << endl << "\t\t{ \"name\": \"queued\", \"cat\": \"wait\", \"ph\": \"b\", \"id\": " << i << ", \"ts\": " << DeviceTraceTime(command.queued);
+				sstream << ", \"pid\": 1, \"tid\": " << track << ", \"args\": { \"command\": \"" << command.name << "\" } }";
+				sstream << "," << endl << "\t\t{ \"name\": \"queued\", \"cat\": \"wait\", \"ph\": \"e\", \"id\": " << i << ", \"ts\": " << DeviceTraceTime(command.start);
+				sstream << ", \"pid\": 1, \"tid\": " << track << " }";
+			}
+		}
+
+		sstream << endl << "\t]" << endl << "}" << endl;
+
+		return sstream.str();
+	}
+
+	const deque<ProfiledCommand>& Commands() {
+		Collect();
+		return commands;
+	}
+
+	const vector<ProfiledPhase>& Phases() const {
+		return phases;
+	}
+
+private:
+	friend class ProfileScope;
+
+	void Add(const string& name, ProfiledKind kind, const cl::Event& event, cl_ulong bytes) {
+		ProfiledCommand command;
+		command.stage = stage;
+		command.name = name;
+		command.kind = kind;
+		command.event = event;
+		command.bytes = bytes;
+		command.queued = command.submit = command.start = command.end = 0;
+		commands.push_back(command);
+	}
+
+	cl_ulong Origin() const {
+		cl_ulong origin = ~(cl_ulong)0;
+		for (size_t i = 0; i < commands.size(); i++)
+			origin = std::min(origin, commands[i].queued);
+		return commands.empty() ? 0 : origin;
+	}
+
+	// the stages in the order of their first command, host-only stages last
+	vector<string> Stages() const {
+		vector<string> stages;
+		for (size_t i = 0; i < commands.size(); i++)
+		{
+			if (std::find(stages.begin(), stages.end(), commands[i].stage) == stages.end())
+				stages.push_back(commands[i].stage);
+		}
+		for (size_t i = 0; i < phases.size(); i++)
+		{
+			if (std::find(stages.begin(), stages.end(), phases[i].stage) == stages.end())
+				stages.push_back(phases[i].stage);
+		}
+		return stages;
+	}
+
+	size_t Launches(const string& stage_name) const {
+		size_t launches = 0;
+		for (size_t i = 0; i < commands.size(); i++)
+		{
+			if (commands[i].stage == stage_name)
+				launches++;
+		}
+		return launches;
+	}
+
+	double HostTime(const string& stage_name) const {
+		double time = 0;
+		for (size_t i = 0; i < phases.size(); i++)
+		{
+			if (phases[i].stage == stage_name)
+				time += std::chrono::duration<double, std::milli>(phases[i].end - phases[i].start).count();
+		}
+		return time;
+	}
+
+	// us since the profiler was created
+	double TraceTime(std::chrono::high_resolution_clock::time_point time) const {
+		return std::chrono::duration<double, std::micro>(time - created).count();
+	}
+
+	// a device timestamp [ns] on the same axis as TraceTime
+	double DeviceTraceTime(cl_ulong time) const {
+		return TraceTime(host_sync) + ((double)time - (double)device_sync) / 1000.0;
+	}
+
+	// bytes per ns is GB/s
+	static string Bandwidth(const ProfiledCommand& command) {
+		if (!command.bytes || command.end <= command.start)
+			return "-";
+
+		stringstream sstream;
+		sstream << (double)command.bytes / (command.end - command.start);
+		return sstream.str();
+	}
+
+	// the same for the JSON report, null where the text reports show "-"
+	static string JsonBandwidth(const ProfiledCommand& command) {
+		string bandwidth = Bandwidth(command);
+		return bandwidth == "-" ? "null" : bandwidth;
+	}
+
+	string stage;
+	deque<ProfiledCommand> commands;
+	vector<ProfiledPhase> phases;
+	size_t collected_count;
+
+	std::chrono::high_resolution_clock::time_point created;
+	std::chrono::high_resolution_clock::time_point host_sync;
+	cl_ulong device_sync;
+};
+
+// makes stage the current stage of the profiler and times the host side of it, the previous stage is
+// restored when the scope is left (or at End for the stages that are not a block of their own)
+class ProfileScope {
+public:
+	ProfileScope(Profiler& profiler, const string& stage) : profiler(profiler), previous(profiler.stage), open(true) {
+		profiler.stage = stage;
+		phase.stage = stage;
+		phase.start = std::chrono::high_resolution_clock::now();
+	}
+
+	~ProfileScope() {
+		End();
+	}
+
+	void End() {
+		if (!open)
+			return;
+
+		phase.end = std::chrono::high_resolution_clock::now();
+		profiler.phases.push_back(phase);
+		profiler.stage = previous;
+		open = false;
+	}
+
+private:
+	ProfileScope(const ProfileScope&);
+	ProfileScope& operator=(const ProfileScope&);
+
+	Profiler& profiler;
+	string previous;
+	ProfiledPhase phase;
+	bool open;
+};
@@ -0,0 +1,413 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <limits>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "TempData.h"
+
+using namespace std;
+
+// ad-hoc queries: --select count,mean,p95 --where station=CRANWELL,year>=2000 --group-by month
+// every query is turned into one fused filter + group-by kernel whose source only depends on the shape of
+// the query (aggregates, predicate fields and comparisons, group key), the predicate values are kernel
+// arguments, so queries of the same shape share one compiled program
+
+// group keys of --group-by
+enum QueryGroup {
+	QGROUP_ALL = 0,
+	QGROUP_STATION = 1,
+	QGROUP_YEAR = 2,
+	QGROUP_MONTH = 3,
+	QGROUP_DAY = 4,
+	QGROUP_HOUR = 5
+};
+
+// percentiles are read from a per-group histogram of QUERY_BINS bins of QUERY_BIN_WIDTH degrees from QUERY_HIST_MIN
+const float QUERY_HIST_MIN = -50.0f;
+const float QUERY_BIN_WIDTH = 0.1f;
+const int QUERY_BINS = 1100;
+
+struct QuerySpec {
+	vector<string> select;
+	vector<Predicate> where;
+	int groupBy;
+	string text;
+	// the query as given on the command line, for the output
+
+	QuerySpec() : groupBy(QGROUP_ALL) {}
+};
+
+int ParseQueryGroup(const string& name) {
+	if (name == "all") return QGROUP_ALL;
+	if (name == "station") return QGROUP_STATION;
+	if (name == "year") return QGROUP_YEAR;
+	if (name == "month") return QGROUP_MONTH;
+	if (name == "day") return QGROUP_DAY;
+	if (name == "hour") return QGROUP_HOUR;
+	return -1;
+}
+
+// percentile of a pNN aggregate, -1 for the other aggregates
+int QueryPercentile(const string& aggregate) {
+	if (aggregate.size() < 2 || aggregate[0] != 'p')
+		return -1;
+
+	int p = atoi(aggregate.c_str() + 1);
+	return (p >= 1 && p <= 99) ? p : -1;
+}
+
+// comma separated aggregates: count, sum, mean, min, max, stddev and percentiles p1 .. p99
+bool ParseSelect(const string& text, vector<string>& select, string& error) {
+	stringstream sstream(text);
+	string aggregate;
+
+	while (getline(sstream, aggregate, ','))
+	{
+		if (aggregate != "count" && aggregate != "sum" && aggregate != "mean" && aggregate != "min" && aggregate != "max" &&
+			aggregate != "stddev" && QueryPercentile(aggregate) < 0)
+		{
+			error = "unknown aggregate " + aggregate;
+			return false;
+		}
+		select.push_back(aggregate);
+	}
+
+	return !select.empty();
+}
+
+bool QuerySelects(const QuerySpec& query, const string& aggregate) {
+	return find(query.select.begin(), query.select.end(), aggregate) != query.select.end();
+}
+
+bool QueryNeedsHistogram(const QuerySpec& query) {
+	for (unsigned int i = 0; i < query.select.size(); i++)
+	{
+		if (QueryPercentile(query.select[i]) >= 0)
+			return true;
+	}
+	return false;
+}
+
+int QueryGroupCount(int group, const TempColumns& columns) {
+	switch (group)
+	{
+	case QGROUP_STATION: return (int)columns.stationNames.size();
+	case QGROUP_YEAR: return columns.lastYear - columns.firstYear + 1;
+	case QGROUP_MONTH: return 12;
+	case QGROUP_DAY: return 366;
+	case QGROUP_HOUR: return 24;
+	default: return 1;
+	}
+}
+
+string QueryGroupLabel(int group, int g, const TempColumns& columns) {
+	stringstream sstream;
+
+	switch (group)
+	{
+	case QGROUP_STATION: sstream << columns.stationNames[g]; break;
+	case QGROUP_YEAR: sstream << columns.firstYear + g; break;
+	case QGROUP_MONTH: sstream << "month " << g + 1; break;
+	case QGROUP_DAY: sstream << "day " << g + 1; break;
+	case QGROUP_HOUR: sstream << setfill('0') << setw(2) << g << ":00"; break;
+	default: sstream << "all"; break;
+	}
+
+	return sstream.str();
+}
+
+// the SHARED HELPERS section of the kernel source (timestamp fields and float atomics), every generated query
+// program starts with it, so the queries always compile the same helpers as my_kernels_3.cl
+string QueryPrelude(const char* kernels, size_t size) {
+	string source(kernels, size);
+	const string begin = "// ********** SHARED HELPERS **********";
+	const string end = "// ********** END SHARED HELPERS **********";
+
+	size_t first = source.find(begin);
+	size_t last = source.find(end);
+	if (first == string::npos || last == string::npos || last < first)
+		throw cl::Error(CL_INVALID_PROGRAM, "QueryPrelude");
+
+	return source.substr(first, last - first);
+}
+
+// OpenCL C expression of a predicate field for the record (t, st, ts)
+string QueryFieldExpression(int field) {
+	switch (field)
+	{
+	case FIELD_STATION: return "(float)st";
+	case FIELD_TEMP: return "t";
+	case FIELD_YEAR: return "(float)ts_year(ts)";
+	case FIELD_MONTH: return "(float)ts_month(ts)";
+	case FIELD_DAY: return "(float)ts_day(ts)";
+	case FIELD_HOUR: return "(float)ts_hour(ts)";
+	default: return "(float)(ts >> 11)";
+	}
+}
+
+string QueryCompareOperator(int op) {
+	switch (op)
+	{
+	case CMP_EQ: return "==";
+	case CMP_NE: return "!=";
+	case CMP_LT: return "<";
+	case CMP_LE: return "<=";
+	case CMP_GT: return ">";
+	default: return ">=";
+	}
+}
+
+string QueryGroupExpression(int group) {
+	switch (group)
+	{
+	case QGROUP_STATION: return "st";
+	case QGROUP_YEAR: return "ts_year(ts) - firstYear";
+	case QGROUP_MONTH: return "ts_month(ts) - 1";
+	case QGROUP_DAY: return "ts_day_of_year(ts)";
+	case QGROUP_HOUR: return "ts_hour(ts)";
+	default: return "0";
+	}
+}
+
+// fused kernel "query": evaluates the predicates, accumulates the moments the aggregates need per group in
+// local memory (same layout as MOMENT_* in my_kernels_3.cl) and, for percentiles, a global histogram per group
+string GenerateQueryKernel(const QuerySpec& query, const string& prelude) {
+	bool need_sum = QuerySelects(query, "sum") || QuerySelects(query, "mean") || QuerySelects(query, "stddev");
+	bool need_sumsq = QuerySelects(query, "stddev");
+	bool need_min = QuerySelects(query, "min");
+	bool need_max = QuerySelects(query, "max");
+	bool need_histogram = QueryNeedsHistogram(query);
+
+	stringstream source;
+	source << fixed << setprecision(6);
+	// float constants need a decimal point to be float literals in OpenCL C
+	source << prelude;
+	source << "\nkernel void query(global const float* A, global const int* station, global const uint* timestamp, constant float* values,\n";
+	source << "	global float* stats, global int* counts, global int* hist, local float* lstats, local int* lcounts, int n, int firstYear, int nGroups)\n";
+	source << "{\n";
+	source << "	int id = get_global_id(0);\n";
+	source << "	int lid = get_local_id(0);\n";
+	source << "	int lN = get_local_size(0);\n\n";
+	source << "	for (int g = lid; g < nGroups; g += lN)\n";
+	source << "	{\n";
+	source << "		lstats[g * 4 + 0] = 0.0f;\n";
+	source << "		lstats[g * 4 + 1] = 0.0f;\n";
+	source << "		lstats[g * 4 + 2] = INFINITY;\n";
+	source << "		lstats[g * 4 + 3] = -INFINITY;\n";
+	source << "		lcounts[g] = 0;\n";
+	source << "	}\n\n";
+	source << "	barrier(CLK_LOCAL_MEM_FENCE);\n\n";
+	source << "	if (id < n)\n";
+	source << "	{\n";
+	source << "		float t = A[id];\n";
+	source << "		int st = station[id];\n";
+	source << "		uint ts = timestamp[id];\n\n";
+	source << "		if (1";
+	for (unsigned int i = 0; i < query.where.size(); i++)
+	{
+		source << " && (" << QueryFieldExpression(query.where[i].field) << " " << QueryCompareOperator(query.where[i].op) << " values[" << i << "])";
+	}
+	source << ")\n";
+	source << "		{\n";
+	source << "			int g = " << QueryGroupExpression(query.groupBy) << ";\n\n";
+	source << "			atomic_inc(&lcounts[g]);\n";
+	if (need_sum)
+		source << "			atomic_add_float_local(&lstats[g * 4 + 0], t);\n";
+	if (need_sumsq)
+		source << "			atomic_add_float_local(&lstats[g * 4 + 1], t * t);\n";
+	if (need_min)
+		source << "			atomic_min_float_local(&lstats[g * 4 + 2], t);\n";
+	if (need_max)
+		source << "			atomic_max_float_local(&lstats[g * 4 + 3], t);\n";
+	if (need_histogram)
+		source << "			atomic_inc(&hist[g * " << QUERY_BINS << " + clamp((int)((t - (" << QUERY_HIST_MIN << "f)) / " << QUERY_BIN_WIDTH << "f), 0, " << QUERY_BINS - 1 << ")]);\n";
+	source << "		}\n";
+	source << "	}\n\n";
+	source << "	barrier(CLK_LOCAL_MEM_FENCE);\n\n";
+	source << "	for (int g = lid; g < nGroups; g += lN)\n";
+	source << "	{\n";
+	source << "		if (lcounts[g])\n";
+	source << "		{\n";
+	source << "			atomic_add(&counts[g], lcounts[g]);\n";
+	if (need_sum)
+		source << "			atomic_add_float_global(&stats[g * 4 + 0], lstats[g * 4 + 0]);\n";
+	if (need_sumsq)
+		source << "			atomic_add_float_global(&stats[g * 4 + 1], lstats[g * 4 + 1]);\n";
+	if (need_min)
+		source << "			atomic_min_float_global(&stats[g * 4 + 2], lstats[g * 4 + 2]);\n";
+	if (need_max)
+		source << "			atomic_max_float_global(&stats[g * 4 + 3], lstats[g * 4 + 3]);\n";
+	source << "		}\n";
+	source << "	}\n";
+	source << "}\n";
+
+	return source.str();
+}
+
+// compiled query programs by source, i.e. by query shape
+typedef map<string, cl::Program> QueryProgramCache;
+
+// returns the program of the query shape from the in-memory cache, from the binary cache on disk
+// (see LoadProgramBinary in Utils.h) or builds it, built is set only when it had to be compiled from source
+cl::Program GetQueryProgram(const cl::Context& context, QueryProgramCache& cache, const string& source, bool& built) {
+	QueryProgramCache::iterator it = cache.find(source);
+	built = false;
+
+	if (it != cache.end())
+		return it->second;
+
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+
+	cl::Program::Sources sources;
+	sources.push_back(make_pair(source.c_str(), source.length() + 1));
+
+	string binary_file = "query." + ProgramCacheKey(sources, "", device) + ".bin";
+	cl::Program program;
+
+	if (!LoadProgramBinary(context, device, binary_file, "", program))
+	{
+		program = cl::Program(context, sources);
+
+		try
+		{
+			program.build();
+		}
+		catch (const cl::Error& err)
+		{
+			cout << "Query Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << endl;
+			throw err;
+		}
+
+		SaveProgramBinary(program, binary_file);
+		built = true;
+	}
+
+	cache[source] = program;
+	return program;
+}
+
+// value of the p-th percentile from a histogram of count readings, the centre of the bin holding it
+float HistogramPercentile(const vector<cl_int>& hist, size_t offset, int count, int p) {
+	int rank = (int)ceil(count * p / 100.0);
+	int seen = 0;
+
+	for (int b = 0; b < QUERY_BINS; b++)
+	{
+		seen += hist[offset + b];
+		if (seen >= rank)
+			return QUERY_HIST_MIN + (b + 0.5f) * QUERY_BIN_WIDTH;
+	}
+
+	return QUERY_HIST_MIN + QUERY_BINS * QUERY_BIN_WIDTH;
+}
+
+// one output row of a query group with the selected aggregates in order
+string FormatQueryRow(const QuerySpec& query, const string& label, const GroupStats& group, const vector<cl_int>& hist, size_t offset) {
+	stringstream sstream;
+	sstream << label;
+
+	for (unsigned int i = 0; i < query.select.size(); i++)
+	{
+		const string& aggregate = query.select[i];
+		sstream << "	" << aggregate << ": ";
+
+		if (aggregate == "count") sstream << group.count;
+		else if (aggregate == "sum") sstream << group.sum;
+		else if (aggregate == "mean") sstream << group.Mean();
+		else if (aggregate == "min") sstream << group.min;
+		else if (aggregate == "max") sstream << group.max;
+		else if (aggregate == "stddev") sstream << group.StdDev();
+		else sstream << HistogramPercentile(hist, offset, group.count, QueryPercentile(aggregate));
+	}
+
+	return sstream.str();
+}
+
+// runs one query over the first n records of the column buffers and returns its output rows
+// the per-group tables and histograms are tiny compared with the data, they are the only readback
+vector<string> RunQuery(const cl::Context& context, cl::CommandQueue& queue, BufferPool& pool, QueryProgramCache& cache, const string& prelude, const QuerySpec& query,
+	const cl::Buffer& temperature, const cl::Buffer& station, const cl::Buffer& timestamp, size_t n, size_t local_size,
+	const TempColumns& columns, bool& built, vector<cl::Event>* events = 0) {
+	cl::Program program = GetQueryProgram(context, cache, GenerateQueryKernel(query, prelude), built);
+
+	int nGroups = QueryGroupCount(query.groupBy, columns);
+	bool histogram = QueryNeedsHistogram(query);
+
+	vector<float> values(query.where.size() + 1, 0.0f);
+	// at least one value, an empty buffer cannot be created
+	for (unsigned int i = 0; i < query.where.size(); i++)
+		values[i] = query.where[i].value;
+
+	vector<float> stats(nGroups * MOMENTS);
+	vector<cl_int> counts(nGroups, 0);
+	vector<cl_int> hist(histogram ? nGroups * QUERY_BINS : 1, 0);
+
+	for (int g = 0; g < nGroups; g++)
+	{
+		stats[g * MOMENTS + 0] = 0.0f;
+		stats[g * MOMENTS + 1] = 0.0f;
+		stats[g * MOMENTS + 2] = numeric_limits<float>::infinity();
+		stats[g * MOMENTS + 3] = -numeric_limits<float>::infinity();
+	}
+
+	// queries of the same shape need the same sizes, so after the first one these come back from the pool
+	cl::Buffer buffer_values = pool.Acquire(values.size() * sizeof(float));
+	cl::Buffer buffer_stats = pool.Acquire(stats.size() * sizeof(float));
+	cl::Buffer buffer_counts = pool.Acquire(counts.size() * sizeof(cl_int));
+	cl::Buffer buffer_hist = pool.Acquire(hist.size() * sizeof(cl_int));
+
+	queue.enqueueWriteBuffer(buffer_values, CL_TRUE, 0, values.size() * sizeof(float), &values[0]);
+	queue.enqueueWriteBuffer(buffer_stats, CL_TRUE, 0, stats.size() * sizeof(float), &stats[0]);
+	queue.enqueueFillBuffer(buffer_counts, 0, 0, counts.size() * sizeof(cl_int));
+	queue.enqueueFillBuffer(buffer_hist, 0, 0, hist.size() * sizeof(cl_int));
+
+	cl::Kernel kernel_query = cl::Kernel(program, "query");
+	kernel_query.setArg(0, temperature);
+	kernel_query.setArg(1, station);
+	kernel_query.setArg(2, timestamp);
+	kernel_query.setArg(3, buffer_values);
+	kernel_query.setArg(4, buffer_stats);
+	kernel_query.setArg(5, buffer_counts);
+	kernel_query.setArg(6, buffer_hist);
+	kernel_query.setArg(7, cl::Local(nGroups * MOMENTS * sizeof(float)));
+	kernel_query.setArg(8, cl::Local(nGroups * sizeof(cl_int)));
+	kernel_query.setArg(9, (cl_int)n);
+	kernel_query.setArg(10, columns.firstYear);
+	kernel_query.setArg(11, nGroups);
+
+	cl::Event query_event;
+	queue.enqueueNDRangeKernel(kernel_query, cl::NullRange, cl::NDRange(((n + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), NULL, &query_event);
+	if (events)
+		events->push_back(query_event);
+
+	queue.enqueueReadBuffer(buffer_stats, CL_TRUE, 0, stats.size() * sizeof(float), &stats[0]);
+	queue.enqueueReadBuffer(buffer_counts, CL_TRUE, 0, counts.size() * sizeof(cl_int), &counts[0]);
+	if (histogram)
+		queue.enqueueReadBuffer(buffer_hist, CL_TRUE, 0, hist.size() * sizeof(cl_int), &hist[0]);
+
+	pool.Release(buffer_values);
+	pool.Release(buffer_stats);
+	pool.Release(buffer_counts);
+	pool.Release(buffer_hist);
+
+	vector<GroupStats> groups = ToGroupStats(stats, counts);
+	vector<string> rows;
+
+	for (int g = 0; g < nGroups; g++)
+	{
+		if (groups[g].count)
+			rows.push_back(FormatQueryRow(query, QueryGroupLabel(query.groupBy, g, columns), groups[g], hist, histogram ? g * QUERY_BINS : 0));
+	}
+
+	return rows;
+}
@@ -0,0 +1,752 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <fstream>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+using namespace std;
+
+// alignment of the host columns, page aligned memory can back a CL_MEM_USE_HOST_PTR buffer in place
+const size_t HOST_PAGE_SIZE = 4096;
+
+// allocator of page aligned blocks, the pointer malloc returned is kept just in front of the block
+template<typename T>
+struct PageAllocator {
+	typedef T value_type;
+
+	PageAllocator() {}
+	template<typename U> PageAllocator(const PageAllocator<U>&) {}
+
+	T* allocate(size_t n) {
+		char* block = (char*)malloc(n * sizeof(T) + HOST_PAGE_SIZE + sizeof(void*));
+		if (!block)
+			throw bad_alloc();
+
+		char* aligned = block + sizeof(void*);
+		aligned += (HOST_PAGE_SIZE - (size_t)aligned % HOST_PAGE_SIZE) % HOST_PAGE_SIZE;
+		((void**)aligned)[-1] = block;
+		return (T*)aligned;
+	}
+
+	void deallocate(T* p, size_t) {
+		free(((void**)p)[-1]);
+	}
+};
+
+template<typename T, typename U> bool operator==(const PageAllocator<T>&, const PageAllocator<U>&) { return true; }
+template<typename T, typename U> bool operator!=(const PageAllocator<T>&, const PageAllocator<U>&) { return false; }
+
+// column of values the device reads, see PageAllocator
+template<typename T> using HostColumn = vector<T, PageAllocator<T> >;
+
+// packed timestamp layout, ordered so that comparing two packed values compares them in time
+// bits: year [31..20], month [19..16], day [15..11], hour [10..6], minute [5..0]
+// the same layout is unpacked on the device by the ts_* helpers in my_kernels_3.cl
+cl_uint PackTimestamp(int year, int month, int day, int hhmm) {
+	int hour = hhmm / 100;
+	int minute = hhmm % 100;
+	return ((cl_uint)year << 20) | ((cl_uint)month << 16) | ((cl_uint)day << 11) | ((cl_uint)hour << 6) | (cl_uint)minute;
+}
+
+int TimestampYear(cl_uint ts) { return (int)(ts >> 20); }
+int TimestampMonth(cl_uint ts) { return (int)((ts >> 16) & 0xF); }
+int TimestampDay(cl_uint ts) { return (int)((ts >> 11) & 0x1F); }
+int TimestampHour(cl_uint ts) { return (int)((ts >> 6) & 0x1F); }
+int TimestampMinute(cl_uint ts) { return (int)(ts & 0x3F); }
+
+// e.g. "1996-12-16 09:50"
+string FormatTimestamp(cl_uint ts) {
+	stringstream sstream;
+	sstream << setfill('0') << setw(4) << TimestampYear(ts) << "-" << setw(2) << TimestampMonth(ts) << "-" << setw(2) << TimestampDay(ts);
+	sstream << " " << setw(2) << TimestampHour(ts) << ":" << setw(2) << TimestampMinute(ts);
+	return sstream.str();
+}
+
+// column store of the temperature file, one entry per record in each column
+// station names are replaced by their index in stationNames
+struct TempColumns {
+	vector<string> stationNames;
+	HostColumn<cl_int> station;
+	HostColumn<cl_uint> timestamp;
+	HostColumn<float> temperature;
+
+	// range of years in the timestamp column, used to size the calendar buckets
+	int firstYear;
+	int lastYear;
+
+	TempColumns() : firstYear(0), lastYear(-1) {}
+};
+
+int GetStationId(TempColumns& columns, const string& name) {
+	for (unsigned int i = 0; i < columns.stationNames.size(); i++)
+	{
+		if (columns.stationNames[i] == name)
+			return i;
+	}
+
+	columns.stationNames.push_back(name);
+	return (int)columns.stationNames.size() - 1;
+}
+
+// converts the words of the temperature file (6 per record) into columns
+// word order: station, year, month, day, time (HHMM), temperature
+void ParseTempColumns(const vector<string>& words, TempColumns& columns) {
+	for (unsigned int i = 5; i < words.size(); i += 6)
+	{
+		columns.station.push_back(GetStationId(columns, words[i - 5]));
+		columns.timestamp.push_back(PackTimestamp(atoi(words[i - 4].c_str()), atoi(words[i - 3].c_str()), atoi(words[i - 2].c_str()), atoi(words[i - 1].c_str())));
+		columns.temperature.push_back(strtof(words[i].c_str(), 0));
+
+		int year = TimestampYear(columns.timestamp.back());
+		if (columns.lastYear < columns.firstYear)
+		{
+			columns.firstYear = columns.lastYear = year;
+		}
+		columns.firstYear = min(columns.firstYear, year);
+		columns.lastYear = max(columns.lastYear, year);
+	}
+}
+
+// number of floats per group produced by the group-by kernels, see MOMENT_* in my_kernels_3.cl
+const int MOMENTS = 4;
+
+// summary of one group as produced by the group-by kernels
+struct GroupStats {
+	int count;
+	float sum;
+	float sumsq;
+	float min;
+	float max;
+
+	float Mean() const { return sum / count; }
+	float Variance() const { return sumsq / count - Mean() * Mean(); }
+	float StdDev() const { return sqrt(std::max(Variance(), 0.0f)); }
+};
+
+// unpacks the stats[group * MOMENTS + m] and counts[group] tables read back from the device
+vector<GroupStats> ToGroupStats(const vector<float>& stats, const vector<cl_int>& counts) {
+	vector<GroupStats> groups(counts.size());
+
+	for (unsigned int i = 0; i < counts.size(); i++)
+	{
+		groups[i].count = counts[i];
+		groups[i].sum = stats[i * MOMENTS + 0];
+		groups[i].sumsq = stats[i * MOMENTS + 1];
+		groups[i].min = stats[i * MOMENTS + 2];
+		groups[i].max = stats[i * MOMENTS + 3];
+	}
+
+	return groups;
+}
+
+// one row of a group-by result table
+string FormatGroupStats(const string& label, const GroupStats& group) {
+	stringstream sstream;
+	sstream << label << "	count: " << group.count << "	mean: " << group.Mean() << "	std dev: " << group.StdDev();
+	sstream << "	min: " << group.min << "	max: " << group.max;
+	return sstream.str();
+}
+
+// keys of the calendar group-by, values match KEY_* in my_kernels_3.cl
+enum CalendarKey {
+	KEY_YEAR = 0,
+	KEY_YEAR_MONTH = 1,
+	KEY_DAY_OF_YEAR = 2,
+	KEY_HOUR = 3
+};
+
+// -g option names of the calendar keys, -1 if the name is unknown
+int ParseCalendarKey(const string& name) {
+	if (name == "year") return KEY_YEAR;
+	if (name == "month") return KEY_YEAR_MONTH;
+	if (name == "day") return KEY_DAY_OF_YEAR;
+	if (name == "hour") return KEY_HOUR;
+	return -1;
+}
+
+// number of dense buckets of a calendar key
+int CalendarBucketCount(int key, const TempColumns& columns) {
+	int years = columns.lastYear - columns.firstYear + 1;
+
+	switch (key)
+	{
+	case KEY_YEAR: return years;
+	case KEY_YEAR_MONTH: return years * 12;
+	case KEY_DAY_OF_YEAR: return 366;
+	default: return 24;
+	}
+}
+
+// row label of a calendar bucket, e.g. "1996-12" for KEY_YEAR_MONTH
+string CalendarBucketLabel(int key, int bucket, const TempColumns& columns) {
+	stringstream sstream;
+
+	switch (key)
+	{
+	case KEY_YEAR: sstream << columns.firstYear + bucket; break;
+	case KEY_YEAR_MONTH: sstream << columns.firstYear + bucket / 12 << "-" << setfill('0') << setw(2) << bucket % 12 + 1; break;
+	case KEY_DAY_OF_YEAR: sstream << "day " << bucket + 1; break;
+	default: sstream << setfill('0') << setw(2) << bucket << ":00"; break;
+	}
+
+	return sstream.str();
+}
+
+// composite keys of the hash group-by, values match HKEY_* in my_kernels_3.cl
+enum HashKey {
+	HKEY_STATION = 0,
+	HKEY_STATION_YEAR = 1,
+	HKEY_STATION_YEAR_MONTH = 2,
+	HKEY_STATION_DATE = 3
+};
+
+// -G option names of the composite keys, -1 if the name is unknown
+int ParseHashKey(const string& name) {
+	if (name == "station") return HKEY_STATION;
+	if (name == "station-year") return HKEY_STATION_YEAR;
+	if (name == "station-month") return HKEY_STATION_YEAR_MONTH;
+	if (name == "station-date") return HKEY_STATION_DATE;
+	return -1;
+}
+
+// upper bound of the number of groups of a composite key
+size_t HashGroupBound(int key, const TempColumns& columns) {
+	size_t stations = columns.stationNames.size();
+	size_t years = columns.lastYear - columns.firstYear + 1;
+
+	switch (key)
+	{
+	case HKEY_STATION: return stations;
+	case HKEY_STATION_YEAR: return stations * years;
+	case HKEY_STATION_YEAR_MONTH: return stations * years * 12;
+	default: return stations * years * 366;
+	}
+}
+
+// row label of a composite key as built by composite_key in my_kernels_3.cl, e.g. "CRANWELL 1996-12-16"
+string HashKeyLabel(int key, cl_uint value, const TempColumns& columns) {
+	stringstream sstream;
+	cl_uint ts = value << 11;
+	// shifting the date part back into place drops the station bits
+
+	sstream << columns.stationNames[value >> 21];
+	if (key != HKEY_STATION)
+		sstream << " " << setfill('0') << setw(4) << TimestampYear(ts);
+	if (key == HKEY_STATION_YEAR_MONTH || key == HKEY_STATION_DATE)
+		sstream << "-" << setw(2) << TimestampMonth(ts);
+	if (key == HKEY_STATION_DATE)
+		sstream << "-" << setw(2) << TimestampDay(ts);
+
+	return sstream.str();
+}
+
+// size of the seg_float/seg_int (head flag, value) pairs of the segmented scans in my_kernels_3.cl
+const size_t SEG_PAIR_SIZE = 2 * sizeof(cl_int);
+
+// thresholds of the streak detection [degree Celsius]
+const float HEATWAVE_THRESHOLD = 25.0f;
+const float COLD_STREAK_THRESHOLD = 0.0f;
+
+// one run of consecutive qualifying days as emitted by emit_runs
+struct Streak {
+	int station;
+	cl_uint start;
+	int length;
+	float peak;
+};
+
+// fields and comparisons of the -f filter, values match FIELD_* and CMP_* in my_kernels_3.cl
+enum FilterField {
+	FIELD_STATION = 0,
+	FIELD_TEMP = 1,
+	FIELD_YEAR = 2,
+	FIELD_MONTH = 3,
+	FIELD_DAY = 4,
+	FIELD_HOUR = 5,
+	FIELD_DATE = 6
+};
+
+enum FilterCompare {
+	CMP_EQ = 0,
+	CMP_NE = 1,
+	CMP_LT = 2,
+	CMP_LE = 3,
+	CMP_GT = 4,
+	CMP_GE = 5
+};
+
+// one "field op value" term of the filter, same layout as the predicate struct on the device
+struct Predicate {
+	cl_int field;
+	cl_int op;
+	float value;
+};
+
+int ParseFilterField(const string& name) {
+	if (name == "station") return FIELD_STATION;
+	if (name == "temp") return FIELD_TEMP;
+	if (name == "year") return FIELD_YEAR;
+	if (name == "month") return FIELD_MONTH;
+	if (name == "day") return FIELD_DAY;
+	if (name == "hour") return FIELD_HOUR;
+	if (name == "date") return FIELD_DATE;
+	return -1;
+}
+
+int ParseFilterCompare(const string& op) {
+	if (op == "=" || op == "==") return CMP_EQ;
+	if (op == "!=") return CMP_NE;
+	if (op == "<") return CMP_LT;
+	if (op == "<=") return CMP_LE;
+	if (op == ">") return CMP_GT;
+	if (op == ">=") return CMP_GE;
+	return -1;
+}
+
+// parses a comma separated list of predicates that must all hold, e.g. "station=CONINGSBY,month>=6,month<=8,temp>25"
+// dates are written as YYYY-MM-DD and compared as the date part of the packed timestamp
+// returns false and leaves an error message in error if a term cannot be parsed
+bool ParsePredicates(const string& text, const TempColumns& columns, vector<Predicate>& predicates, string& error) {
+	stringstream terms(text);
+	string term;
+
+	while (getline(terms, term, ','))
+	{
+		size_t op_start = term.find_first_of("<>=!");
+		size_t op_end = term.find_first_not_of("<>=!", op_start);
+
+		if (op_start == string::npos || op_start == 0 || op_end == string::npos)
+		{
+			error = "expected field, comparison and value in \"" + term + "\"";
+			return false;
+		}
+
+		string name = term.substr(0, op_start);
+		string value = term.substr(op_end);
+
+		Predicate predicate;
+		predicate.field = ParseFilterField(name);
+		predicate.op = ParseFilterCompare(term.substr(op_start, op_end - op_start));
+
+		if (predicate.field < 0 || predicate.op < 0)
+		{
+			error = "unknown field or comparison in \"" + term + "\"";
+			return false;
+		}
+
+		if (predicate.field == FIELD_STATION)
+		{
+			vector<string>::const_iterator it = find(columns.stationNames.begin(), columns.stationNames.end(), value);
+			predicate.value = (it == columns.stationNames.end()) ? -1.0f : (float)(it - columns.stationNames.begin());
+			// an unknown station selects nothing
+		}
+		else if (predicate.field == FIELD_DATE)
+		{
+			int year, month, day;
+			if (sscanf(value.c_str(), "%d-%d-%d", &year, &month, &day) != 3 || month < 1 || month > 12 || day < 1 || day > 31)
+			{
+				error = "expected a YYYY-MM-DD date in \"" + term + "\"";
+				return false;
+			}
+			predicate.value = (float)(PackTimestamp(year, month, day, 0) >> 11);
+		}
+		else
+		{
+			char* end = 0;
+			predicate.value = strtof(value.c_str(), &end);
+			if (end == value.c_str() || *end != '\0')
+			{
+				error = "expected a number in \"" + term + "\"";
+				return false;
+			}
+		}
+
+		predicates.push_back(predicate);
+	}
+
+	return true;
+}
+
+// records per block of the zone maps
+const int ZONE_BLOCK = 65536;
+
+// how a block relates to the filter, from its zone map alone
+enum ZoneClass {
+	ZONE_SKIP = 0,		// no record can match
+	ZONE_FULL = 1,		// every record matches
+	ZONE_PARTIAL = 2	// has to be scanned
+};
+
+// combines the summaries of two disjoint sets of records
+GroupStats MergeGroupStats(const GroupStats& a, const GroupStats& b) {
+	if (!a.count) return b;
+	if (!b.count) return a;
+
+	GroupStats merged;
+	merged.count = a.count + b.count;
+	merged.sum = a.sum + b.sum;
+	merged.sumsq = a.sumsq + b.sumsq;
+	merged.min = std::min(a.min, b.min);
+	merged.max = std::max(a.max, b.max);
+	return merged;
+}
+
+// classifies one block from its temperature summary and timestamp range [first, last]
+// only temp, year and date are ordered with what the zone map covers, the other fields make a block partial
+int ClassifyZone(const GroupStats& zone, cl_uint first, cl_uint last, const vector<Predicate>& predicates) {
+	if (!zone.count)
+		return ZONE_SKIP;
+
+	bool full = true;
+
+	for (unsigned int i = 0; i < predicates.size(); i++)
+	{
+		float lo, hi, v = predicates[i].value;
+
+		switch (predicates[i].field)
+		{
+		case FIELD_TEMP: lo = zone.min; hi = zone.max; break;
+		case FIELD_YEAR: lo = (float)TimestampYear(first); hi = (float)TimestampYear(last); break;
+		case FIELD_DATE: lo = (float)(first >> 11); hi = (float)(last >> 11); break;
+		default: full = false; continue;
+		}
+
+		bool never, always;
+		switch (predicates[i].op)
+		{
+		case CMP_EQ: never = v < lo || v > hi; always = lo == v && hi == v; break;
+		case CMP_NE: never = lo == v && hi == v; always = v < lo || v > hi; break;
+		case CMP_LT: never = lo >= v; always = hi < v; break;
+		case CMP_LE: never = lo > v; always = hi <= v; break;
+		case CMP_GT: never = hi <= v; always = lo > v; break;
+		default: never = hi < v; always = lo >= v; break;
+		}
+
+		if (never)
+			return ZONE_SKIP;
+		full = full && always;
+	}
+
+	return full ? ZONE_FULL : ZONE_PARTIAL;
+}
+
+// FNV-1a hash of the first count records, identifies the data a persisted index or cube was built for
+cl_uint ColumnsChecksum(const TempColumns& columns, size_t count) {
+	cl_uint hash = 2166136261u;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		cl_uint temperature;
+		memcpy(&temperature, &columns.temperature[i], sizeof(temperature));
+
+		hash = (hash ^ (cl_uint)columns.station[i]) * 16777619u;
+		hash = (hash ^ columns.timestamp[i]) * 16777619u;
+		hash = (hash ^ temperature) * 16777619u;
+	}
+
+	return hash;
+}
+
+// the (station, timestamp) order of the records is stored next to the data file as
+// record count, columns checksum and the permutation itself
+bool LoadTimeIndex(const string& file_name, const TempColumns& columns, vector<cl_int>& order) {
+	ifstream file(file_name.c_str(), ios::binary);
+	cl_uint count = 0, checksum = 0;
+
+	if (!file.read((char*)&count, sizeof(count)) || !file.read((char*)&checksum, sizeof(checksum)))
+		return false;
+
+	if (count != columns.timestamp.size() || checksum != ColumnsChecksum(columns, count))
+		return false;
+	// stale index of a different data file
+
+	order.resize(count);
+	return count && file.read((char*)&order[0], count * sizeof(cl_int));
+}
+
+void SaveTimeIndex(const string& file_name, const TempColumns& columns, const vector<cl_int>& order) {
+	ofstream file(file_name.c_str(), ios::binary);
+	cl_uint count = (cl_uint)order.size();
+	cl_uint checksum = ColumnsChecksum(columns, order.size());
+
+	file.write((const char*)&count, sizeof(count));
+	file.write((const char*)&checksum, sizeof(checksum));
+	if (count)
+		file.write((const char*)&order[0], count * sizeof(cl_int));
+}
+
+// zone maps of the first rows records, one summary and timestamp range per ZONE_BLOCK records
+// stored next to the data file like the cube, while rows are only appended every block but the last stays valid
+struct ZoneMaps {
+	cl_uint rows;
+	cl_uint checksum;
+	vector<GroupStats> blocks;
+	vector<cl_uint> time;	// first and last timestamp of every block
+
+	ZoneMaps() : rows(0), checksum(0) {}
+};
+
+bool LoadZoneMaps(const string& file_name, const TempColumns& columns, ZoneMaps& zones) {
+	ifstream file(file_name.c_str(), ios::binary);
+	cl_int block_size = 0;
+
+	if (!file.read((char*)&zones.rows, sizeof(zones.rows)) || !file.read((char*)&zones.checksum, sizeof(zones.checksum)) ||
+		!file.read((char*)&block_size, sizeof(block_size)))
+		return false;
+
+	if (block_size != ZONE_BLOCK || zones.rows > columns.timestamp.size() || zones.checksum != ColumnsChecksum(columns, zones.rows))
+		return false;
+
+	size_t count = (zones.rows + ZONE_BLOCK - 1) / ZONE_BLOCK;
+	zones.blocks.resize(count);
+	zones.time.resize(2 * count);
+
+	if (count)
+	{
+		file.read((char*)&zones.blocks[0], count * sizeof(GroupStats));
+		file.read((char*)&zones.time[0], zones.time.size() * sizeof(cl_uint));
+	}
+	return !file.fail();
+}
+
+void SaveZoneMaps(const string& file_name, const ZoneMaps& zones) {
+	ofstream file(file_name.c_str(), ios::binary);
+	cl_int block_size = ZONE_BLOCK;
+
+	file.write((const char*)&zones.rows, sizeof(zones.rows));
+	file.write((const char*)&zones.checksum, sizeof(zones.checksum));
+	file.write((const char*)&block_size, sizeof(block_size));
+	if (!zones.blocks.empty())
+	{
+		file.write((const char*)&zones.blocks[0], zones.blocks.size() * sizeof(GroupStats));
+		file.write((const char*)&zones.time[0], zones.time.size() * sizeof(cl_uint));
+	}
+}
+
+// -t option, a station and an inclusive date range, e.g. "CRANWELL,1990-01-01,1990-12-31"
+struct TimeRange {
+	int station;
+	cl_uint first;
+	cl_uint last;
+};
+
+bool ParseTimeRange(const string& text, const TempColumns& columns, TimeRange& range) {
+	stringstream sstream(text);
+	string name, from, to;
+
+	if (!getline(sstream, name, ',') || !getline(sstream, from, ',') || !getline(sstream, to, ','))
+		return false;
+
+	vector<string>::const_iterator it = find(columns.stationNames.begin(), columns.stationNames.end(), name);
+	if (it == columns.stationNames.end())
+		return false;
+
+	int year, month, day;
+	if (sscanf(from.c_str(), "%d-%d-%d", &year, &month, &day) != 3 || month < 1 || month > 12 || day < 1 || day > 31)
+		return false;
+	range.first = PackTimestamp(year, month, day, 0);
+
+	if (sscanf(to.c_str(), "%d-%d-%d", &year, &month, &day) != 3 || month < 1 || month > 12 || day < 1 || day > 31)
+		return false;
+	range.last = PackTimestamp(year, month, day, 2359);
+	range.station = (int)(it - columns.stationNames.begin());
+
+	return range.first <= range.last;
+}
+
+// bitmaps of the bitmap index, see build_bitmaps in my_kernels_3.cl: one per station, month and hour of day
+size_t BitmapCount(const TempColumns& columns) {
+	return columns.stationNames.size() + 12 + 24;
+}
+
+// parses a -m query such as "station=CRANWELL,month=6|7|8,hour=12" into the clauses of combine_bitmaps
+// the values of one term are OR-ed, the terms are AND-ed
+bool ParseBitmapQuery(const string& text, const TempColumns& columns, vector<cl_int>& ids, vector<cl_int>& clauseStart, string& error) {
+	stringstream terms(text);
+	string term;
+	int nStations = (int)columns.stationNames.size();
+
+	clauseStart.assign(1, 0);
+
+	while (getline(terms, term, ','))
+	{
+		size_t eq = term.find('=');
+		if (eq == string::npos)
+		{
+			error = "expected field=value[|value...] in \"" + term + "\"";
+			return false;
+		}
+
+		string name = term.substr(0, eq);
+		stringstream values(term.substr(eq + 1));
+		string value;
+
+		while (getline(values, value, '|'))
+		{
+			if (name == "station")
+			{
+				vector<string>::const_iterator it = find(columns.stationNames.begin(), columns.stationNames.end(), value);
+				if (it == columns.stationNames.end())
+				{
+					error = "unknown station " + value;
+					return false;
+				}
+				ids.push_back((cl_int)(it - columns.stationNames.begin()));
+			}
+			else if (name == "month" && atoi(value.c_str()) >= 1 && atoi(value.c_str()) <= 12)
+			{
+				ids.push_back(nStations + atoi(value.c_str()) - 1);
+			}
+			else if (name == "hour" && atoi(value.c_str()) >= 0 && atoi(value.c_str()) <= 23)
+			{
+				ids.push_back(nStations + 12 + atoi(value.c_str()));
+			}
+			else
+			{
+				error = "unknown field or value in \"" + term + "\"";
+				return false;
+			}
+		}
+
+		clauseStart.push_back((cl_int)ids.size());
+	}
+
+	return true;
+}
+
+// unpacks GroupStats back into the stats[group * MOMENTS + m] and counts[group] tables of the device
+void FromGroupStats(const vector<GroupStats>& groups, vector<float>& stats, vector<cl_int>& counts) {
+	stats.resize(groups.size() * MOMENTS);
+	counts.resize(groups.size());
+
+	for (unsigned int i = 0; i < groups.size(); i++)
+	{
+		counts[i] = groups[i].count;
+		stats[i * MOMENTS + 0] = groups[i].sum;
+		stats[i * MOMENTS + 1] = groups[i].sumsq;
+		stats[i * MOMENTS + 2] = groups[i].min;
+		stats[i * MOMENTS + 3] = groups[i].max;
+	}
+}
+
+// moments of every station, year and month, cell (station * years + year - firstYear) * 12 + month - 1
+// rows and checksum identify the prefix of the data file the cube covers, so appended rows can be added to it
+struct AggregateCube {
+	cl_uint rows;
+	cl_uint checksum;
+	int stations;
+	int firstYear;
+	int years;
+	vector<GroupStats> cells;
+
+	AggregateCube() : rows(0), checksum(0), stations(0), firstYear(0), years(0) {}
+};
+
+// a stored cube is only usable if the data starts with the rows it covers and has the same dimensions
+bool LoadCube(const string& file_name, const TempColumns& columns, AggregateCube& cube) {
+	ifstream file(file_name.c_str(), ios::binary);
+
+	if (!file.read((char*)&cube.rows, sizeof(cube.rows)) || !file.read((char*)&cube.checksum, sizeof(cube.checksum)) ||
+		!file.read((char*)&cube.stations, sizeof(cube.stations)) || !file.read((char*)&cube.firstYear, sizeof(cube.firstYear)) ||
+		!file.read((char*)&cube.years, sizeof(cube.years)))
+		return false;
+
+	if (cube.rows > columns.timestamp.size() || cube.checksum != ColumnsChecksum(columns, cube.rows) ||
+		cube.stations != (int)columns.stationNames.size() || cube.firstYear != columns.firstYear ||
+		cube.years != columns.lastYear - columns.firstYear + 1)
+		return false;
+	// new stations or years change the layout, the cube is then rebuilt
+
+	size_t cells = (size_t)cube.stations * cube.years * 12;
+	streampos start = file.tellg();
+	file.seekg(0, ios::end);
+	if (file.tellg() - start != (streamoff)(cells * sizeof(GroupStats)))
+		return false;
+	// truncated or written for other dimensions
+	file.seekg(start);
+
+	cube.cells.resize(cells);
+	if (cells)
+		file.read((char*)&cube.cells[0], cells * sizeof(GroupStats));
+	return !file.fail();
+}
+
+void SaveCube(const string& file_name, const AggregateCube& cube) {
+	ofstream file(file_name.c_str(), ios::binary);
+
+	file.write((const char*)&cube.rows, sizeof(cube.rows));
+	file.write((const char*)&cube.checksum, sizeof(cube.checksum));
+	file.write((const char*)&cube.stations, sizeof(cube.stations));
+	file.write((const char*)&cube.firstYear, sizeof(cube.firstYear));
+	file.write((const char*)&cube.years, sizeof(cube.years));
+	if (!cube.cells.empty())
+		file.write((const char*)&cube.cells[0], cube.cells.size() * sizeof(GroupStats));
+}
+
+// roll-ups of the cube for the -c option
+enum CubeRollUp {
+	ROLLUP_STATION_YEAR_MONTH = 0,
+	ROLLUP_STATION_YEAR = 1,
+	ROLLUP_STATION = 2,
+	ROLLUP_YEAR_MONTH = 3,
+	ROLLUP_YEAR = 4
+};
+
+int ParseCubeRollUp(const string& name) {
+	if (name == "station-month") return ROLLUP_STATION_YEAR_MONTH;
+	if (name == "station-year") return ROLLUP_STATION_YEAR;
+	if (name == "station") return ROLLUP_STATION;
+	if (name == "month") return ROLLUP_YEAR_MONTH;
+	if (name == "year") return ROLLUP_YEAR;
+	return -1;
+}
+
+// merges the cube cells into the groups of a roll-up, e.g. the annual summary of every station for ROLLUP_STATION_YEAR
+void RollUpCube(const AggregateCube& cube, const TempColumns& columns, int rollup, vector<string>& labels, vector<GroupStats>& groups) {
+	for (int s = 0; s < cube.stations; s++)
+	{
+		for (int y = 0; y < cube.years; y++)
+		{
+			for (int m = 0; m < 12; m++)
+			{
+				const GroupStats& cell = cube.cells[(s * cube.years + y) * 12 + m];
+				if (!cell.count)
+					continue;
+
+				stringstream sstream;
+				size_t group;
+
+				switch (rollup)
+				{
+				case ROLLUP_STATION_YEAR_MONTH: group = (s * cube.years + y) * 12 + m; sstream << columns.stationNames[s] << " " << cube.firstYear + y << "-" << setfill('0') << setw(2) << m + 1; break;
+				case ROLLUP_STATION_YEAR: group = s * cube.years + y; sstream << columns.stationNames[s] << " " << cube.firstYear + y; break;
+				case ROLLUP_STATION: group = s; sstream << columns.stationNames[s]; break;
+				case ROLLUP_YEAR_MONTH: group = y * 12 + m; sstream << cube.firstYear + y << "-" << setfill('0') << setw(2) << m + 1; break;
+				default: group = y; sstream << cube.firstYear + y; break;
+				}
+
+				if (group >= groups.size())
+				{
+					groups.resize(group + 1, GroupStats());
+					labels.resize(group + 1);
+				}
+				groups[group] = MergeGroupStats(groups[group], cell);
+				labels[group] = sstream.str();
+			}
+		}
+	}
+}
@@ -1,10 +1,12 @@
-#pragma comment(lib, "OpenCl.lib")
+﻿#pragma comment(lib, "OpenCl.lib")
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #define __CL_ENABLE_EXCEPTIONS
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <chrono>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.hpp>
@@ -13,6 +15,12 @@
 #endif
 
 #include "Utils.h"
+#include "TempData.h"
+#include "Query.h"
+#include "MultiDevice.h"
+#include "Profiler.h"
+#include "my_kernels_3.cl.h"
+// MY_KERNELS_3_CL, generated from my_kernels_3.cl by its custom build step
 
 void print_help() 
 {
@@ -21,6 +29,26 @@ void print_help()
 	std::cerr << "  -p : select platform " << std::endl;
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -k : number of hottest/coldest readings to list (default 10)" << std::endl;
+	std::cerr << "  -g : group the statistics by year, month, day (of year) or hour" << std::endl;
+	std::cerr << "  -G : group the statistics by station, station-year, station-month or station-date (hash table)" << std::endl;
+	std::cerr << "  -w : rolling mean/min/max over windows of this many readings per station (e.g. 24 or 720 for hourly data)" << std::endl;
+	std::cerr << "  -r : find runs of consecutive days above 25 C (heatwaves) and below 0 C (cold streaks)" << std::endl;
+	std::cerr << "  -f : only analyse the readings matching all predicates, e.g. station=CONINGSBY,month>=6,month<=8,temp>25" << std::endl;
+	std::cerr << "       fields: station, temp, year, month, day, hour, date (YYYY-MM-DD), comparisons: = != < <= > >=" << std::endl;
+	std::cerr << "  -t : statistics of one station over an inclusive date range, e.g. CRANWELL,1990-01-01,1990-12-31" << std::endl;
+	std::cerr << "  -m : statistics of the readings selected by the station/month/hour bitmaps, e.g. station=CRANWELL,month=6|7|8,hour=12" << std::endl;
+	std::cerr << "  -c : roll-up of the stored station x year x month cube: station-month, station-year, station, month or year" << std::endl;
+	std::cerr << "  --select : ad-hoc query compiled into its own kernel, aggregates count, sum, mean, min, max, stddev, p1..p99" << std::endl;
+	std::cerr << "  --where : predicates of the query in the -f syntax, e.g. station=CRANWELL,year>=2000" << std::endl;
+	std::cerr << "  --group-by : group key of the query: all, station, year, month, day or hour" << std::endl;
+	std::cerr << "       e.g. --select mean,p95 --where station=CRANWELL,year>=2000 --group-by month, repeat --select for more queries" << std::endl;
+	std::cerr << "  -a : compute the per-station statistics on several devices at once, all or a list such as 0:0,1:0" << std::endl;
+	std::cerr << "       the records are split by the throughput of each device and the partial results merged on the host" << std::endl;
+	std::cerr << "  -o : run the average, max, min and standard deviation reductions as an event DAG on an out-of-order queue" << std::endl;
+	std::cerr << "  -j : write the per-stage profiling report as JSON to this file" << std::endl;
+	std::cerr << "  --trace : write a Chrome trace_event file of the host phases and queue commands, open it in ui.perfetto.dev" << std::endl;
+	std::cerr << "  -s : rank the hottest/coldest readings with a full device argsort instead of the top-k reduction" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
@@ -29,6 +57,25 @@ int main(int argc, char **argv)
 	//Part 1 - handle command line options such as device selection, verbosity, etc.
 	int platform_id = 0;
 	int device_id = 0;
+	int top_k = 10;
+	bool full_sort = false;
+	int calendar_key = -1;
+	int hash_key = -1;
+	int window = 0;
+	bool streaks = false;
+	string filter;
+	string time_range;
+	string bitmap_query;
+	int cube_rollup = -1;
+	string multi_device;
+	bool out_of_order = false;
+	string profile_file;
+	string trace_file;
+	std::vector<QuerySpec> queries;
+	std::vector<string> query_select;
+	std::vector<string> query_where;
+	std::vector<string> query_group;
+	// every --select starts a new query, --where and --group-by apply to the last one
 
 	for (int i = 1; i < argc; i++)	
 	{
@@ -40,6 +87,76 @@ int main(int argc, char **argv)
 		{ 
 			device_id = atoi(argv[++i]); 
 		}
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1)))
+		{
+			top_k = std::max(1, atoi(argv[++i]));
+		}
+		else if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1)))
+		{
+			calendar_key = ParseCalendarKey(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-G") == 0) && (i < (argc - 1)))
+		{
+			hash_key = ParseHashKey(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1)))
+		{
+			window = atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1)))
+		{
+			filter = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-t") == 0) && (i < (argc - 1)))
+		{
+			time_range = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1)))
+		{
+			bitmap_query = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1)))
+		{
+			cube_rollup = ParseCubeRollUp(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "-a") == 0) && (i < (argc - 1)))
+		{
+			multi_device = argv[++i];
+		}
+		else if ((strcmp(argv[i], "-j") == 0) && (i < (argc - 1)))
+		{
+			profile_file = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--trace") == 0) && (i < (argc - 1)))
+		{
+			trace_file = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--select") == 0) && (i < (argc - 1)))
+		{
+			query_select.push_back(argv[++i]);
+			query_where.push_back("");
+			query_group.push_back("all");
+		}
+		else if ((strcmp(argv[i], "--where") == 0) && (i < (argc - 1)) && !query_select.empty())
+		{
+			query_where.back() = argv[++i];
+		}
+		else if ((strcmp(argv[i], "--group-by") == 0) && (i < (argc - 1)) && !query_select.empty())
+		{
+			query_group.back() = argv[++i];
+		}
+		else if (strcmp(argv[i], "-r") == 0)
+		{
+			streaks = true;
+		}
+		else if (strcmp(argv[i], "-s") == 0)
+		{
+			full_sort = true;
+		}
+		else if (strcmp(argv[i], "-o") == 0)
+		{
+			out_of_order = true;
+		}
 		else if (strcmp(argv[i], "-l") == 0) 
 		{ 
 			std::cout << ListPlatformsDevices() << std::endl; 
@@ -50,12 +167,16 @@ int main(int argc, char **argv)
 		}
 	}
 
+	Profiler profiler;
+	// every command is recorded with the stage it belongs to, reported at the end
+
 	//reading file in
+	ProfileScope parse_scope(profiler, "PARSE");
 	fstream file;
 	string fileDir, word;
 
 	std::vector<string> tempInfoString;
-	std::vector<float> tempInfo;
+	TempColumns columns;
 
 	//fileDir = "C:\\Users\\Student\\Desktop\\OpenCL- Assignment\\temp_lincolnshire_short.txt";
 	fileDir = "C:\\Users\\Student\\Desktop\\OpenCL- Assignment\\temp_lincolnshire.txt";
@@ -68,20 +189,85 @@ int main(int argc, char **argv)
 		// reading each word into a vector
 	}
 
-	for (int i = 5; i < tempInfoString.size(); i += 6)
-	{
-		tempInfo.push_back(strtof((tempInfoString[i]).c_str(), 0));
-		// taking only the temp floats and adding them to another vector
-		// converting to float
-	}
+	ParseTempColumns(tempInfoString, columns);
+	// splitting the words into station, timestamp and temperature columns
+	parse_scope.End();
+
+	HostColumn<float>& tempInfo = columns.temperature;
+	// taking only the temp floats
 
 	int numberOfElements = tempInfo.size();
 	// getting number of elements
 
+	std::vector<Predicate> predicates;
+	string filter_error;
+	if (!filter.empty() && !ParsePredicates(filter, columns, predicates, filter_error))
+	{
+		std::cerr << "Invalid filter: " << filter_error << std::endl;
+		return 1;
+	}
+
+	std::vector<cl_int> bitmapIds;
+	std::vector<cl_int> bitmapClauses;
+	if (!bitmap_query.empty() && !ParseBitmapQuery(bitmap_query, columns, bitmapIds, bitmapClauses, filter_error))
+	{
+		std::cerr << "Invalid bitmap query: " << filter_error << std::endl;
+		return 1;
+	}
+
+	for (size_t q = 0; q < query_select.size(); q++)
+	{
+		QuerySpec query;
+		query.groupBy = ParseQueryGroup(query_group[q]);
+		query.text = "select " + query_select[q] + (query_where[q].empty() ? "" : " where " + query_where[q]) + " group-by " + query_group[q];
+
+		if (!ParseSelect(query_select[q], query.select, filter_error) || !ParsePredicates(query_where[q], columns, query.where, filter_error) || query.groupBy < 0)
+		{
+			std::cerr << "Invalid query " << query.text << ": " << filter_error << std::endl;
+			return 1;
+		}
+
+		queries.push_back(query);
+	}
+
+	TimeRange range;
+	if (!time_range.empty() && !ParseTimeRange(time_range, columns, range))
+	{
+		std::cerr << "Invalid time range: " << time_range << std::endl;
+		print_help();
+		return 1;
+	}
+
 	//detect any potential exceptions
 	try
 	{
 		//Part 2 - host operations
+		cl::Program::Sources sources;
+
+		sources.push_back(make_pair((const char*)MY_KERNELS_3_CL, sizeof(MY_KERNELS_3_CL)));
+		// the kernel code is compiled into the executable, so nothing is read from the working directory
+
+		cl_ulong kernels_hash = HashBytes(MY_KERNELS_3_CL, sizeof(MY_KERNELS_3_CL));
+
+		std::stringstream build_options;
+		build_options << "-DTOPK=" << top_k;
+		// k of the top-k reduction is fixed at compile time
+
+		if (!multi_device.empty())
+		{
+			std::vector<const DeviceInfo*> devices;
+			if (!ParseDeviceList(multi_device, devices))
+			{
+				std::cerr << "Invalid device list: " << multi_device << std::endl;
+				return 1;
+			}
+
+			RunMultiDevice(devices, columns, sources, kernels_hash, build_options.str());
+
+			system("pause");
+			return 0;
+		}
+
 		//2.1 Select computing devices
 		cl::Context context = GetContext(platform_id, device_id);
 
@@ -91,32 +277,51 @@ int main(int argc, char **argv)
 		//create a queue to which we will push commands for the device
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
 
+		profiler.SyncClock(queue);
+		// the device timestamps of the trace are placed on the host clock from here
+
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		const DeviceInfo& device_info = GetDeviceInfo(platform_id, device_id);
+		// capabilities of the device, queried once when the devices were enumerated
+
 		//2.2 Load & build the device code
-		cl::Program::Sources sources;
+		cl::Program program;
 
-		AddSources(sources, "my_kernels_3.cl");
-		// get the kernel code
+		// the compiled binary is kept on disk, keyed by the source, the options and the device/driver,
+		// so later runs only load it and fall back to building from source when it is missing or rejected
+		string program_cache_file = "my_kernels_3." + ProgramCacheKey(kernels_hash, build_options.str(), device) + ".bin";
 
-		cl::Program program(context, sources);
+		ProfileScope build_scope(profiler, "BUILD");
+		std::chrono::high_resolution_clock::time_point program_start = std::chrono::high_resolution_clock::now();
+		bool program_loaded = LoadProgramBinary(context, device, program_cache_file, build_options.str(), program);
 
-		//build and debug the kernel code
-		try 
-		{
-			program.build();
-		}
-		catch (const cl::Error& err)
+		if (!program_loaded)
 		{
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+			program = cl::Program(context, sources);
+
+			try 
+			{
+				program.build(build_options.str().c_str());
+			}
+			catch (const cl::Error& err)
+			{
+				std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+				std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+				std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
+				throw err;
+			}
+
+			SaveProgramBinary(program, program_cache_file);
 		}
 
+		double program_time = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - program_start).count();
+		build_scope.End();
+
 		// typedef int mytype;
 		typedef float mytype;
 
 		//host - input
-		std::vector<mytype> A;
+		HostColumn<mytype> A;
 		for (int i = 0; i < tempInfo.size(); i++)
 		{
 			A.push_back(tempInfo[i]);
@@ -125,7 +330,7 @@ int main(int argc, char **argv)
 		//the following part adjusts the length of the input vector so it can be run for a specific workgroup size
 		//if the total input length is divisible by the workgroup size
 		//this makes the code more efficient
-		size_t local_size = 128; // workgroup size
+		size_t local_size = std::min((size_t)128, device_info.maxWorkGroupSize); // workgroup size
 		// work group size may result in different values on different devices
 
 		size_t padding_size = A.size() % local_size;
@@ -145,212 +350,1647 @@ int main(int argc, char **argv)
 		size_t nr_groups = input_elements / local_size;
 
 		//host - output
-		//std::vector<mytype> B(input_elements);
-		std::vector<mytype> Bavg(input_elements);
-		std::vector<mytype> Cmax(input_elements);
-		std::vector<mytype> Dmin(input_elements);
-		std::vector<mytype> Estanddev(input_elements);
-		std::vector<mytype> sortedVec(input_elements);
-		// output vectors for the results
-
-		size_t output_size = Bavg.size() * sizeof(mytype);//size in bytes
-		size_t sorted_size = A.size() * sizeof(mytype);
+		// the reductions only read back their final values, the partials stay on the device
 
 		//device - buffers
-		cl::Buffer buffer_A(context, CL_MEM_READ_ONLY, input_size);
-		cl::Buffer buffer_B(context, CL_MEM_READ_WRITE, output_size); // buffer for average
-		cl::Buffer buffer_C(context, CL_MEM_READ_WRITE, output_size); // buffer for max
-		cl::Buffer buffer_D(context, CL_MEM_READ_WRITE, output_size); // buffer for min
-		cl::Buffer buffer_standdev(context, CL_MEM_READ_WRITE, output_size); // buffer for standdev
-		cl::Buffer buffer_sorted(context, CL_MEM_READ_WRITE, sorted_size); // buffer for sorting
-
-		//copy arrays to buffer and initialise other arrays on device memory
-		queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &A[0]);
-		queue.enqueueFillBuffer(buffer_B, 0, 0, output_size);//zero B buffer on device memory
-		queue.enqueueFillBuffer(buffer_C, 0, 0, output_size);//zero C buffer on device memory
-		queue.enqueueFillBuffer(buffer_D, 0, 0, output_size);//zero D buffer on device memory
-		queue.enqueueFillBuffer(buffer_standdev, 0, 0, output_size);
-		queue.enqueueFillBuffer(buffer_sorted, 0, 0, sorted_size);
-
-		// ********** AVERAGE KERNEL **********
+		// on devices sharing memory with the host (CPU runtimes) the input buffers use the page aligned
+		// host columns in place and uploading them costs nothing, other devices get a copy as before
+		bool zero_copy = device_info.hostUnifiedMemory;
+		std::vector<cl::Event> upload_events;
+
+		ProfileScope upload_scope(profiler, "UPLOAD");
+		cl::Buffer buffer_A = CreateInputBuffer(context, queue, zero_copy, input_size, &A[0], &upload_events);
+
+		// scratch and partial-result buffers come from the pool and go back to it once their section is done,
+		// fills are only enqueued for the parts of a buffer that are read before a kernel writes them
+		BufferPool pool(context);
+
+		size_t station_size = columns.station.size() * sizeof(cl_int);
+		size_t time_size = columns.timestamp.size() * sizeof(cl_uint);
+
+		cl::Buffer buffer_station = CreateInputBuffer(context, queue, zero_copy, station_size, &columns.station[0], &upload_events); // station id column
+		cl::Buffer buffer_time = CreateInputBuffer(context, queue, zero_copy, time_size, &columns.timestamp[0], &upload_events); // packed timestamp column
+		size_t record_size = sizeof(mytype) + sizeof(cl_int) + sizeof(cl_uint); // bytes of one record over the three columns
+
+		if (!upload_events.empty())
+		{
+			profiler.Transfer("write temperature", upload_events[0], input_size);
+			profiler.Transfer("write station", upload_events[1], station_size);
+			profiler.Transfer("write timestamp", upload_events[2], time_size);
+		}
+		upload_scope.End();
+
+		// ********** CUBE KERNEL **********
+		// station x year x month moments of all records, stored next to the data file
+		// a stored cube is extended with only the rows appended since, the roll-ups are answered from its cells
+		AggregateCube cube;
+		size_t cube_new_rows = 0;
+
+		std::vector<cl::Event> cube_events;
+		cl_ulong cube_kernel_time = 0;
+
+		if (cube_rollup >= 0)
+		{
+			ProfileScope cube_scope(profiler, "CUBE");
+			size_t n = tempInfo.size();
+			string cube_file = fileDir + ".cube";
+			bool cube_loaded = LoadCube(cube_file, columns, cube);
+
+			if (!cube_loaded)
+			{
+				cube = AggregateCube();
+				cube.stations = (int)columns.stationNames.size();
+				cube.firstYear = columns.firstYear;
+				cube.years = columns.lastYear - columns.firstYear + 1;
+				cube.cells.resize(cube.stations * cube.years * 12);
+			}
+
+			cube_new_rows = n - cube.rows;
+
+			if (cube_new_rows)
+			{
+				std::vector<float> cubeStats(cube.cells.size() * MOMENTS);
+				std::vector<cl_int> cubeCounts(cube.cells.size());
+
+				cl::Buffer buffer_cube_stats = pool.Acquire(cubeStats.size() * sizeof(float));
+				cl::Buffer buffer_cube_counts = pool.Acquire(cubeCounts.size() * sizeof(cl_int));
+
+				cl::Event prof_event_CUBE;
+
+				if (cube_loaded)
+				{
+					FromGroupStats(cube.cells, cubeStats, cubeCounts);
+					queue.enqueueWriteBuffer(buffer_cube_stats, CL_TRUE, 0, cubeStats.size() * sizeof(float), &cubeStats[0]);
+					queue.enqueueWriteBuffer(buffer_cube_counts, CL_TRUE, 0, cubeCounts.size() * sizeof(cl_int), &cubeCounts[0]);
+				}
+				else
+				{
+					cl::Kernel kernel_init_cube = cl::Kernel(program, "init_group_stats");
+					kernel_init_cube.setArg(0, buffer_cube_stats);
+					kernel_init_cube.setArg(1, buffer_cube_counts);
+
+					queue.enqueueNDRangeKernel(kernel_init_cube, cl::NullRange, cl::NDRange(cube.cells.size()), cl::NullRange, NULL, &prof_event_CUBE);
+					cube_events.push_back(prof_event_CUBE);
+					profiler.Kernel(kernel_init_cube, prof_event_CUBE);
+				}
+
+				cl::Kernel kernel_cube = cl::Kernel(program, "reduce_cube_stats");
+				kernel_cube.setArg(0, buffer_A);
+				kernel_cube.setArg(1, buffer_station);
+				kernel_cube.setArg(2, buffer_time);
+				kernel_cube.setArg(3, buffer_cube_stats);
+				kernel_cube.setArg(4, buffer_cube_counts);
+				kernel_cube.setArg(5, cl::Local(local_size * MOMENTS * sizeof(float)));
+				kernel_cube.setArg(6, (cl_int)n);
+				kernel_cube.setArg(7, cube.firstYear);
+				kernel_cube.setArg(8, cube.years);
+
+				// only the rows the stored cube does not cover yet
+				queue.enqueueNDRangeKernel(kernel_cube, cl::NDRange(cube.rows), cl::NDRange(((cube_new_rows + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), NULL, &prof_event_CUBE);
+				cube_events.push_back(prof_event_CUBE);
+				profiler.Kernel(kernel_cube, prof_event_CUBE, cube_new_rows * record_size);
+
+				queue.enqueueReadBuffer(buffer_cube_stats, CL_TRUE, 0, cubeStats.size() * sizeof(float), &cubeStats[0]);
+				queue.enqueueReadBuffer(buffer_cube_counts, CL_TRUE, 0, cubeCounts.size() * sizeof(cl_int), &cubeCounts[0]);
+
+				pool.Release(buffer_cube_stats);
+				pool.Release(buffer_cube_counts);
+
+				cube.cells = ToGroupStats(cubeStats, cubeCounts);
+				cube.rows = (cl_uint)n;
+				cube.checksum = ColumnsChecksum(columns, n);
+				SaveCube(cube_file, cube);
+
+				cube_kernel_time = GetKernelTime(cube_events);
+			}
+		}
+
+		// ********** FILTER KERNEL **********
+		// the -f predicates are evaluated on the device into selection flags, a scan of the flags positions the
+		// selected records and the compacted columns take the place of buffer_A/buffer_station/buffer_time,
+		// so every kernel below only sees the selected records and nothing is copied back apart from their count
+		size_t row_count = tempInfo.size();
+
+		std::vector<cl::Event> filter_events;
+		cl_ulong filter_kernel_time = 0;
+
+		// summary of the selected records: the zone maps of the fully matching blocks merged with the moments
+		// of the records selected from the partial blocks, the only ones scanned
+		ZoneMaps zones;
+		bool zones_loaded = false;
+		GroupStats zoneSummary = GroupStats();
+		int zoneClassCount[3] = { 0, 0, 0 };
+
+		if (!predicates.empty())
+		{
+			ProfileScope filter_scope(profiler, "FILTER");
+			size_t n = tempInfo.size();
+
+			cl::Buffer buffer_predicates = pool.Acquire(predicates.size() * sizeof(Predicate));
+			queue.enqueueWriteBuffer(buffer_predicates, CL_TRUE, 0, predicates.size() * sizeof(Predicate), &predicates[0]);
+
+			cl::Event prof_event_FILTER;
+
+			// ********** ZONE MAP KERNEL **********
+			// summary of every ZONE_BLOCK records, stored next to the data file, only the blocks of rows appended
+			// since (from the last stored block on, it may have grown) are summarised and read back
+			size_t zone_count = (n + ZONE_BLOCK - 1) / ZONE_BLOCK;
+			string zone_file = fileDir + ".zones";
+
+			zones_loaded = LoadZoneMaps(zone_file, columns, zones);
+			if (!zones_loaded)
+			{
+				zones = ZoneMaps();
+			}
+
+			size_t first_block = zones.rows == n ? zone_count : zones.rows / ZONE_BLOCK;
+
+			if (first_block < zone_count)
+			{
+				size_t new_blocks = zone_count - first_block;
+
+				std::vector<float> zoneStats(new_blocks * MOMENTS);
+				std::vector<cl_int> zoneCounts(new_blocks);
+				std::vector<cl_uint> zoneTime(2 * new_blocks);
+
+				cl::Buffer buffer_zone_stats = pool.Acquire(zoneStats.size() * sizeof(float));
+				cl::Buffer buffer_zone_counts = pool.Acquire(zoneCounts.size() * sizeof(cl_int));
+				cl::Buffer buffer_zone_time = pool.Acquire(zoneTime.size() * sizeof(cl_uint));
+
+				cl::Kernel kernel_zone_maps = cl::Kernel(program, "zone_maps");
+				kernel_zone_maps.setArg(0, buffer_A);
+				kernel_zone_maps.setArg(1, buffer_time);
+				kernel_zone_maps.setArg(2, buffer_zone_stats);
+				kernel_zone_maps.setArg(3, buffer_zone_counts);
+				kernel_zone_maps.setArg(4, buffer_zone_time);
+				kernel_zone_maps.setArg(5, cl::Local(local_size * MOMENTS * sizeof(float)));
+				kernel_zone_maps.setArg(6, cl::Local(2 * local_size * sizeof(cl_uint)));
+				kernel_zone_maps.setArg(7, (cl_int)n);
+				kernel_zone_maps.setArg(8, ZONE_BLOCK);
+				kernel_zone_maps.setArg(9, (cl_int)first_block);
+
+				queue.enqueueNDRangeKernel(kernel_zone_maps, cl::NullRange, cl::NDRange(new_blocks * local_size), cl::NDRange(local_size), NULL, &prof_event_FILTER);
+				filter_events.push_back(prof_event_FILTER);
+				profiler.Kernel(kernel_zone_maps, prof_event_FILTER, (n - first_block * ZONE_BLOCK) * (sizeof(float) + sizeof(cl_uint)));
+
+				queue.enqueueReadBuffer(buffer_zone_stats, CL_TRUE, 0, zoneStats.size() * sizeof(float), &zoneStats[0]);
+				queue.enqueueReadBuffer(buffer_zone_counts, CL_TRUE, 0, zoneCounts.size() * sizeof(cl_int), &zoneCounts[0]);
+				queue.enqueueReadBuffer(buffer_zone_time, CL_TRUE, 0, zoneTime.size() * sizeof(cl_uint), &zoneTime[0]);
+
+				pool.Release(buffer_zone_stats);
+				pool.Release(buffer_zone_counts);
+				pool.Release(buffer_zone_time);
+
+				std::vector<GroupStats> newZones = ToGroupStats(zoneStats, zoneCounts);
+
+				zones.blocks.resize(first_block);
+				zones.time.resize(2 * first_block);
+				zones.blocks.insert(zones.blocks.end(), newZones.begin(), newZones.end());
+				zones.time.insert(zones.time.end(), zoneTime.begin(), zoneTime.end());
+				zones.rows = (cl_uint)n;
+				zones.checksum = ColumnsChecksum(columns, n);
+				SaveZoneMaps(zone_file, zones);
+			}
+
+			// skipped blocks are not touched, fully matching blocks are answered from their summary and copied as a
+			// whole, the predicates are only evaluated on the partial blocks, packed one after another
+			std::vector<int> zoneClass(zone_count);
+			std::vector<cl_int> partialBlocks;
+
+			for (size_t b = 0; b < zone_count; b++)
+			{
+				zoneClass[b] = ClassifyZone(zones.blocks[b], zones.time[2 * b], zones.time[2 * b + 1], predicates);
+				zoneClassCount[zoneClass[b]]++;
+
+				if (zoneClass[b] == ZONE_FULL)
+				{
+					zoneSummary = MergeGroupStats(zoneSummary, zones.blocks[b]);
+				}
+				else if (zoneClass[b] == ZONE_PARTIAL)
+				{
+					partialBlocks.push_back((cl_int)b);
+				}
+			}
+
+			size_t packed = partialBlocks.size() * ZONE_BLOCK;
+			size_t packed_elements = ((packed + local_size - 1) / local_size) * local_size;
+
+			std::vector<cl_int> partialEnds(partialBlocks.size());
+			// inclusive count of the selected records up to the end of every partial block
+
+			cl::Buffer buffer_blocks, buffer_flags, buffer_select_index;
+
+			if (packed)
+			{
+				std::vector<float> partialStats(MOMENTS);
+				std::vector<cl_int> partialCounts(1);
+
+				cl::Buffer buffer_partial_stats = pool.Acquire(partialStats.size() * sizeof(float));
+				cl::Buffer buffer_partial_counts = pool.Acquire(partialCounts.size() * sizeof(cl_int));
+
+				buffer_blocks = pool.Acquire(partialBlocks.size() * sizeof(cl_int));
+				buffer_flags = pool.Acquire(packed * sizeof(cl_int));
+				buffer_select_index = pool.Acquire(packed * sizeof(cl_int));
+
+				queue.enqueueWriteBuffer(buffer_blocks, CL_TRUE, 0, partialBlocks.size() * sizeof(cl_int), &partialBlocks[0]);
+
+				cl::Kernel kernel_init_partial = cl::Kernel(program, "init_group_stats");
+				kernel_init_partial.setArg(0, buffer_partial_stats);
+				kernel_init_partial.setArg(1, buffer_partial_counts);
+
+				queue.enqueueNDRangeKernel(kernel_init_partial, cl::NullRange, cl::NDRange(1), cl::NullRange, NULL, &prof_event_FILTER);
+				filter_events.push_back(prof_event_FILTER);
+				profiler.Kernel(kernel_init_partial, prof_event_FILTER);
+
+				cl::Kernel kernel_filter = cl::Kernel(program, "filter_blocks");
+				kernel_filter.setArg(0, buffer_A);
+				kernel_filter.setArg(1, buffer_station);
+				kernel_filter.setArg(2, buffer_time);
+				kernel_filter.setArg(3, buffer_predicates);
+				kernel_filter.setArg(4, (cl_int)predicates.size());
+				kernel_filter.setArg(5, buffer_blocks);
+				kernel_filter.setArg(6, ZONE_BLOCK);
+				kernel_filter.setArg(7, buffer_flags);
+				kernel_filter.setArg(8, buffer_partial_stats);
+				kernel_filter.setArg(9, buffer_partial_counts);
+				kernel_filter.setArg(10, cl::Local(MOMENTS * sizeof(float)));
+				kernel_filter.setArg(11, cl::Local(sizeof(cl_int)));
+				kernel_filter.setArg(12, (cl_int)packed);
+				kernel_filter.setArg(13, (cl_int)n);
+
+				queue.enqueueNDRangeKernel(kernel_filter, cl::NullRange, cl::NDRange(packed_elements), cl::NDRange(local_size), NULL, &prof_event_FILTER);
+				filter_events.push_back(prof_event_FILTER);
+				profiler.Kernel(kernel_filter, prof_event_FILTER, packed * (record_size + sizeof(cl_int)));
+
+				size_t scan_first = filter_events.size();
+				EnqueueScan(pool, queue, program, "add_int", buffer_flags, buffer_select_index, packed, sizeof(cl_int), local_size, true, &filter_events);
+				profiler.Kernels("scan_add_int", filter_events, scan_first);
+
+				for (size_t p = 0; p < partialBlocks.size(); p++)
+				{
+					queue.enqueueReadBuffer(buffer_select_index, CL_FALSE, ((p + 1) * ZONE_BLOCK - 1) * sizeof(cl_int), sizeof(cl_int), &partialEnds[p]);
+				}
+				queue.enqueueReadBuffer(buffer_partial_stats, CL_FALSE, 0, partialStats.size() * sizeof(float), &partialStats[0]);
+				queue.enqueueReadBuffer(buffer_partial_counts, CL_FALSE, 0, partialCounts.size() * sizeof(cl_int), &partialCounts[0]);
+				queue.finish();
+
+				pool.Release(buffer_partial_stats);
+				pool.Release(buffer_partial_counts);
+
+				zoneSummary = MergeGroupStats(zoneSummary, ToGroupStats(partialStats, partialCounts)[0]);
+			}
+
+			// position of every block in the compacted columns, the selected records keep their order
+			std::vector<size_t> blockOffset(zone_count);
+			std::vector<cl_int> blockDelta(partialBlocks.size());
+			size_t selected_count = 0;
+
+			for (size_t b = 0, p = 0; b < zone_count; b++)
+			{
+				blockOffset[b] = selected_count;
+
+				if (zoneClass[b] == ZONE_FULL)
+				{
+					selected_count += zones.blocks[b].count;
+				}
+				else if (zoneClass[b] == ZONE_PARTIAL)
+				{
+					cl_int before = p ? partialEnds[p - 1] : 0;
+					blockDelta[p] = (cl_int)selected_count - before;
+					selected_count += partialEnds[p] - before;
+					p++;
+				}
+			}
+
+			if (!selected_count)
+			{
+				std::cout << "No readings match the filter " << filter << std::endl;
+				return 0;
+			}
+
+			size_t selected_elements = ((selected_count + local_size - 1) / local_size) * local_size;
+
+			cl::Buffer buffer_selected_temp = pool.Acquire(selected_elements * sizeof(float));
+			cl::Buffer buffer_selected_station = pool.Acquire(selected_count * sizeof(cl_int));
+			cl::Buffer buffer_selected_time = pool.Acquire(selected_count * sizeof(cl_uint));
+
+			// runs of fully matching blocks are copied without being read by a kernel
+			for (size_t b = 0; b < zone_count; b++)
+			{
+				if (zoneClass[b] != ZONE_FULL)
+					continue;
+
+				size_t first = b;
+				while (b + 1 < zone_count && zoneClass[b + 1] == ZONE_FULL)
+				{
+					b++;
+				}
+
+				size_t start = first * ZONE_BLOCK;
+				size_t length = std::min((b + 1) * ZONE_BLOCK, n) - start;
+				size_t offset = blockOffset[first];
+
+				queue.enqueueCopyBuffer(buffer_A, buffer_selected_temp, start * sizeof(float), offset * sizeof(float), length * sizeof(float), NULL, &prof_event_FILTER);
+				profiler.Transfer("copy full temperature", prof_event_FILTER, length * sizeof(float));
+				queue.enqueueCopyBuffer(buffer_station, buffer_selected_station, start * sizeof(cl_int), offset * sizeof(cl_int), length * sizeof(cl_int), NULL, &prof_event_FILTER);
+				profiler.Transfer("copy full station", prof_event_FILTER, length * sizeof(cl_int));
+				queue.enqueueCopyBuffer(buffer_time, buffer_selected_time, start * sizeof(cl_uint), offset * sizeof(cl_uint), length * sizeof(cl_uint), NULL, &prof_event_FILTER);
+				profiler.Transfer("copy full timestamp", prof_event_FILTER, length * sizeof(cl_uint));
+			}
+
+			if (packed)
+			{
+				cl::Buffer buffer_block_delta = pool.Acquire(blockDelta.size() * sizeof(cl_int));
+				queue.enqueueWriteBuffer(buffer_block_delta, CL_TRUE, 0, blockDelta.size() * sizeof(cl_int), &blockDelta[0]);
+
+				cl::Kernel kernel_compact = cl::Kernel(program, "compact_blocks");
+				kernel_compact.setArg(0, buffer_flags);
+				kernel_compact.setArg(1, buffer_select_index);
+				kernel_compact.setArg(2, buffer_blocks);
+				kernel_compact.setArg(3, buffer_block_delta);
+				kernel_compact.setArg(4, ZONE_BLOCK);
+				kernel_compact.setArg(5, buffer_A);
+				kernel_compact.setArg(6, buffer_station);
+				kernel_compact.setArg(7, buffer_time);
+				kernel_compact.setArg(8, buffer_selected_temp);
+				kernel_compact.setArg(9, buffer_selected_station);
+				kernel_compact.setArg(10, buffer_selected_time);
+				kernel_compact.setArg(11, (cl_int)packed);
+				kernel_compact.setArg(12, (cl_int)n);
+
+				queue.enqueueNDRangeKernel(kernel_compact, cl::NullRange, cl::NDRange(packed_elements), cl::NDRange(local_size), NULL, &prof_event_FILTER);
+				filter_events.push_back(prof_event_FILTER);
+				profiler.Kernel(kernel_compact, prof_event_FILTER, packed * 2 * sizeof(cl_int) + partialEnds.back() * 2 * record_size);
+
+				pool.Release(buffer_flags);
+				pool.Release(buffer_select_index);
+				pool.Release(buffer_blocks);
+				pool.Release(buffer_block_delta);
+			}
+
+			pool.Release(buffer_predicates);
+			filter_kernel_time = GetKernelTime(filter_events);
+
+			buffer_A = buffer_selected_temp;
+			buffer_station = buffer_selected_station;
+			buffer_time = buffer_selected_time;
+
+			row_count = selected_count;
+			numberOfElements = row_count;
+			station_size = row_count * sizeof(cl_int);
+			time_size = row_count * sizeof(cl_uint);
+
+			input_elements = selected_elements;
+			nr_groups = input_elements / local_size;
+			// the kernels below only cover the selected records and their padding
+		}
+
+		// ********** AVERAGE, MAX, MIN AND STAND DEV KERNELS **********
+		// every reduction works through ping-pong partial buffers of ceil(N / local_size) values instead of
+		// input-sized ones, every level waits for the one before it through its event and only the reduced
+		// value is read back, stand dev only waits for the sum of the average
+		// -o enqueues the four reductions on an out-of-order queue (one in-order queue per reduction where the
+		// device has none) so the independent ones overlap, otherwise they run one after another on queue
+		// with -f the sum, max and min of the selected records come from the filter's summary and only stand dev
+		// is reduced, over the compacted selection around the mean of that summary
+		ProfileScope reduce_scope(profiler, "REDUCE");
 		cl::Kernel kernel_add = cl::Kernel(program, "reduce_add_4");
-		kernel_add.setArg(0, buffer_A);
-		kernel_add.setArg(1, buffer_B);
-		kernel_add.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
-
-		cl::Event prof_event_AVG;
-		float AVG_kernel_time;
-		float AVG_single_kernel;
-		cl::Event prof_event_AVG_mem;
-		float AVG_memory_time;
-		queue.enqueueNDRangeKernel(kernel_add, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_AVG); // call the kernel
-		queue.enqueueReadBuffer(buffer_B, CL_TRUE, 0, output_size, &Bavg[0], NULL, &prof_event_AVG_mem); // copy the output to the host
-		AVG_kernel_time = prof_event_AVG.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_AVG.getProfilingInfo<CL_PROFILING_COMMAND_START>(); // get kernel profiling time
-		AVG_single_kernel = prof_event_AVG.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_AVG.getProfilingInfo<CL_PROFILING_COMMAND_START>(); // get kernel profiling time
-		AVG_memory_time = prof_event_AVG_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_AVG_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>(); // get memory transfer time
-
-		// loop until vector elements is less than workgroup size
-		// kernel redcues for only the workgroup size
-		// breaking down into chunks
-		// reduces until only one value
-		// TILING!
-		while (Bavg[1] != 0.0f)
-		{
-			kernel_add.setArg(0, buffer_B);
-			kernel_add.setArg(1, buffer_B);
-			kernel_add.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
 
-			queue.enqueueNDRangeKernel(kernel_add, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_AVG);
-			queue.enqueueReadBuffer(buffer_B, CL_TRUE, 0, output_size, &Bavg[0], NULL, &prof_event_AVG_mem);
-			AVG_kernel_time += prof_event_AVG.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_AVG.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-			AVG_memory_time += prof_event_AVG_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_AVG_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>(); // get memory transfer time
+		float totalTemp, maxTemp, minTemp, squaredDiffTotal;
+		cl_ulong AVG_kernel_time = 0, AVG_single_kernel = 0, AVG_memory_time = 0;
+		cl_ulong max_kernel_time = 0, max_single_kernel = 0, max_memory_time = 0;
+		cl_ulong min_kernel_time = 0, min_single_kernel = 0, min_memory_time = 0;
+		cl_ulong standdev_kernel_time = 0, standdev_single_kernel = 0, standdev_memory_time = 0;
+
+		std::vector<string> dag_labels;
+		std::vector<cl::Event> dag_events;
+		// every command of the DAG for the timeline report
+
+		if (!predicates.empty())
+		{
+			// the filter already summarised the selected records, from the zone maps of the fully matching blocks
+			// and the moments of the records selected from the partial ones
+			totalTemp = zoneSummary.sum;
+			maxTemp = zoneSummary.max;
+			minTemp = zoneSummary.min;
+
+			// the summary's sum of squares would give a one-pass variance, which cancels badly for narrow
+			// selections such as temp>25, so the squared differences are still summed on the device
+			cl::Buffer buffer_total = pool.Acquire(sizeof(float));
+			queue.enqueueWriteBuffer(buffer_total, CL_TRUE, 0, sizeof(float), &totalTemp);
+
+			cl::Kernel kernel_standDev = cl::Kernel(program, "reduce_standDev_4");
+			kernel_standDev.setArg(0, buffer_A);
+			kernel_standDev.setArg(2, buffer_total);
+			kernel_standDev.setArg(3, cl::Local(local_size * sizeof(mytype)));
+			kernel_standDev.setArg(4, (cl_int)row_count);
+
+			cl::Kernel kernel_standDev_levels = cl::Kernel(program, "reduce_add_4");
+			kernel_standDev_levels.setArg(2, cl::Local(local_size * sizeof(mytype)));
+
+			size_t partial_size = ReductionLevelSize(input_elements, local_size) * sizeof(mytype);
+			cl::Buffer buffer_standdev[2] = { pool.Acquire(partial_size), pool.Acquire(partial_size) };
+
+			std::vector<cl::Event> standdev_events;
+			cl::Buffer standdev_result;
+			cl::Event prof_event_STANDDEV_mem;
+
+			EnqueueReduction(queue, kernel_standDev, 1, kernel_standDev_levels, buffer_standdev, input_elements, local_size, 0.0f, std::vector<cl::Event>(), standdev_result, &standdev_events);
+			queue.enqueueReadBuffer(standdev_result, CL_TRUE, 0, sizeof(float), &squaredDiffTotal, NULL, &prof_event_STANDDEV_mem);
+
+			pool.Release(buffer_total);
+			pool.Release(buffer_standdev[0]);
+			pool.Release(buffer_standdev[1]);
+
+			size_t count = input_elements;
+			for (size_t i = 0; i < standdev_events.size(); i++)
+			{
+				size_t groups = (count + local_size - 1) / local_size;
+				profiler.Kernel(i ? kernel_standDev_levels : kernel_standDev, standdev_events[i], (count + groups) * sizeof(mytype));
+				count = ((groups + local_size - 1) / local_size) * local_size;
+			}
+			profiler.Transfer("read result", prof_event_STANDDEV_mem, sizeof(float));
+
+			standdev_kernel_time = GetKernelTime(standdev_events);
+			standdev_single_kernel = GetKernelTime(std::vector<cl::Event>(1, standdev_events[0]));
+			standdev_memory_time = GetKernelTime(std::vector<cl::Event>(1, prof_event_STANDDEV_mem));
 		}
-		// loop through kernel calls until fully reduced
+		else
+		{
+			std::vector<cl::CommandQueue> dag_queues(4, queue);
+			// queues of the avg, max, min and stand dev reductions
+
+			if (out_of_order)
+			{
+				cl_command_queue_properties dag_properties = CL_QUEUE_PROFILING_ENABLE;
+				if (device_info.outOfOrderQueue)
+					dag_properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+
+				dag_queues[0] = cl::CommandQueue(context, dag_properties);
+				for (size_t i = 1; i < dag_queues.size(); i++)
+				{
+					dag_queues[i] = device_info.outOfOrderQueue ? dag_queues[0] : cl::CommandQueue(context, dag_properties);
+				}
+			}
+
+			kernel_add.setArg(0, buffer_A);
+			kernel_add.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
 
-		
+			// max, min and stand dev only read the row_count real values, the zeros padding the input up to
+			// input_elements would otherwise count as readings
+			cl::Kernel kernel_max = cl::Kernel(program, "reduce_max_4");
+			kernel_max.setArg(0, buffer_A);
+			kernel_max.setArg(2, cl::Local(local_size * sizeof(mytype)));
+			kernel_max.setArg(3, (cl_int)row_count);
+
+			cl::Kernel kernel_min = cl::Kernel(program, "reduce_min_4");
+			kernel_min.setArg(0, buffer_A);
+			kernel_min.setArg(2, cl::Local(local_size * sizeof(mytype)));
+			kernel_min.setArg(3, (cl_int)row_count);
+
+			cl::Kernel kernel_standDev = cl::Kernel(program, "reduce_standDev_4");
+			kernel_standDev.setArg(0, buffer_A);
+			kernel_standDev.setArg(3, cl::Local(local_size * sizeof(mytype)));
+			kernel_standDev.setArg(4, (cl_int)row_count);
+
+			size_t level_values = ReductionLevelSize(input_elements, local_size);
+			size_t partial_size = level_values * sizeof(mytype);
+
+			// the levels after the first one of every reduction
+			// the level buffers are filled with the identity behind the partials, so every value of them is read
+			cl::Kernel kernel_add_levels = cl::Kernel(program, "reduce_add_4");
+			kernel_add_levels.setArg(2, cl::Local(local_size * sizeof(mytype)));
+			cl::Kernel kernel_max_levels = cl::Kernel(program, "reduce_max_4");
+			kernel_max_levels.setArg(2, cl::Local(local_size * sizeof(mytype)));
+			kernel_max_levels.setArg(3, (cl_int)level_values);
+			cl::Kernel kernel_min_levels = cl::Kernel(program, "reduce_min_4");
+			kernel_min_levels.setArg(2, cl::Local(local_size * sizeof(mytype)));
+			kernel_min_levels.setArg(3, (cl_int)level_values);
+			cl::Kernel kernel_standDev_levels = cl::Kernel(program, "reduce_add_4");
+			kernel_standDev_levels.setArg(2, cl::Local(local_size * sizeof(mytype)));
+
+			cl::Buffer buffer_B[2] = { pool.Acquire(partial_size), pool.Acquire(partial_size) }; // partials of average
+			cl::Buffer buffer_C[2] = { pool.Acquire(partial_size), pool.Acquire(partial_size) }; // partials of max
+			cl::Buffer buffer_D[2] = { pool.Acquire(partial_size), pool.Acquire(partial_size) }; // partials of min
+			cl::Buffer buffer_standdev[2] = { pool.Acquire(partial_size), pool.Acquire(partial_size) }; // partials of standdev
+
+			std::vector<cl::Event> avg_events, max_events, min_events, standdev_events;
+			cl::Buffer avg_result, max_result, min_result, standdev_result;
+			std::vector<cl::Event> no_wait;
+
+			cl::Event avg_done = EnqueueReduction(dag_queues[0], kernel_add, 1, kernel_add_levels, buffer_B, input_elements, local_size, 0.0f, no_wait, avg_result, &avg_events);
+			EnqueueReduction(dag_queues[1], kernel_max, 1, kernel_max_levels, buffer_C, input_elements, local_size, -INFINITY, no_wait, max_result, &max_events);
+			EnqueueReduction(dag_queues[2], kernel_min, 1, kernel_min_levels, buffer_D, input_elements, local_size, INFINITY, no_wait, min_result, &min_events);
+
+			kernel_standDev.setArg(2, avg_result); // pass through the output from reduce add to get mean for stand dev
+			EnqueueReduction(dag_queues[3], kernel_standDev, 1, kernel_standDev_levels, buffer_standdev, input_elements, local_size, 0.0f, std::vector<cl::Event>(1, avg_done), standdev_result, &standdev_events);
+
+			// only the reduced values are read back, each one as soon as its own reduction is done
+			cl::Event prof_event_AVG_mem, prof_event_MAX_mem, prof_event_MIN_mem, prof_event_STANDDEV_mem;
+			dag_queues[0].enqueueReadBuffer(avg_result, CL_FALSE, 0, sizeof(float), &totalTemp, &avg_events, &prof_event_AVG_mem);
+			dag_queues[1].enqueueReadBuffer(max_result, CL_FALSE, 0, sizeof(float), &maxTemp, &max_events, &prof_event_MAX_mem);
+			dag_queues[2].enqueueReadBuffer(min_result, CL_FALSE, 0, sizeof(float), &minTemp, &min_events, &prof_event_MIN_mem);
+			dag_queues[3].enqueueReadBuffer(standdev_result, CL_FALSE, 0, sizeof(float), &squaredDiffTotal, &standdev_events, &prof_event_STANDDEV_mem);
+
+			for (size_t i = 0; i < dag_queues.size(); i++)
+			{
+				dag_queues[i].flush();
+			}
+
+			std::vector<cl::Event> dag_reads = { prof_event_AVG_mem, prof_event_MAX_mem, prof_event_MIN_mem, prof_event_STANDDEV_mem };
+			cl::WaitForEvents(dag_reads);
+
+			for (int i = 0; i < 2; i++)
+			{
+				pool.Release(buffer_B[i]);
+				pool.Release(buffer_C[i]);
+				pool.Release(buffer_D[i]);
+				pool.Release(buffer_standdev[i]);
+			}
+
+			const std::vector<cl::Event>* reduce_chains[4] = { &avg_events, &max_events, &min_events, &standdev_events };
+			const cl::Event* reduce_reads[4] = { &prof_event_AVG_mem, &prof_event_MAX_mem, &prof_event_MIN_mem, &prof_event_STANDDEV_mem };
+			cl::Kernel* reduce_kernels[4][2] = { { &kernel_add, &kernel_add_levels }, { &kernel_max, &kernel_max_levels },
+				{ &kernel_min, &kernel_min_levels }, { &kernel_standDev, &kernel_standDev_levels } };
+
+			for (int c = 0; c < 4; c++)
+			{
+				size_t count = input_elements;
+				for (size_t i = 0; i < reduce_chains[c]->size(); i++)
+				{
+					size_t groups = (count + local_size - 1) / local_size;
+					profiler.Kernel(*reduce_kernels[c][i ? 1 : 0], (*reduce_chains[c])[i], (count + groups) * sizeof(mytype));
+					count = ((groups + local_size - 1) / local_size) * local_size;
+				}
+				profiler.Transfer("read result", *reduce_reads[c], sizeof(float));
+			}
+			// every level reads its whole input level and writes one partial per work group
+
+			AVG_kernel_time = GetKernelTime(avg_events);
+			AVG_single_kernel = GetKernelTime(std::vector<cl::Event>(1, avg_events[0]));
+			AVG_memory_time = GetKernelTime(std::vector<cl::Event>(1, prof_event_AVG_mem));
+			max_kernel_time = GetKernelTime(max_events);
+			max_single_kernel = GetKernelTime(std::vector<cl::Event>(1, max_events[0]));
+			max_memory_time = GetKernelTime(std::vector<cl::Event>(1, prof_event_MAX_mem));
+			min_kernel_time = GetKernelTime(min_events);
+			min_single_kernel = GetKernelTime(std::vector<cl::Event>(1, min_events[0]));
+			min_memory_time = GetKernelTime(std::vector<cl::Event>(1, prof_event_MIN_mem));
+			standdev_kernel_time = GetKernelTime(standdev_events);
+			standdev_single_kernel = GetKernelTime(std::vector<cl::Event>(1, standdev_events[0]));
+			standdev_memory_time = GetKernelTime(std::vector<cl::Event>(1, prof_event_STANDDEV_mem));
+
+			if (out_of_order)
+			{
+				const char* names[4] = { "AVG", "MAX", "MIN", "STANDDEV" };
+
+				for (int c = 0; c < 4; c++)
+				{
+					for (size_t i = 0; i < reduce_chains[c]->size(); i++)
+					{
+						dag_labels.push_back(string(names[c]) + " level " + std::to_string(i));
+						dag_events.push_back((*reduce_chains[c])[i]);
+					}
+					dag_labels.push_back(string(names[c]) + " read");
+					dag_events.push_back(*reduce_reads[c]);
+				}
+			}
+		}
+		reduce_scope.End();
 
-		float totalTemp = Bavg[0];
 		float avgTemp = totalTemp / numberOfElements;
 		// calcualting avg temp
 
-		// ********** MAX KERNEL **********
-		cl::Kernel kernel_max = cl::Kernel(program, "reduce_max_4");
-		kernel_max.setArg(0, buffer_A);
-		kernel_max.setArg(1, buffer_C);
-		kernel_max.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
+		float variance = (squaredDiffTotal / numberOfElements);
+		float standDev = sqrt(variance);
+
+		// ********** EXTREME READINGS **********
+		// the k hottest and coldest readings together with the station and timestamp they were recorded at
+		// by default a top-k reduction is used, -s ranks them with a full device argsort instead
+		if ((size_t)top_k * 2 > local_size)
+		{
+			std::cout << "k is larger than half the workgroup size, falling back to the full argsort" << std::endl;
+			full_sort = true;
+		}
+
+		size_t extremes_count = std::min((size_t)top_k, row_count);
+
+		std::vector<float> extremeTemp(2 * extremes_count);
+		std::vector<cl_int> extremeStation(2 * extremes_count);
+		std::vector<cl_uint> extremeTime(2 * extremes_count);
 
-		cl::Event prof_event_MAX;
-		float max_kernel_time;
-		float max_single_kernel;
-		cl::Event prof_event_MAX_mem;
-		float max_memory_time;
-		queue.enqueueNDRangeKernel(kernel_max, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_MAX);
-		queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, output_size, &Cmax[0], NULL, &prof_event_MAX_mem);
-		max_kernel_time = prof_event_MAX.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MAX.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		max_single_kernel = prof_event_MAX.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MAX.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		max_memory_time = prof_event_MAX_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MAX_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		cl::Event prof_event_ARGSORT;
+		std::vector<cl::Event> argsort_events;
+		cl_ulong argsort_kernel_time;
+		cl::Event prof_event_ARGSORT_mem;
+		cl_ulong argsort_memory_time;
 
-		// reduce until left with a single value
-		while (Cmax[1] != 0.0f)
+		cl::Event prof_event_TOPK;
+		std::vector<cl::Event> topk_events;
+		cl_ulong topk_kernel_time;
+		cl::Event prof_event_TOPK_mem;
+		cl_ulong topk_memory_time;
+
+		if (full_sort)
+		{
+			// ********** ARGSORT KERNEL **********
+			ProfileScope argsort_scope(profiler, "ARGSORT");
+			// sorts (temperature, record index) pairs on the device so the extremes keep their station and timestamp
+			// only the 2k extreme records are read back, not the whole sorted array
+			size_t sort_elements = local_size;
+			while (sort_elements < row_count)
+			{
+				sort_elements *= 2;
+			}
+			// bitonic sort needs a power of 2 length, the extra elements are padded with +INFINITY on the device
+
+			cl::Buffer buffer_keys = pool.Acquire(sort_elements * sizeof(float)); // temperatures being sorted
+			cl::Buffer buffer_vals = pool.Acquire(sort_elements * sizeof(cl_int)); // record indices moved with them
+			cl::Buffer buffer_extreme_temp = pool.Acquire(extremeTemp.size() * sizeof(float));
+			cl::Buffer buffer_extreme_station = pool.Acquire(extremeStation.size() * sizeof(cl_int));
+			cl::Buffer buffer_extreme_time = pool.Acquire(extremeTime.size() * sizeof(cl_uint));
+
+			cl::Kernel kernel_init_argsort = cl::Kernel(program, "init_argsort");
+			kernel_init_argsort.setArg(0, buffer_A);
+			kernel_init_argsort.setArg(1, buffer_keys);
+			kernel_init_argsort.setArg(2, buffer_vals);
+			kernel_init_argsort.setArg(3, (cl_int)row_count);
+
+			queue.enqueueNDRangeKernel(kernel_init_argsort, cl::NullRange, cl::NDRange(sort_elements), cl::NDRange(local_size), NULL, &prof_event_ARGSORT);
+			argsort_events.push_back(prof_event_ARGSORT);
+			profiler.Kernel(kernel_init_argsort, prof_event_ARGSORT, sort_elements * (2 * sizeof(float) + sizeof(cl_int)));
+
+			size_t sort_first = argsort_events.size();
+			EnqueueBitonicSort(queue, program, "kv", buffer_keys, buffer_vals, sort_elements, sizeof(float), local_size, &argsort_events);
+			profiler.Kernels("bitonic_kv", argsort_events, sort_first);
+
+			// gather the k coldest and k hottest records with their station and timestamp
+			cl::Kernel kernel_gather_extremes = cl::Kernel(program, "gather_extremes");
+			kernel_gather_extremes.setArg(0, buffer_keys);
+			kernel_gather_extremes.setArg(1, buffer_vals);
+			kernel_gather_extremes.setArg(2, buffer_station);
+			kernel_gather_extremes.setArg(3, buffer_time);
+			kernel_gather_extremes.setArg(4, buffer_extreme_temp);
+			kernel_gather_extremes.setArg(5, buffer_extreme_station);
+			kernel_gather_extremes.setArg(6, buffer_extreme_time);
+			kernel_gather_extremes.setArg(7, (cl_int)row_count);
+
+			queue.enqueueNDRangeKernel(kernel_gather_extremes, cl::NullRange, cl::NDRange(2 * extremes_count), cl::NullRange, NULL, &prof_event_ARGSORT);
+			argsort_events.push_back(prof_event_ARGSORT);
+			profiler.Kernel(kernel_gather_extremes, prof_event_ARGSORT);
+
+			queue.enqueueReadBuffer(buffer_extreme_temp, CL_TRUE, 0, extremeTemp.size() * sizeof(float), &extremeTemp[0], NULL, &prof_event_ARGSORT_mem);
+			profiler.Transfer("read extreme_temp", prof_event_ARGSORT_mem, extremeTemp.size() * sizeof(float));
+			queue.enqueueReadBuffer(buffer_extreme_station, CL_TRUE, 0, extremeStation.size() * sizeof(cl_int), &extremeStation[0], NULL, &prof_event_ARGSORT_mem);
+			profiler.Transfer("read extreme_station", prof_event_ARGSORT_mem, extremeStation.size() * sizeof(cl_int));
+			queue.enqueueReadBuffer(buffer_extreme_time, CL_TRUE, 0, extremeTime.size() * sizeof(cl_uint), &extremeTime[0], NULL, &prof_event_ARGSORT_mem);
+			profiler.Transfer("read extreme_time", prof_event_ARGSORT_mem, extremeTime.size() * sizeof(cl_uint));
+
+			pool.Release(buffer_keys);
+			pool.Release(buffer_vals);
+			pool.Release(buffer_extreme_temp);
+			pool.Release(buffer_extreme_station);
+			pool.Release(buffer_extreme_time);
+
+			argsort_kernel_time = GetKernelTime(argsort_events);
+			argsort_memory_time = profiler.Total("ARGSORT", PROFILED_TRANSFER);
+		}
+		else
 		{
-			kernel_max.setArg(0, buffer_C);
-			kernel_max.setArg(1, buffer_C);
-			kernel_max.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
+			// ********** TOP-K KERNEL **********
+			ProfileScope topk_scope(profiler, "TOPK");
+			// every workgroup keeps the TOPK largest (smallest) readings of its chunk, the lists are then merged
+			// in further passes until TOPK are left, so only O(N) work and a 2k element readback
+			size_t topk_groups = (row_count + local_size - 1) / local_size;
+
+			cl::Buffer buffer_topk_keys[2];
+			cl::Buffer buffer_topk_vals[2];
+			// ping-pong buffers, each pass reads the lists of the previous one
+			for (int i = 0; i < 2; i++)
+			{
+				buffer_topk_keys[i] = pool.Acquire(topk_groups * top_k * sizeof(float));
+				buffer_topk_vals[i] = pool.Acquire(topk_groups * top_k * sizeof(cl_int));
+			}
+
+			cl::Kernel kernel_topk = cl::Kernel(program, "reduce_topk_4");
+			cl::Kernel kernel_merge_topk = cl::Kernel(program, "merge_topk_4");
+
+			std::vector<float> topkTemp(top_k);
+			std::vector<cl_int> topkStation(top_k);
+			std::vector<cl_uint> topkTime(top_k);
+
+			cl::Buffer buffer_topk_station = pool.Acquire(top_k * sizeof(cl_int));
+			cl::Buffer buffer_topk_time = pool.Acquire(top_k * sizeof(cl_uint));
+
+			cl::Kernel kernel_gather_records = cl::Kernel(program, "gather_records");
+
+			// largest = 1 for the hottest readings, 0 for the coldest
+			for (cl_int largest = 1; largest >= 0; largest--)
+			{
+				size_t remaining = topk_groups * top_k;
+				// number of values left after the first pass
+				int current = 0;
+
+				kernel_topk.setArg(0, buffer_A);
+				kernel_topk.setArg(1, buffer_topk_keys[current]);
+				kernel_topk.setArg(2, buffer_topk_vals[current]);
+				kernel_topk.setArg(3, cl::Local(local_size * sizeof(float)));
+				kernel_topk.setArg(4, cl::Local(local_size * sizeof(cl_int)));
+				kernel_topk.setArg(5, (cl_int)row_count);
+				kernel_topk.setArg(6, largest);
+
+				queue.enqueueNDRangeKernel(kernel_topk, cl::NullRange, cl::NDRange(topk_groups * local_size), cl::NDRange(local_size), NULL, &prof_event_TOPK);
+				topk_events.push_back(prof_event_TOPK);
+				profiler.Kernel(kernel_topk, prof_event_TOPK, row_count * sizeof(float));
+
+				// merge the per-workgroup lists until only one is left
+				while (remaining > (size_t)top_k)
+				{
+					size_t merge_groups = (remaining + local_size - 1) / local_size;
+
+					kernel_merge_topk.setArg(0, buffer_topk_keys[current]);
+					kernel_merge_topk.setArg(1, buffer_topk_vals[current]);
+					kernel_merge_topk.setArg(2, buffer_topk_keys[1 - current]);
+					kernel_merge_topk.setArg(3, buffer_topk_vals[1 - current]);
+					kernel_merge_topk.setArg(4, cl::Local(local_size * sizeof(float)));
+					kernel_merge_topk.setArg(5, cl::Local(local_size * sizeof(cl_int)));
+					kernel_merge_topk.setArg(6, (cl_int)remaining);
+					kernel_merge_topk.setArg(7, largest);
+
+					queue.enqueueNDRangeKernel(kernel_merge_topk, cl::NullRange, cl::NDRange(merge_groups * local_size), cl::NDRange(local_size), NULL, &prof_event_TOPK);
+					topk_events.push_back(prof_event_TOPK);
+					profiler.Kernel(kernel_merge_topk, prof_event_TOPK, remaining * (sizeof(float) + sizeof(cl_int)));
+
+					remaining = merge_groups * top_k;
+					current = 1 - current;
+				}
+
+				queue.enqueueReadBuffer(buffer_topk_keys[current], CL_TRUE, 0, top_k * sizeof(float), &topkTemp[0], NULL, &prof_event_TOPK_mem);
+				profiler.Transfer("read topk_keys", prof_event_TOPK_mem, top_k * sizeof(float));
+
+				// station and timestamp of the k records are gathered on the device, the indices refer to the
+				// filtered columns when -f is used so they cannot be looked up in the host columns
+				kernel_gather_records.setArg(0, buffer_topk_vals[current]);
+				kernel_gather_records.setArg(1, buffer_station);
+				kernel_gather_records.setArg(2, buffer_time);
+				kernel_gather_records.setArg(3, buffer_topk_station);
+				kernel_gather_records.setArg(4, buffer_topk_time);
+				kernel_gather_records.setArg(5, (cl_int)extremes_count);
+
+				queue.enqueueNDRangeKernel(kernel_gather_records, cl::NullRange, cl::NDRange(extremes_count), cl::NullRange, NULL, &prof_event_TOPK);
+				topk_events.push_back(prof_event_TOPK);
+				profiler.Kernel(kernel_gather_records, prof_event_TOPK);
+
+				queue.enqueueReadBuffer(buffer_topk_station, CL_TRUE, 0, extremes_count * sizeof(cl_int), &topkStation[0], NULL, &prof_event_TOPK_mem);
+				profiler.Transfer("read topk_station", prof_event_TOPK_mem, extremes_count * sizeof(cl_int));
+				queue.enqueueReadBuffer(buffer_topk_time, CL_TRUE, 0, extremes_count * sizeof(cl_uint), &topkTime[0], NULL, &prof_event_TOPK_mem);
+				profiler.Transfer("read topk_time", prof_event_TOPK_mem, extremes_count * sizeof(cl_uint));
+
+				for (size_t i = 0; i < extremes_count; i++)
+				{
+					size_t j = largest ? extremes_count + i : i;
+					extremeTemp[j] = topkTemp[i];
+					extremeStation[j] = topkStation[i];
+					extremeTime[j] = topkTime[i];
+				}
+			}
+
+			for (int i = 0; i < 2; i++)
+			{
+				pool.Release(buffer_topk_keys[i]);
+				pool.Release(buffer_topk_vals[i]);
+			}
+			pool.Release(buffer_topk_station);
+			pool.Release(buffer_topk_time);
+
+			topk_kernel_time = GetKernelTime(topk_events);
+			topk_memory_time = profiler.Total("TOPK", PROFILED_TRANSFER);
+		}
 
-			queue.enqueueNDRangeKernel(kernel_max, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_MAX);
-			queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, output_size, &Cmax[0], NULL, &prof_event_MAX_mem);
-			max_kernel_time += prof_event_MAX.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MAX.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-			max_memory_time += prof_event_MAX_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MAX_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		// ********** PER-STATION KERNEL **********
+		// count, sum, sum of squares, min and max of every station from a single read of the data
+		// the workgroups accumulate in local memory and merge into the global table with atomics
+		ProfileScope station_scope(profiler, "STATION");
+		size_t station_count = columns.stationNames.size();
+
+		std::vector<float> stationStats(station_count * MOMENTS);
+		std::vector<cl_int> stationCounts(station_count);
+
+		cl::Buffer buffer_station_stats = pool.Acquire(stationStats.size() * sizeof(float));
+		cl::Buffer buffer_station_counts = pool.Acquire(stationCounts.size() * sizeof(cl_int));
+
+		cl::Event prof_event_STATION;
+		std::vector<cl::Event> station_events;
+		cl_ulong station_kernel_time;
+		cl::Event prof_event_STATION_mem;
+		cl_ulong station_memory_time;
+
+		cl::Kernel kernel_init_group_stats = cl::Kernel(program, "init_group_stats");
+		kernel_init_group_stats.setArg(0, buffer_station_stats);
+		kernel_init_group_stats.setArg(1, buffer_station_counts);
+
+		queue.enqueueNDRangeKernel(kernel_init_group_stats, cl::NullRange, cl::NDRange(station_count), cl::NullRange, NULL, &prof_event_STATION);
+		station_events.push_back(prof_event_STATION);
+		profiler.Kernel(kernel_init_group_stats, prof_event_STATION);
+
+		cl::Kernel kernel_station_stats = cl::Kernel(program, "reduce_station_stats");
+		kernel_station_stats.setArg(0, buffer_A);
+		kernel_station_stats.setArg(1, buffer_station);
+		kernel_station_stats.setArg(2, buffer_station_stats);
+		kernel_station_stats.setArg(3, buffer_station_counts);
+		kernel_station_stats.setArg(4, cl::Local(station_count * MOMENTS * sizeof(float)));
+		kernel_station_stats.setArg(5, cl::Local(station_count * sizeof(cl_int)));
+		kernel_station_stats.setArg(6, (cl_int)row_count);
+		kernel_station_stats.setArg(7, (cl_int)station_count);
+
+		queue.enqueueNDRangeKernel(kernel_station_stats, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_STATION);
+		station_events.push_back(prof_event_STATION);
+		profiler.Kernel(kernel_station_stats, prof_event_STATION, row_count * (sizeof(float) + sizeof(cl_int)));
+
+		queue.enqueueReadBuffer(buffer_station_stats, CL_TRUE, 0, stationStats.size() * sizeof(float), &stationStats[0], NULL, &prof_event_STATION_mem);
+		profiler.Transfer("read station_stats", prof_event_STATION_mem, stationStats.size() * sizeof(float));
+		queue.enqueueReadBuffer(buffer_station_counts, CL_TRUE, 0, stationCounts.size() * sizeof(cl_int), &stationCounts[0], NULL, &prof_event_STATION_mem);
+		profiler.Transfer("read station_counts", prof_event_STATION_mem, stationCounts.size() * sizeof(cl_int));
+		station_kernel_time = GetKernelTime(station_events);
+		station_memory_time = profiler.Total("STATION", PROFILED_TRANSFER);
+
+		std::vector<GroupStats> stationGroups = ToGroupStats(stationStats, stationCounts);
+		station_scope.End();
+
+		// ********** CALENDAR KERNEL **********
+		// dense group-by on year, year * 12 + month, day of year or hour of day, computed from the timestamp column
+		// buckets are privatised in local memory when they fit, otherwise every reading goes to the global table
+		std::vector<GroupStats> calendarGroups;
+
+		cl::Event prof_event_CALENDAR;
+		std::vector<cl::Event> calendar_events;
+		cl_ulong calendar_kernel_time = 0;
+		cl::Event prof_event_CALENDAR_mem;
+		cl_ulong calendar_memory_time = 0;
+
+		if (calendar_key >= 0)
+		{
+			ProfileScope calendar_scope(profiler, "CALENDAR");
+			size_t bucket_count = CalendarBucketCount(calendar_key, columns);
+			size_t bucket_local_size = bucket_count * (MOMENTS * sizeof(float) + sizeof(cl_int));
+			bool privatize = bucket_local_size <= device_info.localMemSize;
+
+			std::vector<float> calendarStats(bucket_count * MOMENTS);
+			std::vector<cl_int> calendarCounts(bucket_count);
+
+			cl::Buffer buffer_calendar_stats = pool.Acquire(calendarStats.size() * sizeof(float));
+			cl::Buffer buffer_calendar_counts = pool.Acquire(calendarCounts.size() * sizeof(cl_int));
+
+			kernel_init_group_stats.setArg(0, buffer_calendar_stats);
+			kernel_init_group_stats.setArg(1, buffer_calendar_counts);
+
+			queue.enqueueNDRangeKernel(kernel_init_group_stats, cl::NullRange, cl::NDRange(bucket_count), cl::NullRange, NULL, &prof_event_CALENDAR);
+			calendar_events.push_back(prof_event_CALENDAR);
+			profiler.Kernel(kernel_init_group_stats, prof_event_CALENDAR);
+
+			if (privatize)
+			{
+				cl::Kernel kernel_calendar = cl::Kernel(program, "reduce_calendar_stats");
+				kernel_calendar.setArg(0, buffer_A);
+				kernel_calendar.setArg(1, buffer_time);
+				kernel_calendar.setArg(2, buffer_calendar_stats);
+				kernel_calendar.setArg(3, buffer_calendar_counts);
+				kernel_calendar.setArg(4, cl::Local(bucket_count * MOMENTS * sizeof(float)));
+				kernel_calendar.setArg(5, cl::Local(bucket_count * sizeof(cl_int)));
+				kernel_calendar.setArg(6, (cl_int)row_count);
+				kernel_calendar.setArg(7, (cl_int)calendar_key);
+				kernel_calendar.setArg(8, (cl_int)columns.firstYear);
+				kernel_calendar.setArg(9, (cl_int)bucket_count);
+
+				queue.enqueueNDRangeKernel(kernel_calendar, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_CALENDAR);
+				profiler.Kernel(kernel_calendar, prof_event_CALENDAR, row_count * (sizeof(float) + sizeof(cl_uint)));
+			}
+			else
+			{
+				cl::Kernel kernel_calendar = cl::Kernel(program, "reduce_calendar_stats_global");
+				kernel_calendar.setArg(0, buffer_A);
+				kernel_calendar.setArg(1, buffer_time);
+				kernel_calendar.setArg(2, buffer_calendar_stats);
+				kernel_calendar.setArg(3, buffer_calendar_counts);
+				kernel_calendar.setArg(4, (cl_int)row_count);
+				kernel_calendar.setArg(5, (cl_int)calendar_key);
+				kernel_calendar.setArg(6, (cl_int)columns.firstYear);
+
+				queue.enqueueNDRangeKernel(kernel_calendar, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_CALENDAR);
+				profiler.Kernel(kernel_calendar, prof_event_CALENDAR, row_count * (sizeof(float) + sizeof(cl_uint)));
+			}
+			calendar_events.push_back(prof_event_CALENDAR);
+
+			queue.enqueueReadBuffer(buffer_calendar_stats, CL_TRUE, 0, calendarStats.size() * sizeof(float), &calendarStats[0], NULL, &prof_event_CALENDAR_mem);
+			profiler.Transfer("read calendar_stats", prof_event_CALENDAR_mem, calendarStats.size() * sizeof(float));
+			queue.enqueueReadBuffer(buffer_calendar_counts, CL_TRUE, 0, calendarCounts.size() * sizeof(cl_int), &calendarCounts[0], NULL, &prof_event_CALENDAR_mem);
+			profiler.Transfer("read calendar_counts", prof_event_CALENDAR_mem, calendarCounts.size() * sizeof(cl_int));
+			pool.Release(buffer_calendar_stats);
+			pool.Release(buffer_calendar_counts);
+
+			calendar_kernel_time = GetKernelTime(calendar_events);
+			calendar_memory_time = profiler.Total("CALENDAR", PROFILED_TRANSFER);
+
+			calendarGroups = ToGroupStats(calendarStats, calendarCounts);
 		}
 
-		
+		// ********** HASH GROUP-BY KERNEL **********
+		// group-by on composite keys such as station x date, the groups live in an open addressing hash table
+		// on the device and only the compacted used slots are read back
+		std::vector<cl_uint> hashKeys;
+		std::vector<GroupStats> hashGroups;
 
-		float maxTemp = Cmax[0];
-
-		// ********** MIN KERNEL **********
-		cl::Kernel kernel_min = cl::Kernel(program, "reduce_min_4");
-		kernel_min.setArg(0, buffer_A);
-		kernel_min.setArg(1, buffer_D);
-		kernel_min.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
-
-		cl::Event prof_event_MIN;
-		float min_kernel_time;
-		float min_single_kernel;
-		cl::Event prof_event_MIN_mem;
-		float min_memory_time;
-		queue.enqueueNDRangeKernel(kernel_min, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_MIN);
-		queue.enqueueReadBuffer(buffer_D, CL_TRUE, 0, output_size, &Dmin[0], NULL, &prof_event_MIN_mem);
-		min_kernel_time = prof_event_MIN.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MIN.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		min_single_kernel = prof_event_MIN.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MIN.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		min_memory_time = prof_event_MIN_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MIN_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-
-		// reduce until left with a single value
-		while (Dmin[1] != 0.0f)
-		{
-			kernel_min.setArg(0, buffer_D);
-			kernel_min.setArg(1, buffer_D);
-			kernel_min.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
-
-			queue.enqueueNDRangeKernel(kernel_min, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_MIN);
-			queue.enqueueReadBuffer(buffer_D, CL_TRUE, 0, output_size, &Dmin[0], NULL, &prof_event_MIN_mem);
-			min_kernel_time += prof_event_MIN.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MIN.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-			min_memory_time += prof_event_MIN_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_MIN_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		}
-
-		float minTemp = Dmin[0];
-
-		// ********** STAND DEV KERNEL **********
-		cl::Kernel kernel_standDev = cl::Kernel(program, "reduce_standDev_4");
-		kernel_standDev.setArg(0, buffer_A);
-		kernel_standDev.setArg(1, buffer_standdev);
-		kernel_standDev.setArg(2, buffer_B); // pass through the output from reduce add to get mean for stand dev
-		kernel_standDev.setArg(3, cl::Local(local_size * sizeof(mytype)));
-
-		cl::Event prof_event_STANDDEV;
-		float standdev_kernel_time;
-		float standdev_single_kernel;
-		cl::Event prof_event_STANDDEV_mem;
-		float standdev_memory_time;
-		queue.enqueueNDRangeKernel(kernel_standDev, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_STANDDEV);
-		queue.enqueueReadBuffer(buffer_standdev, CL_TRUE, 0, output_size, &Estanddev[0], NULL, &prof_event_STANDDEV_mem);
-		standdev_kernel_time = prof_event_STANDDEV.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_STANDDEV.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		standdev_single_kernel = prof_event_STANDDEV.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_STANDDEV.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		standdev_memory_time = prof_event_STANDDEV_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_STANDDEV_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		
+		cl::Event prof_event_HASH;
+		std::vector<cl::Event> hash_events;
+		cl_ulong hash_kernel_time = 0;
+		cl::Event prof_event_HASH_mem;
+		cl_ulong hash_memory_time = 0;
 
-		while (Estanddev[1] != 0.0f)
+		if (hash_key >= 0)
 		{
-			// call add kernel to sum up all the (value - mean)^2 values
-			kernel_add.setArg(0, buffer_standdev);
-			kernel_add.setArg(1, buffer_standdev);
-			kernel_add.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
+			ProfileScope hash_scope(profiler, "HASH");
+			size_t hash_capacity = local_size;
+			while (hash_capacity < 2 * std::min(HashGroupBound(hash_key, columns), row_count))
+			{
+				hash_capacity *= 2;
+			}
+			// power of 2 with a load factor of at most 1/2
+
+			cl::Buffer buffer_hash_keys = pool.Acquire(hash_capacity * sizeof(cl_uint));
+			cl::Buffer buffer_hash_stats = pool.Acquire(hash_capacity * MOMENTS * sizeof(float));
+			cl::Buffer buffer_hash_counts = pool.Acquire(hash_capacity * sizeof(cl_int));
+			cl::Buffer buffer_group_keys = pool.Acquire(hash_capacity * sizeof(cl_uint));
+			cl::Buffer buffer_group_stats = pool.Acquire(hash_capacity * MOMENTS * sizeof(float));
+			cl::Buffer buffer_group_counts = pool.Acquire(hash_capacity * sizeof(cl_int));
+			cl::Buffer buffer_group_total = pool.Acquire(sizeof(cl_int));
+
+			queue.enqueueFillBuffer(buffer_hash_keys, (cl_uint)0xFFFFFFFF, 0, hash_capacity * sizeof(cl_uint)); // all slots empty
+			queue.enqueueFillBuffer(buffer_group_total, (cl_int)0, 0, sizeof(cl_int));
+
+			kernel_init_group_stats.setArg(0, buffer_hash_stats);
+			kernel_init_group_stats.setArg(1, buffer_hash_counts);
+
+			queue.enqueueNDRangeKernel(kernel_init_group_stats, cl::NullRange, cl::NDRange(hash_capacity), cl::NDRange(local_size), NULL, &prof_event_HASH);
+			hash_events.push_back(prof_event_HASH);
+			profiler.Kernel(kernel_init_group_stats, prof_event_HASH);
+
+			cl::Kernel kernel_hash = cl::Kernel(program, "hash_group_stats");
+			kernel_hash.setArg(0, buffer_A);
+			kernel_hash.setArg(1, buffer_station);
+			kernel_hash.setArg(2, buffer_time);
+			kernel_hash.setArg(3, buffer_hash_keys);
+			kernel_hash.setArg(4, buffer_hash_stats);
+			kernel_hash.setArg(5, buffer_hash_counts);
+			kernel_hash.setArg(6, (cl_int)row_count);
+			kernel_hash.setArg(7, (cl_int)hash_key);
+			kernel_hash.setArg(8, (cl_uint)(hash_capacity - 1));
+
+			queue.enqueueNDRangeKernel(kernel_hash, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_HASH);
+			hash_events.push_back(prof_event_HASH);
+			profiler.Kernel(kernel_hash, prof_event_HASH, row_count * record_size);
+
+			cl::Kernel kernel_compact_hash = cl::Kernel(program, "compact_hash_groups");
+			kernel_compact_hash.setArg(0, buffer_hash_keys);
+			kernel_compact_hash.setArg(1, buffer_hash_stats);
+			kernel_compact_hash.setArg(2, buffer_hash_counts);
+			kernel_compact_hash.setArg(3, buffer_group_keys);
+			kernel_compact_hash.setArg(4, buffer_group_stats);
+			kernel_compact_hash.setArg(5, buffer_group_counts);
+			kernel_compact_hash.setArg(6, buffer_group_total);
+
+			queue.enqueueNDRangeKernel(kernel_compact_hash, cl::NullRange, cl::NDRange(hash_capacity), cl::NDRange(local_size), NULL, &prof_event_HASH);
+			hash_events.push_back(prof_event_HASH);
+			profiler.Kernel(kernel_compact_hash, prof_event_HASH);
+
+			// read the number of groups first so only the used rows are transferred
+			cl_int group_total = 0;
+			queue.enqueueReadBuffer(buffer_group_total, CL_TRUE, 0, sizeof(cl_int), &group_total, NULL, &prof_event_HASH_mem);
+			profiler.Transfer("read group_total", prof_event_HASH_mem, sizeof(cl_int));
+
+			if (group_total)
+			{
+				std::vector<float> groupStats(group_total * MOMENTS);
+				std::vector<cl_int> groupCounts(group_total);
+				hashKeys.resize(group_total);
+
+				queue.enqueueReadBuffer(buffer_group_keys, CL_TRUE, 0, group_total * sizeof(cl_uint), &hashKeys[0], NULL, &prof_event_HASH_mem);
+				profiler.Transfer("read group_keys", prof_event_HASH_mem, group_total * sizeof(cl_uint));
+				queue.enqueueReadBuffer(buffer_group_stats, CL_TRUE, 0, groupStats.size() * sizeof(float), &groupStats[0], NULL, &prof_event_HASH_mem);
+				profiler.Transfer("read group_stats", prof_event_HASH_mem, groupStats.size() * sizeof(float));
+				queue.enqueueReadBuffer(buffer_group_counts, CL_TRUE, 0, groupCounts.size() * sizeof(cl_int), &groupCounts[0], NULL, &prof_event_HASH_mem);
+				profiler.Transfer("read group_counts", prof_event_HASH_mem, groupCounts.size() * sizeof(cl_int));
+
+				hashGroups = ToGroupStats(groupStats, groupCounts);
+			}
+
+			pool.Release(buffer_hash_keys);
+			pool.Release(buffer_hash_stats);
+			pool.Release(buffer_hash_counts);
+			pool.Release(buffer_group_keys);
+			pool.Release(buffer_group_stats);
+			pool.Release(buffer_group_counts);
+			pool.Release(buffer_group_total);
+
+			hash_kernel_time = GetKernelTime(hash_events);
+			hash_memory_time = profiler.Total("HASH", PROFILED_TRANSFER);
+		}
+
+		// ********** BITMAP INDEX KERNELS **********
+		// word packed bitmaps of every station, month and hour, the -m query combines them 32 records per
+		// work item and the resulting mask restricts the per-station reduction
+		std::vector<GroupStats> bitmapGroups;
 
-			queue.enqueueNDRangeKernel(kernel_add, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_STANDDEV);
-			queue.enqueueReadBuffer(buffer_standdev, CL_TRUE, 0, output_size, &Estanddev[0], NULL, &prof_event_STANDDEV_mem);
-			standdev_kernel_time += prof_event_STANDDEV.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_STANDDEV.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-			standdev_memory_time += prof_event_STANDDEV_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_STANDDEV_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		std::vector<cl::Event> bitmap_events;
+		cl_ulong bitmap_kernel_time = 0;
+
+		if (!bitmap_query.empty())
+		{
+			ProfileScope bitmap_scope(profiler, "BITMAP");
+			size_t bitmap_words = (row_count + 31) / 32;
+			size_t bitmap_count = BitmapCount(columns);
+
+			cl::Buffer buffer_bitmaps = pool.Acquire(bitmap_count * bitmap_words * sizeof(cl_uint));
+			cl::Buffer buffer_mask = pool.Acquire(bitmap_words * sizeof(cl_uint));
+			cl::Buffer buffer_bitmap_ids = pool.Acquire(bitmapIds.size() * sizeof(cl_int));
+			cl::Buffer buffer_bitmap_clauses = pool.Acquire(bitmapClauses.size() * sizeof(cl_int));
+
+			queue.enqueueFillBuffer(buffer_bitmaps, 0, 0, bitmap_count * bitmap_words * sizeof(cl_uint));
+			queue.enqueueWriteBuffer(buffer_bitmap_ids, CL_TRUE, 0, bitmapIds.size() * sizeof(cl_int), &bitmapIds[0]);
+			queue.enqueueWriteBuffer(buffer_bitmap_clauses, CL_TRUE, 0, bitmapClauses.size() * sizeof(cl_int), &bitmapClauses[0]);
+
+			cl::Event prof_event_BITMAP;
+
+			cl::Kernel kernel_build_bitmaps = cl::Kernel(program, "build_bitmaps");
+			kernel_build_bitmaps.setArg(0, buffer_station);
+			kernel_build_bitmaps.setArg(1, buffer_time);
+			kernel_build_bitmaps.setArg(2, buffer_bitmaps);
+			kernel_build_bitmaps.setArg(3, (cl_int)bitmap_words);
+			kernel_build_bitmaps.setArg(4, (cl_int)station_count);
+			kernel_build_bitmaps.setArg(5, (cl_int)row_count);
+
+			queue.enqueueNDRangeKernel(kernel_build_bitmaps, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_BITMAP);
+			bitmap_events.push_back(prof_event_BITMAP);
+			profiler.Kernel(kernel_build_bitmaps, prof_event_BITMAP, row_count * (sizeof(cl_int) + sizeof(cl_uint)));
+
+			cl::Kernel kernel_combine_bitmaps = cl::Kernel(program, "combine_bitmaps");
+			kernel_combine_bitmaps.setArg(0, buffer_bitmaps);
+			kernel_combine_bitmaps.setArg(1, buffer_bitmap_ids);
+			kernel_combine_bitmaps.setArg(2, buffer_bitmap_clauses);
+			kernel_combine_bitmaps.setArg(3, (cl_int)bitmapClauses.size() - 1);
+			kernel_combine_bitmaps.setArg(4, buffer_mask);
+			kernel_combine_bitmaps.setArg(5, (cl_int)bitmap_words);
+
+			queue.enqueueNDRangeKernel(kernel_combine_bitmaps, cl::NullRange, cl::NDRange(((bitmap_words + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), NULL, &prof_event_BITMAP);
+			bitmap_events.push_back(prof_event_BITMAP);
+			profiler.Kernel(kernel_combine_bitmaps, prof_event_BITMAP);
+
+			std::vector<float> bitmapStats(station_count * MOMENTS);
+			std::vector<cl_int> bitmapCounts(station_count);
+
+			cl::Buffer buffer_bitmap_stats = pool.Acquire(bitmapStats.size() * sizeof(float));
+			cl::Buffer buffer_bitmap_counts = pool.Acquire(bitmapCounts.size() * sizeof(cl_int));
+
+			kernel_init_group_stats.setArg(0, buffer_bitmap_stats);
+			kernel_init_group_stats.setArg(1, buffer_bitmap_counts);
+
+			queue.enqueueNDRangeKernel(kernel_init_group_stats, cl::NullRange, cl::NDRange(station_count), cl::NullRange, NULL, &prof_event_BITMAP);
+			bitmap_events.push_back(prof_event_BITMAP);
+			profiler.Kernel(kernel_init_group_stats, prof_event_BITMAP);
+
+			cl::Kernel kernel_masked_stats = cl::Kernel(program, "reduce_masked_stats");
+			kernel_masked_stats.setArg(0, buffer_A);
+			kernel_masked_stats.setArg(1, buffer_station);
+			kernel_masked_stats.setArg(2, buffer_mask);
+			kernel_masked_stats.setArg(3, buffer_bitmap_stats);
+			kernel_masked_stats.setArg(4, buffer_bitmap_counts);
+			kernel_masked_stats.setArg(5, cl::Local(station_count * MOMENTS * sizeof(float)));
+			kernel_masked_stats.setArg(6, cl::Local(station_count * sizeof(cl_int)));
+			kernel_masked_stats.setArg(7, (cl_int)row_count);
+			kernel_masked_stats.setArg(8, (cl_int)station_count);
+
+			queue.enqueueNDRangeKernel(kernel_masked_stats, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_BITMAP);
+			bitmap_events.push_back(prof_event_BITMAP);
+			profiler.Kernel(kernel_masked_stats, prof_event_BITMAP, row_count * (sizeof(float) + sizeof(cl_int)));
+
+			queue.enqueueReadBuffer(buffer_bitmap_stats, CL_TRUE, 0, bitmapStats.size() * sizeof(float), &bitmapStats[0]);
+			queue.enqueueReadBuffer(buffer_bitmap_counts, CL_TRUE, 0, bitmapCounts.size() * sizeof(cl_int), &bitmapCounts[0]);
+
+			pool.Release(buffer_bitmaps);
+			pool.Release(buffer_mask);
+			pool.Release(buffer_bitmap_ids);
+			pool.Release(buffer_bitmap_clauses);
+			pool.Release(buffer_bitmap_stats);
+			pool.Release(buffer_bitmap_counts);
+
+			bitmapGroups = ToGroupStats(bitmapStats, bitmapCounts);
+			bitmap_kernel_time = GetKernelTime(bitmap_events);
 		}
 
-		float variance = (Estanddev[0] / numberOfElements);
-		float standDev = sqrt(variance);
+		// ********** QUERY KERNELS **********
+		// every ad-hoc query runs as its own generated kernel, programs are shared between queries of the same shape
+		QueryProgramCache query_programs;
+		string query_prelude = QueryPrelude((const char*)MY_KERNELS_3_CL, sizeof(MY_KERNELS_3_CL));
+		std::vector<std::vector<string> > queryRows(queries.size());
+		int query_programs_built = 0;
 
-		// ********** SORT KERNEL **********
-		cl::Kernel kernel_sort = cl::Kernel(program, "sort");
-		//cl::Kernel kernel_sort = cl::Kernel(program, "sort_oddeven");
-		kernel_sort.setArg(0, buffer_A);
-		kernel_sort.setArg(1, buffer_sorted);
-		kernel_sort.setArg(2, cl::Local(local_size * sizeof(mytype)));
-
-		cl::Event prof_event_SORT;
-		float sort_kernel_time;
-		cl::Event prof_event_SORT_mem;
-		float sort_memory_time;
-		//queue.enqueueNDRangeKernel(kernel_sort, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_SORT);
-		//queue.enqueueReadBuffer(buffer_sorted, CL_TRUE, 0, sorted_size, &sortedVec[0], NULL, &prof_event_SORT_mem);
-		//sort_kernel_time = prof_event_SORT.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_SORT.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		//sort_memory_time = prof_event_SORT_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_SORT_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-
-		//for (int i = 0; i < tempInfo.size() / 2; i++)
-		//{
-		//	kernel_sort.setArg(0, buffer_sorted);
-		//	kernel_sort.setArg(1, buffer_sorted);
-
-		//	queue.enqueueNDRangeKernel(kernel_sort, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_SORT);
-		//	queue.enqueueReadBuffer(buffer_sorted, CL_TRUE, 0, sorted_size, &sortedVec[0], NULL, &prof_event_SORT_mem);
-		//	sort_kernel_time += prof_event_SORT.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_SORT.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		//	sort_memory_time = prof_event_SORT_mem.getProfilingInfo<CL_PROFILING_COMMAND_END>() - prof_event_SORT_mem.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		//}
-		//// call kernel N/2 times
-		
-		//float medianTemp = sortedVec[A.size() / 2]; // may be wrong because of extra padded 0's
-		//float firstQaut = sortedVec[A.size() / 4];
-		//float thirdQuat = sortedVec[3 * A.size() / 4];
-		//float interQuatRange = thirdQuat - firstQaut;
-		// calculating median and quatiles by taking their values from the sorted vector
+		std::vector<cl::Event> query_events;
+		cl_ulong query_kernel_time = 0;
+
+		for (size_t q = 0; q < queries.size(); q++)
+		{
+			ProfileScope query_scope(profiler, "QUERY");
+			size_t query_first = query_events.size();
+			bool built = false;
+			queryRows[q] = RunQuery(context, queue, pool, query_programs, query_prelude, queries[q], buffer_A, buffer_station, buffer_time, row_count, local_size, columns, built, &query_events);
+			query_programs_built += built ? 1 : 0;
+			profiler.Kernels("query_" + std::to_string(q), query_events, query_first);
+		}
+
+		query_kernel_time = GetKernelTime(query_events);
+
+		// ********** TIME ORDER KERNEL **********
+		// sorts the records by (station, timestamp) on the device, so every station becomes one contiguous
+		// time ordered segment of the buffer_time_* columns, segments[s] is the first record of station s
+		// the permutation is stored next to the data file and reused by later runs on the same data
+		bool time_order = window > 0 || streaks || !time_range.empty();
+		bool time_index_loaded = false;
+
+		std::vector<cl_int> segments(station_count + 1, 0);
+		for (size_t i = 0; i < station_count; i++)
+		{
+			segments[i + 1] = segments[i] + stationGroups[i].count;
+		}
+
+		cl::Buffer buffer_time_temp;
+		cl::Buffer buffer_time_station;
+		cl::Buffer buffer_time_time;
+		cl::Buffer buffer_segments;
+
+		std::vector<cl::Event> time_order_events;
+		cl_ulong time_order_kernel_time = 0;
+
+		if (time_order)
+		{
+			ProfileScope time_order_scope(profiler, "TIME_ORDER");
+			size_t time_sort_elements = local_size;
+			while (time_sort_elements < row_count)
+			{
+				time_sort_elements *= 2;
+			}
+
+			cl::Buffer buffer_time_keys = pool.Acquire(time_sort_elements * sizeof(cl_ulong));
+			cl::Buffer buffer_time_order = pool.Acquire(time_sort_elements * sizeof(cl_int));
+
+			buffer_time_temp = pool.Acquire(row_count * sizeof(float));
+			buffer_time_station = pool.Acquire(station_size);
+			buffer_time_time = pool.Acquire(time_size);
+			buffer_segments = pool.Acquire(segments.size() * sizeof(cl_int));
+
+			queue.enqueueWriteBuffer(buffer_segments, CL_TRUE, 0, segments.size() * sizeof(cl_int), &segments[0]);
+
+			cl::Event prof_event_TIME_ORDER;
+
+			string time_index_file = fileDir + ".timeidx";
+			std::vector<cl_int> timeIndex;
+
+			// the stored permutation covers all records, a filtered run sorts its selection instead
+			time_index_loaded = predicates.empty() && LoadTimeIndex(time_index_file, columns, timeIndex);
+
+			if (time_index_loaded)
+			{
+				queue.enqueueWriteBuffer(buffer_time_order, CL_TRUE, 0, timeIndex.size() * sizeof(cl_int), &timeIndex[0]);
+			}
+			else
+			{
+				cl::Kernel kernel_init_time_sort = cl::Kernel(program, "init_time_sort");
+				kernel_init_time_sort.setArg(0, buffer_station);
+				kernel_init_time_sort.setArg(1, buffer_time);
+				kernel_init_time_sort.setArg(2, buffer_time_keys);
+				kernel_init_time_sort.setArg(3, buffer_time_order);
+				kernel_init_time_sort.setArg(4, (cl_int)row_count);
+
+				queue.enqueueNDRangeKernel(kernel_init_time_sort, cl::NullRange, cl::NDRange(time_sort_elements), cl::NDRange(local_size), NULL, &prof_event_TIME_ORDER);
+				time_order_events.push_back(prof_event_TIME_ORDER);
+				profiler.Kernel(kernel_init_time_sort, prof_event_TIME_ORDER, time_sort_elements * (sizeof(cl_int) + sizeof(cl_uint) + sizeof(cl_ulong) + sizeof(cl_int)));
+
+				size_t sort_first = time_order_events.size();
+				EnqueueBitonicSort(queue, program, "time", buffer_time_keys, buffer_time_order, time_sort_elements, sizeof(cl_ulong), local_size, &time_order_events);
+				profiler.Kernels("bitonic_time", time_order_events, sort_first);
+
+				if (predicates.empty())
+				{
+					timeIndex.resize(row_count);
+					queue.enqueueReadBuffer(buffer_time_order, CL_TRUE, 0, row_count * sizeof(cl_int), &timeIndex[0]);
+					SaveTimeIndex(time_index_file, columns, timeIndex);
+				}
+			}
+
+			cl::Kernel kernel_gather_time_order = cl::Kernel(program, "gather_time_order");
+			kernel_gather_time_order.setArg(0, buffer_time_order);
+			kernel_gather_time_order.setArg(1, buffer_A);
+			kernel_gather_time_order.setArg(2, buffer_station);
+			kernel_gather_time_order.setArg(3, buffer_time);
+			kernel_gather_time_order.setArg(4, buffer_time_temp);
+			kernel_gather_time_order.setArg(5, buffer_time_station);
+			kernel_gather_time_order.setArg(6, buffer_time_time);
+			kernel_gather_time_order.setArg(7, (cl_int)row_count);
+
+			queue.enqueueNDRangeKernel(kernel_gather_time_order, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event_TIME_ORDER);
+			time_order_events.push_back(prof_event_TIME_ORDER);
+			profiler.Kernel(kernel_gather_time_order, prof_event_TIME_ORDER, row_count * (sizeof(cl_int) + 2 * record_size));
+
+			pool.Release(buffer_time_keys);
+			pool.Release(buffer_time_order);
+
+			time_order_kernel_time = GetKernelTime(time_order_events);
+		}
+
+		// ********** TIME RANGE KERNEL **********
+		// the records of a station between two dates are one contiguous slice of the time ordered columns,
+		// its bounds are found by binary search on the device timestamps and only the slice is reduced,
+		// using a global offset so the kernel indexes the full buffers
+		GroupStats rangeStats = GroupStats();
+
+		std::vector<cl::Event> range_events;
+		cl_ulong range_kernel_time = 0;
+
+		if (!time_range.empty())
+		{
+			ProfileScope range_scope(profiler, "RANGE");
+			size_t range_first = LowerBound(queue, buffer_time_time, segments[range.station], segments[range.station + 1], range.first);
+			size_t range_end = LowerBound(queue, buffer_time_time, range_first, segments[range.station + 1], range.last + 1);
+
+			if (range_end > range_first)
+			{
+				size_t range_elements = ((range_end - range_first + local_size - 1) / local_size) * local_size;
+
+				std::vector<float> rangeStatsTable(station_count * MOMENTS);
+				std::vector<cl_int> rangeCounts(station_count);
+
+				cl::Buffer buffer_range_stats = pool.Acquire(rangeStatsTable.size() * sizeof(float));
+				cl::Buffer buffer_range_counts = pool.Acquire(rangeCounts.size() * sizeof(cl_int));
+
+				cl::Event prof_event_RANGE;
+
+				kernel_init_group_stats.setArg(0, buffer_range_stats);
+				kernel_init_group_stats.setArg(1, buffer_range_counts);
+
+				queue.enqueueNDRangeKernel(kernel_init_group_stats, cl::NullRange, cl::NDRange(station_count), cl::NullRange, NULL, &prof_event_RANGE);
+				range_events.push_back(prof_event_RANGE);
+				profiler.Kernel(kernel_init_group_stats, prof_event_RANGE);
+
+				cl::Kernel kernel_range_stats = cl::Kernel(program, "reduce_station_stats");
+				kernel_range_stats.setArg(0, buffer_time_temp);
+				kernel_range_stats.setArg(1, buffer_time_station);
+				kernel_range_stats.setArg(2, buffer_range_stats);
+				kernel_range_stats.setArg(3, buffer_range_counts);
+				kernel_range_stats.setArg(4, cl::Local(station_count * MOMENTS * sizeof(float)));
+				kernel_range_stats.setArg(5, cl::Local(station_count * sizeof(cl_int)));
+				kernel_range_stats.setArg(6, (cl_int)range_end);
+				kernel_range_stats.setArg(7, (cl_int)station_count);
+
+				queue.enqueueNDRangeKernel(kernel_range_stats, cl::NDRange(range_first), cl::NDRange(range_elements), cl::NDRange(local_size), NULL, &prof_event_RANGE);
+				range_events.push_back(prof_event_RANGE);
+				profiler.Kernel(kernel_range_stats, prof_event_RANGE, (range_end - range_first) * (sizeof(float) + sizeof(cl_int)));
 
-		//cout << sortedVec;
-		//std::cout << std::endl;
+				queue.enqueueReadBuffer(buffer_range_stats, CL_TRUE, 0, rangeStatsTable.size() * sizeof(float), &rangeStatsTable[0]);
+				queue.enqueueReadBuffer(buffer_range_counts, CL_TRUE, 0, rangeCounts.size() * sizeof(cl_int), &rangeCounts[0]);
 
+				pool.Release(buffer_range_stats);
+				pool.Release(buffer_range_counts);
+
+				rangeStats = ToGroupStats(rangeStatsTable, rangeCounts)[range.station];
+				range_kernel_time = GetKernelTime(range_events);
+			}
+		}
+
+		// ********** ROLLING WINDOW KERNELS **********
+		// rolling mean from a prefix sum and rolling min/max with van Herk/Gil-Werman blocks, both O(N) for any window
+		// the series stay on the device, per-station summaries of them are computed with reduce_station_stats
+		std::vector<GroupStats> rollingMeanGroups;
+		std::vector<GroupStats> rollingRangeGroups;
+
+		std::vector<cl::Event> rolling_events;
+		cl_ulong rolling_kernel_time = 0;
+
+		if (window > 0)
+		{
+			ProfileScope rolling_scope(profiler, "ROLLING");
+			size_t n = row_count;
+			size_t rolling_elements = ((n + local_size - 1) / local_size) * local_size;
+
+			cl::Event prof_event_ROLLING;
+
+			cl::Buffer buffer_prefix = pool.Acquire(n * sizeof(float));
+			cl::Buffer buffer_roll_mean = pool.Acquire(n * sizeof(float));
+			cl::Buffer buffer_roll_min = pool.Acquire(n * sizeof(float));
+			cl::Buffer buffer_roll_max = pool.Acquire(n * sizeof(float));
+			cl::Buffer buffer_roll_range = pool.Acquire(n * sizeof(float));
+
+			// rolling mean, the mean temperature is taken off before the prefix sum to keep float precision
+			cl::Kernel kernel_subtract_bias = cl::Kernel(program, "subtract_bias");
+			kernel_subtract_bias.setArg(0, buffer_time_temp);
+			kernel_subtract_bias.setArg(1, buffer_prefix);
+			kernel_subtract_bias.setArg(2, avgTemp);
+			kernel_subtract_bias.setArg(3, (cl_int)n);
+
+			queue.enqueueNDRangeKernel(kernel_subtract_bias, cl::NullRange, cl::NDRange(rolling_elements), cl::NDRange(local_size), NULL, &prof_event_ROLLING);
+			rolling_events.push_back(prof_event_ROLLING);
+			profiler.Kernel(kernel_subtract_bias, prof_event_ROLLING, n * 2 * sizeof(float));
+
+			size_t scan_first = rolling_events.size();
+			EnqueueScan(pool, queue, program, "add_float", buffer_prefix, buffer_prefix, n, sizeof(float), local_size, true, &rolling_events);
+			profiler.Kernels("scan_add_float", rolling_events, scan_first);
+
+			cl::Kernel kernel_rolling_mean = cl::Kernel(program, "rolling_mean");
+			kernel_rolling_mean.setArg(0, buffer_prefix);
+			kernel_rolling_mean.setArg(1, buffer_segments);
+			kernel_rolling_mean.setArg(2, buffer_roll_mean);
+			kernel_rolling_mean.setArg(3, (cl_int)station_count);
+			kernel_rolling_mean.setArg(4, (cl_int)window);
+			kernel_rolling_mean.setArg(5, avgTemp);
+			kernel_rolling_mean.setArg(6, (cl_int)n);
+
+			queue.enqueueNDRangeKernel(kernel_rolling_mean, cl::NullRange, cl::NDRange(rolling_elements), cl::NDRange(local_size), NULL, &prof_event_ROLLING);
+			rolling_events.push_back(prof_event_ROLLING);
+			profiler.Kernel(kernel_rolling_mean, prof_event_ROLLING, n * 2 * sizeof(float));
+
+			// rolling min/max, every station segment is cut into blocks of window readings
+			std::vector<cl_int> blockStarts(station_count + 1, 0);
+			for (size_t i = 0; i < station_count; i++)
+			{
+				blockStarts[i + 1] = blockStarts[i] + (stationGroups[i].count + window - 1) / window;
+			}
+			size_t block_count = blockStarts[station_count];
+			size_t block_elements = ((block_count + local_size - 1) / local_size) * local_size;
+
+			cl::Buffer buffer_block_starts = pool.Acquire(blockStarts.size() * sizeof(cl_int));
+			cl::Buffer buffer_g_min = pool.Acquire(n * sizeof(float));
+			cl::Buffer buffer_g_max = pool.Acquire(n * sizeof(float));
+			cl::Buffer buffer_h_min = pool.Acquire(n * sizeof(float));
+			cl::Buffer buffer_h_max = pool.Acquire(n * sizeof(float));
+
+			queue.enqueueWriteBuffer(buffer_block_starts, CL_TRUE, 0, blockStarts.size() * sizeof(cl_int), &blockStarts[0]);
+
+			cl::Kernel kernel_rolling_blocks = cl::Kernel(program, "rolling_blocks");
+			kernel_rolling_blocks.setArg(0, buffer_time_temp);
+			kernel_rolling_blocks.setArg(1, buffer_segments);
+			kernel_rolling_blocks.setArg(2, buffer_block_starts);
+			kernel_rolling_blocks.setArg(3, buffer_g_min);
+			kernel_rolling_blocks.setArg(4, buffer_g_max);
+			kernel_rolling_blocks.setArg(5, buffer_h_min);
+			kernel_rolling_blocks.setArg(6, buffer_h_max);
+			kernel_rolling_blocks.setArg(7, (cl_int)station_count);
+			kernel_rolling_blocks.setArg(8, (cl_int)window);
+			kernel_rolling_blocks.setArg(9, (cl_int)block_count);
+
+			queue.enqueueNDRangeKernel(kernel_rolling_blocks, cl::NullRange, cl::NDRange(block_elements), cl::NDRange(local_size), NULL, &prof_event_ROLLING);
+			rolling_events.push_back(prof_event_ROLLING);
+			profiler.Kernel(kernel_rolling_blocks, prof_event_ROLLING);
+
+			cl::Kernel kernel_rolling_minmax = cl::Kernel(program, "rolling_minmax");
+			kernel_rolling_minmax.setArg(0, buffer_g_min);
+			kernel_rolling_minmax.setArg(1, buffer_g_max);
+			kernel_rolling_minmax.setArg(2, buffer_h_min);
+			kernel_rolling_minmax.setArg(3, buffer_h_max);
+			kernel_rolling_minmax.setArg(4, buffer_segments);
+			kernel_rolling_minmax.setArg(5, buffer_roll_min);
+			kernel_rolling_minmax.setArg(6, buffer_roll_max);
+			kernel_rolling_minmax.setArg(7, buffer_roll_range);
+			kernel_rolling_minmax.setArg(8, (cl_int)station_count);
+			kernel_rolling_minmax.setArg(9, (cl_int)window);
+			kernel_rolling_minmax.setArg(10, (cl_int)n);
+
+			queue.enqueueNDRangeKernel(kernel_rolling_minmax, cl::NullRange, cl::NDRange(rolling_elements), cl::NDRange(local_size), NULL, &prof_event_ROLLING);
+			rolling_events.push_back(prof_event_ROLLING);
+			profiler.Kernel(kernel_rolling_minmax, prof_event_ROLLING, n * 7 * sizeof(float));
+
+			// per-station min/max of the rolling mean and of the rolling range (max - min)
+			cl::Buffer rolling_series[2] = { buffer_roll_mean, buffer_roll_range };
+			std::vector<GroupStats>* rolling_groups[2] = { &rollingMeanGroups, &rollingRangeGroups };
+
+			for (int i = 0; i < 2; i++)
+			{
+				kernel_init_group_stats.setArg(0, buffer_station_stats);
+				kernel_init_group_stats.setArg(1, buffer_station_counts);
+
+				queue.enqueueNDRangeKernel(kernel_init_group_stats, cl::NullRange, cl::NDRange(station_count), cl::NullRange, NULL, &prof_event_ROLLING);
+				rolling_events.push_back(prof_event_ROLLING);
+				profiler.Kernel(kernel_init_group_stats, prof_event_ROLLING);
+
+				kernel_station_stats.setArg(0, rolling_series[i]);
+				kernel_station_stats.setArg(1, buffer_time_station);
+
+				queue.enqueueNDRangeKernel(kernel_station_stats, cl::NullRange, cl::NDRange(rolling_elements), cl::NDRange(local_size), NULL, &prof_event_ROLLING);
+				rolling_events.push_back(prof_event_ROLLING);
+				profiler.Kernel(kernel_station_stats, prof_event_ROLLING, row_count * (sizeof(float) + sizeof(cl_int)));
+
+				std::vector<float> rollingStats(stationStats.size());
+				std::vector<cl_int> rollingCounts(stationCounts.size());
+
+				queue.enqueueReadBuffer(buffer_station_stats, CL_TRUE, 0, rollingStats.size() * sizeof(float), &rollingStats[0]);
+				queue.enqueueReadBuffer(buffer_station_counts, CL_TRUE, 0, rollingCounts.size() * sizeof(cl_int), &rollingCounts[0]);
+
+				*rolling_groups[i] = ToGroupStats(rollingStats, rollingCounts);
+			}
+
+			pool.Release(buffer_prefix);
+			pool.Release(buffer_roll_mean);
+			pool.Release(buffer_roll_min);
+			pool.Release(buffer_roll_max);
+			pool.Release(buffer_roll_range);
+			pool.Release(buffer_block_starts);
+			pool.Release(buffer_g_min);
+			pool.Release(buffer_g_max);
+			pool.Release(buffer_h_min);
+			pool.Release(buffer_h_max);
+
+			rolling_kernel_time = GetKernelTime(rolling_events);
+		}
+
+		// the rolling windows reuse the station tables, they only go back to the pool after them
+		pool.Release(buffer_station_stats);
+		pool.Release(buffer_station_counts);
+
+		// ********** STREAK KERNELS **********
+		// runs of consecutive days with a max above 25 C (heatwaves) or a min below 0 C (cold streaks) per station
+		// daily max/min and the runs are found with segmented scans over the time ordered columns and
+		// compacted through scans of their end flags, only the run table is read back
+		std::vector<Streak> streakRuns[2];
+		// [0] heatwaves, [1] cold streaks
+
+		std::vector<cl::Event> streak_events;
+		cl_ulong streak_kernel_time = 0;
+
+		if (streaks)
+		{
+			ProfileScope streak_scope(profiler, "STREAK");
+			size_t n = row_count;
+			size_t streak_elements = ((n + local_size - 1) / local_size) * local_size;
+
+			cl::Event prof_event_STREAK;
+
+			// daily max and min of every (station, day)
+			cl::Buffer buffer_day_max_scan = pool.Acquire(n * SEG_PAIR_SIZE);
+			cl::Buffer buffer_day_min_scan = pool.Acquire(n * SEG_PAIR_SIZE);
+			cl::Buffer buffer_day_ends = pool.Acquire(n * sizeof(cl_int));
+			cl::Buffer buffer_day_index = pool.Acquire(n * sizeof(cl_int));
+
+			cl::Kernel kernel_day_heads = cl::Kernel(program, "day_heads");
+			kernel_day_heads.setArg(0, buffer_time_temp);
+			kernel_day_heads.setArg(1, buffer_time_station);
+			kernel_day_heads.setArg(2, buffer_time_time);
+			kernel_day_heads.setArg(3, buffer_day_max_scan);
+			kernel_day_heads.setArg(4, buffer_day_min_scan);
+			kernel_day_heads.setArg(5, buffer_day_ends);
+			kernel_day_heads.setArg(6, (cl_int)n);
+
+			queue.enqueueNDRangeKernel(kernel_day_heads, cl::NullRange, cl::NDRange(streak_elements), cl::NDRange(local_size), NULL, &prof_event_STREAK);
+			streak_events.push_back(prof_event_STREAK);
+			profiler.Kernel(kernel_day_heads, prof_event_STREAK, n * (record_size + 2 * SEG_PAIR_SIZE + sizeof(cl_int)));
+
+			size_t scan_first = streak_events.size();
+			EnqueueScan(pool, queue, program, "segmax_float", buffer_day_max_scan, buffer_day_max_scan, n, SEG_PAIR_SIZE, local_size, true, &streak_events);
+			EnqueueScan(pool, queue, program, "segmin_float", buffer_day_min_scan, buffer_day_min_scan, n, SEG_PAIR_SIZE, local_size, true, &streak_events);
+			EnqueueScan(pool, queue, program, "add_int", buffer_day_ends, buffer_day_index, n, sizeof(cl_int), local_size, true, &streak_events);
+			profiler.Kernels("scan_days", streak_events, scan_first);
+
+			cl_int day_count = 0;
+			queue.enqueueReadBuffer(buffer_day_index, CL_TRUE, (n - 1) * sizeof(cl_int), sizeof(cl_int), &day_count);
+			// last element of the inclusive scan is the number of days
+
+			size_t day_elements = ((day_count + local_size - 1) / local_size) * local_size;
+
+			cl::Buffer buffer_days_max = pool.Acquire(day_count * sizeof(float));
+			cl::Buffer buffer_days_min = pool.Acquire(day_count * sizeof(float));
+			cl::Buffer buffer_days_station = pool.Acquire(day_count * sizeof(cl_int));
+			cl::Buffer buffer_days_date = pool.Acquire(day_count * sizeof(cl_uint));
+			cl::Buffer buffer_days_number = pool.Acquire(day_count * sizeof(cl_int));
+
+			cl::Kernel kernel_compact_days = cl::Kernel(program, "compact_days");
+			kernel_compact_days.setArg(0, buffer_day_max_scan);
+			kernel_compact_days.setArg(1, buffer_day_min_scan);
+			kernel_compact_days.setArg(2, buffer_day_ends);
+			kernel_compact_days.setArg(3, buffer_day_index);
+			kernel_compact_days.setArg(4, buffer_time_station);
+			kernel_compact_days.setArg(5, buffer_time_time);
+			kernel_compact_days.setArg(6, buffer_days_max);
+			kernel_compact_days.setArg(7, buffer_days_min);
+			kernel_compact_days.setArg(8, buffer_days_station);
+			kernel_compact_days.setArg(9, buffer_days_date);
+			kernel_compact_days.setArg(10, buffer_days_number);
+			kernel_compact_days.setArg(11, (cl_int)n);
+
+			queue.enqueueNDRangeKernel(kernel_compact_days, cl::NullRange, cl::NDRange(streak_elements), cl::NDRange(local_size), NULL, &prof_event_STREAK);
+			streak_events.push_back(prof_event_STREAK);
+			profiler.Kernel(kernel_compact_days, prof_event_STREAK);
+
+			// runs of qualifying days, once for heatwaves and once for cold streaks
+			cl::Buffer buffer_run_length = pool.Acquire(day_count * SEG_PAIR_SIZE);
+			cl::Buffer buffer_run_peak = pool.Acquire(day_count * SEG_PAIR_SIZE);
+			cl::Buffer buffer_run_ends = pool.Acquire(day_count * sizeof(cl_int));
+			cl::Buffer buffer_run_index = pool.Acquire(day_count * sizeof(cl_int));
+
+			cl::Kernel kernel_run_heads = cl::Kernel(program, "run_heads");
+			kernel_run_heads.setArg(0, buffer_days_max);
+			kernel_run_heads.setArg(1, buffer_days_min);
+			kernel_run_heads.setArg(2, buffer_days_station);
+			kernel_run_heads.setArg(3, buffer_days_number);
+			kernel_run_heads.setArg(4, buffer_run_length);
+			kernel_run_heads.setArg(5, buffer_run_peak);
+			kernel_run_heads.setArg(6, buffer_run_ends);
+			kernel_run_heads.setArg(9, day_count);
+
+			cl::Kernel kernel_emit_runs = cl::Kernel(program, "emit_runs");
+
+			for (int cold = 0; cold < 2; cold++)
+			{
+				kernel_run_heads.setArg(7, cold ? COLD_STREAK_THRESHOLD : HEATWAVE_THRESHOLD);
+				kernel_run_heads.setArg(8, (cl_int)!cold);
+
+				queue.enqueueNDRangeKernel(kernel_run_heads, cl::NullRange, cl::NDRange(day_elements), cl::NDRange(local_size), NULL, &prof_event_STREAK);
+				streak_events.push_back(prof_event_STREAK);
+				profiler.Kernel(kernel_run_heads, prof_event_STREAK);
+
+				scan_first = streak_events.size();
+				EnqueueScan(pool, queue, program, "segadd_int", buffer_run_length, buffer_run_length, day_count, SEG_PAIR_SIZE, local_size, true, &streak_events);
+				EnqueueScan(pool, queue, program, cold ? "segmin_float" : "segmax_float", buffer_run_peak, buffer_run_peak, day_count, SEG_PAIR_SIZE, local_size, true, &streak_events);
+				EnqueueScan(pool, queue, program, "add_int", buffer_run_ends, buffer_run_index, day_count, sizeof(cl_int), local_size, true, &streak_events);
+				profiler.Kernels("scan_runs", streak_events, scan_first);
+
+				cl_int run_count = 0;
+				queue.enqueueReadBuffer(buffer_run_index, CL_TRUE, (day_count - 1) * sizeof(cl_int), sizeof(cl_int), &run_count);
+
+				if (!run_count)
+					continue;
+
+				std::vector<cl_int> runStation(run_count);
+				std::vector<cl_uint> runStart(run_count);
+				std::vector<cl_int> runLength(run_count);
+				std::vector<float> runPeak(run_count);
+
+				cl::Buffer buffer_runs_station = pool.Acquire(run_count * sizeof(cl_int));
+				cl::Buffer buffer_runs_start = pool.Acquire(run_count * sizeof(cl_uint));
+				cl::Buffer buffer_runs_length = pool.Acquire(run_count * sizeof(cl_int));
+				cl::Buffer buffer_runs_peak = pool.Acquire(run_count * sizeof(float));
+
+				kernel_emit_runs.setArg(0, buffer_run_length);
+				kernel_emit_runs.setArg(1, buffer_run_peak);
+				kernel_emit_runs.setArg(2, buffer_run_ends);
+				kernel_emit_runs.setArg(3, buffer_run_index);
+				kernel_emit_runs.setArg(4, buffer_days_station);
+				kernel_emit_runs.setArg(5, buffer_days_date);
+				kernel_emit_runs.setArg(6, buffer_runs_station);
+				kernel_emit_runs.setArg(7, buffer_runs_start);
+				kernel_emit_runs.setArg(8, buffer_runs_length);
+				kernel_emit_runs.setArg(9, buffer_runs_peak);
+				kernel_emit_runs.setArg(10, day_count);
+
+				queue.enqueueNDRangeKernel(kernel_emit_runs, cl::NullRange, cl::NDRange(day_elements), cl::NDRange(local_size), NULL, &prof_event_STREAK);
+				streak_events.push_back(prof_event_STREAK);
+				profiler.Kernel(kernel_emit_runs, prof_event_STREAK);
+
+				queue.enqueueReadBuffer(buffer_runs_station, CL_TRUE, 0, run_count * sizeof(cl_int), &runStation[0]);
+				queue.enqueueReadBuffer(buffer_runs_start, CL_TRUE, 0, run_count * sizeof(cl_uint), &runStart[0]);
+				queue.enqueueReadBuffer(buffer_runs_length, CL_TRUE, 0, run_count * sizeof(cl_int), &runLength[0]);
+				queue.enqueueReadBuffer(buffer_runs_peak, CL_TRUE, 0, run_count * sizeof(float), &runPeak[0]);
+
+				pool.Release(buffer_runs_station);
+				pool.Release(buffer_runs_start);
+				pool.Release(buffer_runs_length);
+				pool.Release(buffer_runs_peak);
+
+				for (cl_int i = 0; i < run_count; i++)
+				{
+					Streak run = { runStation[i], runStart[i], runLength[i], runPeak[i] };
+					streakRuns[cold].push_back(run);
+				}
+			}
+
+			pool.Release(buffer_day_max_scan);
+			pool.Release(buffer_day_min_scan);
+			pool.Release(buffer_day_ends);
+			pool.Release(buffer_day_index);
+			pool.Release(buffer_days_max);
+			pool.Release(buffer_days_min);
+			pool.Release(buffer_days_station);
+			pool.Release(buffer_days_date);
+			pool.Release(buffer_days_number);
+			pool.Release(buffer_run_length);
+			pool.Release(buffer_run_peak);
+			pool.Release(buffer_run_ends);
+			pool.Release(buffer_run_index);
+
+			streak_kernel_time = GetKernelTime(streak_events);
+		}
+
+		// the time ordered columns are last used by the streaks
+		if (time_order)
+		{
+			pool.Release(buffer_time_temp);
+			pool.Release(buffer_time_station);
+			pool.Release(buffer_time_time);
+			pool.Release(buffer_segments);
+		}
 
 		// *********** OUTPUTS **********
 
@@ -373,21 +2013,249 @@ int main(int argc, char **argv)
 		std::cout << "Interquartile Range: " << interQuatRange << std::endl;*/
 		std::cout << std::endl;
 
+		// hottest and coldest readings with where and when they were recorded
+		std::cout << extremes_count << " Hottest Readings:" << std::endl;
+		for (size_t i = 0; i < extremes_count; i++)
+		{
+			size_t j = extremes_count + i;
+			std::cout << "	" << extremeTemp[j] << "	" << columns.stationNames[extremeStation[j]] << "	" << FormatTimestamp(extremeTime[j]) << std::endl;
+		}
+		std::cout << extremes_count << " Coldest Readings:" << std::endl;
+		for (size_t i = 0; i < extremes_count; i++)
+		{
+			std::cout << "	" << extremeTemp[i] << "	" << columns.stationNames[extremeStation[i]] << "	" << FormatTimestamp(extremeTime[i]) << std::endl;
+		}
+		std::cout << std::endl;
+
+		// statistics of every station
+		std::cout << "Per Station:" << std::endl;
+		for (size_t i = 0; i < station_count; i++)
+		{
+			std::cout << FormatGroupStats(columns.stationNames[i], stationGroups[i]) << std::endl;
+		}
+		std::cout << std::endl;
+
+		// summaries of the rolling windows of every station
+		if (window > 0)
+		{
+			std::cout << "Rolling Windows of " << window << " Readings:" << std::endl;
+			for (size_t i = 0; i < station_count; i++)
+			{
+				std::cout << columns.stationNames[i] << "	rolling mean min: " << rollingMeanGroups[i].min << "	rolling mean max: " << rollingMeanGroups[i].max;
+				std::cout << "	largest rolling range: " << rollingRangeGroups[i].max << std::endl;
+			}
+			std::cout << std::endl;
+		}
+
+		for (size_t q = 0; q < queries.size(); q++)
+		{
+			std::cout << "Query " << queries[q].text << ":" << std::endl;
+			for (size_t i = 0; i < queryRows[q].size(); i++)
+			{
+				std::cout << "	" << queryRows[q][i] << std::endl;
+			}
+			std::cout << std::endl;
+		}
+
+		// roll-up of the cube, no raw rows are read
+		if (cube_rollup >= 0)
+		{
+			std::vector<string> cubeLabels;
+			std::vector<GroupStats> cubeGroups;
+			RollUpCube(cube, columns, cube_rollup, cubeLabels, cubeGroups);
+
+			std::cout << "Cube Roll-Up (" << cube_new_rows << " of " << cube.rows << " rows aggregated in this run):" << std::endl;
+			for (size_t i = 0; i < cubeGroups.size(); i++)
+			{
+				if (cubeGroups[i].count)
+					std::cout << "	" << FormatGroupStats(cubeLabels[i], cubeGroups[i]) << std::endl;
+			}
+			std::cout << std::endl;
+		}
+
+		// per station and in total over the bitmap mask
+		if (!bitmap_query.empty())
+		{
+			GroupStats bitmapTotal = GroupStats();
+
+			std::cout << "Bitmap query " << bitmap_query << ":" << std::endl;
+			for (size_t i = 0; i < bitmapGroups.size(); i++)
+			{
+				if (bitmapGroups[i].count)
+				{
+					std::cout << "	" << FormatGroupStats(columns.stationNames[i], bitmapGroups[i]) << std::endl;
+					bitmapTotal = MergeGroupStats(bitmapTotal, bitmapGroups[i]);
+				}
+			}
+			if (bitmapTotal.count)
+				std::cout << "	" << FormatGroupStats("total", bitmapTotal) << std::endl;
+			std::cout << std::endl;
+		}
+
+		if (!time_range.empty())
+		{
+			if (rangeStats.count)
+				std::cout << FormatGroupStats(time_range, rangeStats) << std::endl << std::endl;
+			else
+				std::cout << time_range << ": no readings" << std::endl << std::endl;
+		}
+
+		// longest run of every station and the full list of runs
+		if (streaks)
+		{
+			const char* streak_names[2] = { "Heatwaves (days above 25 C)", "Cold Streaks (days below 0 C)" };
+
+			for (int cold = 0; cold < 2; cold++)
+			{
+				std::cout << streak_names[cold] << ": " << streakRuns[cold].size() << " runs" << std::endl;
+
+				for (size_t s = 0; s < station_count; s++)
+				{
+					int longest = -1;
+					for (size_t i = 0; i < streakRuns[cold].size(); i++)
+					{
+						if (streakRuns[cold][i].station == (int)s && (longest < 0 || streakRuns[cold][i].length > streakRuns[cold][longest].length))
+							longest = i;
+					}
+
+					if (longest >= 0)
+					{
+						const Streak& run = streakRuns[cold][longest];
+						std::cout << "	longest at " << columns.stationNames[s] << ": " << run.length << " days from " << FormatTimestamp(run.start).substr(0, 10) << ", peak " << run.peak << std::endl;
+					}
+				}
+
+				for (size_t i = 0; i < streakRuns[cold].size(); i++)
+				{
+					const Streak& run = streakRuns[cold][i];
+					std::cout << "	" << columns.stationNames[run.station] << "	" << FormatTimestamp(run.start).substr(0, 10) << "	" << run.length << " days	peak " << run.peak << std::endl;
+				}
+				std::cout << std::endl;
+			}
+		}
+
+		// one row per non-empty calendar bucket
+		if (calendar_key >= 0)
+		{
+			std::cout << "Per Calendar Bucket:" << std::endl;
+			for (size_t i = 0; i < calendarGroups.size(); i++)
+			{
+				if (calendarGroups[i].count)
+				{
+					std::cout << FormatGroupStats(CalendarBucketLabel(calendar_key, i, columns), calendarGroups[i]) << std::endl;
+				}
+			}
+			std::cout << std::endl;
+		}
+
+		// composite key groups come out of the hash table unordered, list them ordered by key
+		if (hash_key >= 0)
+		{
+			std::vector<size_t> order(hashKeys.size());
+			for (size_t i = 0; i < order.size(); i++)
+			{
+				order[i] = i;
+			}
+			std::sort(order.begin(), order.end(), [&hashKeys](size_t a, size_t b) { return hashKeys[a] < hashKeys[b]; });
+
+			std::cout << "Per Composite Key (" << hashKeys.size() << " groups):" << std::endl;
+			for (size_t i = 0; i < order.size(); i++)
+			{
+				std::cout << FormatGroupStats(HashKeyLabel(hash_key, hashKeys[order[i]], columns), hashGroups[order[i]]) << std::endl;
+			}
+			std::cout << std::endl;
+		}
+
 		// outputting profiling info
 		std::cout << std::endl;
 		std::wcout << "Work Group Size: " << local_size << std::endl;
-		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
 		std::cout << "Preferred work group multiple: " << kernel_add.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device) << std::endl;
-		std::cout << "Kernel_AVG:	execution time [ns]: " << AVG_kernel_time << ",		single exuctuion time: " << AVG_single_kernel << std::endl << "		total memory transfer [ns]: " << AVG_memory_time << std::endl << std::endl;
-		std::cout << "Kernel_MAX:	execution time [ns]: " << max_kernel_time << ",		single exuction time: " << max_single_kernel << std::endl << "		total memory transfer [ns]: " << max_memory_time << std::endl << std::endl;
-		std::cout << "Kernel_MIN:	execution time [ns]: " << min_kernel_time << ",		single exuction time: " << min_single_kernel << std::endl << "		total memory transfer [ns]: " << min_memory_time << std::endl << std::endl;
+		std::cout << "Input upload:	total memory transfer [ns]: " << GetKernelTime(upload_events) << (zero_copy ? ",		zero-copy host buffers" : "") << std::endl;
+		std::cout << "Buffer pool:	" << pool.Report() << std::endl;
+		std::cout << "Program:	" << (program_loaded ? "loaded from binary cache" : "built from source") << " in " << program_time << " ms" << std::endl << std::endl;
+		if (predicates.empty())
+		{
+			std::cout << "Kernel_AVG:	execution time [ns]: " << AVG_kernel_time << ",		single exuctuion time: " << AVG_single_kernel << std::endl << "		total memory transfer [ns]: " << AVG_memory_time << std::endl << std::endl;
+			std::cout << "Kernel_MAX:	execution time [ns]: " << max_kernel_time << ",		single exuction time: " << max_single_kernel << std::endl << "		total memory transfer [ns]: " << max_memory_time << std::endl << std::endl;
+			std::cout << "Kernel_MIN:	execution time [ns]: " << min_kernel_time << ",		single exuction time: " << min_single_kernel << std::endl << "		total memory transfer [ns]: " << min_memory_time << std::endl << std::endl;
+		}
 		std::cout << "Kernel_STANDDEV:execution time [ns]: " << standdev_kernel_time << ",		single kernel time: " << standdev_single_kernel <<  std::endl << "		total memory transfer [ns]: " << standdev_memory_time << std::endl << std::endl;
-		//std::cout << "Kernel_SORT:		total execution time [ns]: " << sort_kernel_time << ",		total memory transfer time [ns]: " << sort_memory_time << std::endl;
+		if (out_of_order && predicates.empty())
+		{
+			std::cout << "Event DAG timeline (" << (device_info.outOfOrderQueue ? "out-of-order queue" : "one in-order queue per reduction") << "):" << std::endl;
+			std::cout << GetTimelineReport(dag_labels, dag_events) << std::endl;
+		}
+		if (full_sort)
+		{
+			std::cout << "Kernel_ARGSORT:	execution time [ns]: " << argsort_kernel_time << std::endl << "		total memory transfer [ns]: " << argsort_memory_time << std::endl << std::endl;
+		}
+		else
+		{
+			std::cout << "Kernel_TOPK:	execution time [ns]: " << topk_kernel_time << std::endl << "		total memory transfer [ns]: " << topk_memory_time << std::endl << std::endl;
+		}
+		std::cout << "Kernel_STATION:	execution time [ns]: " << station_kernel_time << std::endl << "		total memory transfer [ns]: " << station_memory_time << std::endl << std::endl;
+		if (calendar_key >= 0)
+		{
+			std::cout << "Kernel_CALENDAR:execution time [ns]: " << calendar_kernel_time << std::endl << "		total memory transfer [ns]: " << calendar_memory_time << std::endl << std::endl;
+		}
+		if (time_order)
+		{
+			std::cout << "Kernel_TIME_ORDER:execution time [ns]: " << time_order_kernel_time << (time_index_loaded ? ",		index loaded from disk" : "") << std::endl << std::endl;
+		}
+		if (window > 0)
+		{
+			std::cout << "Kernel_ROLLING:	execution time [ns]: " << rolling_kernel_time << std::endl << std::endl;
+		}
+		if (!queries.empty())
+		{
+			std::cout << "Kernel_QUERY:	execution time [ns]: " << query_kernel_time << ",		programs built: " << query_programs_built << " for " << queries.size() << " queries" << std::endl << std::endl;
+		}
+		if (cube_rollup >= 0)
+		{
+			std::cout << "Kernel_CUBE:	execution time [ns]: " << cube_kernel_time << std::endl << std::endl;
+		}
+		if (!bitmap_query.empty())
+		{
+			std::cout << "Kernel_BITMAP:	execution time [ns]: " << bitmap_kernel_time << std::endl << std::endl;
+		}
+		if (!time_range.empty())
+		{
+			std::cout << "Kernel_RANGE:	execution time [ns]: " << range_kernel_time << std::endl << std::endl;
+		}
+		if (!predicates.empty())
+		{
+			std::cout << "Zone maps:	" << zoneClassCount[ZONE_SKIP] << " blocks skipped, " << zoneClassCount[ZONE_FULL] << " answered from the summary, " << zoneClassCount[ZONE_PARTIAL] << " scanned" << (zones_loaded ? ",		loaded from disk" : "") << std::endl;
+			std::cout << "Kernel_FILTER:	execution time [ns]: " << filter_kernel_time << ",		selected: " << row_count << " of " << tempInfo.size() << std::endl << std::endl;
+		}
+		if (streaks)
+		{
+			std::cout << "Kernel_STREAK:	execution time [ns]: " << streak_kernel_time << std::endl << std::endl;
+		}
+		if (hash_key >= 0)
+		{
+			std::cout << "Kernel_HASH:	execution time [ns]: " << hash_kernel_time << ",		rows/s: " << row_count / (std::max(hash_kernel_time, (cl_ulong)1) * 1e-9) << std::endl << "		total memory transfer [ns]: " << hash_memory_time << std::endl << std::endl;
+		}
 		//std::cout << GetFullProfilingInfo(prof_event, ProfilingResolution::PROF_US) <<  endl;
 		std::cout << std::endl;
 
+		std::cout << "Profiling report:" << std::endl << profiler.Report() << std::endl;
+
+		if (!profile_file.empty())
+		{
+			std::ofstream profile_json(profile_file);
+			profile_json << profiler.JsonReport();
+			std::cout << "Profiling report written to " << profile_file << std::endl;
+		}
+
+		if (!trace_file.empty())
+		{
+			std::ofstream trace_json(trace_file);
+			trace_json << profiler.ChromeTrace();
+			std::cout << "Trace written to " << trace_file << std::endl;
+		}
+
 		std::cout << std::endl;
-		std::cout << "Number of Local Values: " << tempInfo.size() << std::endl;
+		std::cout << "Number of Local Values: " << row_count << std::endl;
 		std::cout << "Length of Vector (may be padded): " << A.size() << std::endl;
 		std::cout << std::endl;
 
@@ -399,7 +2267,6 @@ int main(int argc, char **argv)
 		//std::cout << "Min Temp TEST: " << minTempTEST << std::endl;
 
 		//std::cout << "input: " << A << std::endl;
-		//std::cout << "Sorted: " << sortedVec << std::endl;
 
 		std::cout << "ASSIGNMENT DONE USING FLOATING POINT VALUES" << std::endl;
 		std::cout << std::endl;
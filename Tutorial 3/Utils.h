@@ -5,6 +5,9 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <utility>
+#include <map>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.hpp>
@@ -24,18 +27,149 @@ ostream& operator<< (ostream& out, const vector<T>& v) {
 	return out;
 }
 
+// snapshot of the capabilities of one device, queried once by GetDeviceRegistry
+struct DeviceInfo {
+	int platform_id;
+	int device_id;
+	cl::Platform platform;
+	cl::Device device;
+
+	string platformName;
+	string platformVersion;
+	string platformVendor;
+
+	string name;
+	string version;
+	string vendor;
+	string driverVersion;
+	string extensions;
+	cl_device_type type;
+	cl_uint computeUnits;
+	cl_uint clockFrequency;		// [MHz]
+	cl_ulong globalMemSize;		// [B]
+	cl_ulong maxAllocSize;		// [B]
+	cl_ulong localMemSize;		// [B]
+	size_t maxWorkGroupSize;
+	cl_uint preferredVectorWidthInt;
+	cl_uint preferredVectorWidthFloat;
+	cl_uint preferredVectorWidthDouble;
+	cl_uint preferredVectorWidthHalf;
+	bool hostUnifiedMemory;
+	bool outOfOrderQueue;
+
+	bool fp64;
+	bool fp16;
+	bool int64Atomics;
+
+	bool HasExtension(const string& extension) const {
+		return (" " + extensions + " ").find(" " + extension + " ") != string::npos;
+	}
+};
+
+// platforms of the ICD loader, enumerated on the first call only
+const vector<cl::Platform>& GetPlatforms() {
+	static vector<cl::Platform> platforms;
+	static bool enumerated = false;
+
+	if (!enumerated)
+	{
+		cl::Platform::get(&platforms);
+		enumerated = true;
+	}
+
+	return platforms;
+}
+
+// every device of every platform, enumerated on the first call only
+const vector<DeviceInfo>& GetDeviceRegistry() {
+	static vector<DeviceInfo> registry;
+	static bool enumerated = false;
+
+	if (enumerated)
+		return registry;
+	enumerated = true;
+
+	const vector<cl::Platform>& platforms = GetPlatforms();
+
+	for (unsigned int i = 0; i < platforms.size(); i++)
+	{
+		vector<cl::Device> devices;
+		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+
+		for (unsigned int j = 0; j < devices.size(); j++)
+		{
+			DeviceInfo info;
+			info.platform_id = i;
+			info.device_id = j;
+			info.platform = platforms[i];
+			info.device = devices[j];
+
+			info.platformName = platforms[i].getInfo<CL_PLATFORM_NAME>();
+			info.platformVersion = platforms[i].getInfo<CL_PLATFORM_VERSION>();
+			info.platformVendor = platforms[i].getInfo<CL_PLATFORM_VENDOR>();
+
+			info.name = devices[j].getInfo<CL_DEVICE_NAME>();
+			info.version = devices[j].getInfo<CL_DEVICE_VERSION>();
+			info.vendor = devices[j].getInfo<CL_DEVICE_VENDOR>();
+			info.driverVersion = devices[j].getInfo<CL_DRIVER_VERSION>();
+			info.extensions = devices[j].getInfo<CL_DEVICE_EXTENSIONS>();
+			info.type = devices[j].getInfo<CL_DEVICE_TYPE>();
+			info.computeUnits = devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			info.clockFrequency = devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+			info.globalMemSize = devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+			info.maxAllocSize = devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			info.localMemSize = devices[j].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+			info.maxWorkGroupSize = devices[j].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+			info.preferredVectorWidthInt = devices[j].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT>();
+			info.preferredVectorWidthFloat = devices[j].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+			info.preferredVectorWidthDouble = devices[j].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE>();
+			info.preferredVectorWidthHalf = devices[j].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF>();
+			info.hostUnifiedMemory = devices[j].getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() != CL_FALSE;
+			info.outOfOrderQueue = (devices[j].getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+			info.fp64 = info.HasExtension("cl_khr_fp64") || devices[j].getInfo<CL_DEVICE_DOUBLE_FP_CONFIG>() != 0;
+			info.fp16 = info.HasExtension("cl_khr_fp16");
+			info.int64Atomics = info.HasExtension("cl_khr_int64_base_atomics");
+
+			registry.push_back(info);
+		}
+	}
+
+	return registry;
+}
+
+// the registry entry of a device, throws if the indices do not name one
+const DeviceInfo& GetDeviceInfo(int platform_id, int device_id) {
+	const vector<DeviceInfo>& registry = GetDeviceRegistry();
+
+	for (unsigned int i = 0; i < registry.size(); i++)
+	{
+		if (registry[i].platform_id == platform_id && registry[i].device_id == device_id)
+			return registry[i];
+	}
+
+	throw cl::Error(CL_DEVICE_NOT_FOUND, "GetDeviceInfo");
+}
+
+const DeviceInfo& GetDeviceInfo(const cl::Device& device) {
+	const vector<DeviceInfo>& registry = GetDeviceRegistry();
+
+	for (unsigned int i = 0; i < registry.size(); i++)
+	{
+		if (registry[i].device() == device())
+			return registry[i];
+	}
+
+	throw cl::Error(CL_DEVICE_NOT_FOUND, "GetDeviceInfo");
+}
+
 string GetPlatformName(int platform_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
+	const vector<cl::Platform>& platforms = GetPlatforms();
 	return platforms[platform_id].getInfo<CL_PLATFORM_NAME>();
 }
 
 string GetDeviceName(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	vector<cl::Device> devices;
-	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-	return devices[device_id].getInfo<CL_DEVICE_NAME>();
+	return GetDeviceInfo(platform_id, device_id).name;
 }
 
 const char *getErrorString(cl_int error) {
@@ -121,19 +255,11 @@ void CheckError(cl_int error) {
 	}
 }
 
-void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
-	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back(make_pair((*source_code).c_str(), source_code->length() + 1));
-}
-
 string ListPlatformsDevices() {
 
 	stringstream sstream;
-	vector<cl::Platform> platforms;
-
-	cl::Platform::get(&platforms);
+	const vector<cl::Platform>& platforms = GetPlatforms();
+	const vector<DeviceInfo>& registry = GetDeviceRegistry();
 
 	sstream << "Found " << platforms.size() << " platform(s):" << endl;
 
@@ -144,31 +270,45 @@ string ListPlatformsDevices() {
 		sstream << ", vendor: " << platforms[i].getInfo<CL_PLATFORM_VENDOR>() << endl;
 		//		sstream << ", extensions: " << platforms[i].getInfo<CL_PLATFORM_EXTENSIONS>() << endl;
 
-		vector<cl::Device> devices;
-
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		int device_count = 0;
+		for (unsigned int j = 0; j < registry.size(); j++)
+		{
+			if (registry[j].platform_id == (int)i)
+				device_count++;
+		}
 
-		sstream << "\n   Found " << devices.size() << " device(s):" << endl;
+		sstream << "\n   Found " << device_count << " device(s):" << endl;
 
-		for (unsigned int j = 0; j < devices.size(); j++)
+		for (unsigned int j = 0; j < registry.size(); j++)
 		{
-			sstream << "\n      Device " << j << ", " << devices[j].getInfo<CL_DEVICE_NAME>() << ", version: " << devices[j].getInfo<CL_DEVICE_VERSION>();
+			const DeviceInfo& info = registry[j];
+			if (info.platform_id != (int)i)
+				continue;
+
+			sstream << "\n      Device " << info.device_id << ", " << info.name << ", version: " << info.version;
 
-			sstream << ", vendor: " << devices[j].getInfo<CL_DEVICE_VENDOR>();
-			cl_device_type device_type = devices[j].getInfo<CL_DEVICE_TYPE>();
+			sstream << ", vendor: " << info.vendor;
 			sstream << ", type: ";
-			if (device_type & CL_DEVICE_TYPE_DEFAULT)
+			if (info.type & CL_DEVICE_TYPE_DEFAULT)
 				sstream << "DEFAULT ";
-			if (device_type & CL_DEVICE_TYPE_CPU)
+			if (info.type & CL_DEVICE_TYPE_CPU)
 				sstream << "CPU ";
-			if (device_type & CL_DEVICE_TYPE_GPU)
+			if (info.type & CL_DEVICE_TYPE_GPU)
 				sstream << "GPU ";
-			if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
+			if (info.type & CL_DEVICE_TYPE_ACCELERATOR)
 				sstream << "ACCELERATOR ";
-			sstream << ", compute units: " << devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-			sstream << ", clock freq [MHz]: " << devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
-			sstream << ", max memory size [B]: " << devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-			sstream << ", max allocatable memory [B]: " << devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			sstream << ", compute units: " << info.computeUnits;
+			sstream << ", clock freq [MHz]: " << info.clockFrequency;
+			sstream << ", max memory size [B]: " << info.globalMemSize;
+			sstream << ", max allocatable memory [B]: " << info.maxAllocSize;
+			sstream << ", local memory [B]: " << info.localMemSize;
+			sstream << ", max work group size: " << info.maxWorkGroupSize;
+			sstream << ", preferred vector width int/float/double/half: " << info.preferredVectorWidthInt << "/" << info.preferredVectorWidthFloat;
+			sstream << "/" << info.preferredVectorWidthDouble << "/" << info.preferredVectorWidthHalf;
+			sstream << ", driver: " << info.driverVersion;
+			sstream << ", fp64: " << (info.fp64 ? "yes" : "no") << ", fp16: " << (info.fp16 ? "yes" : "no");
+			sstream << ", int64 atomics: " << (info.int64Atomics ? "yes" : "no");
+			sstream << ", out-of-order queue: " << (info.outOfOrderQueue ? "yes" : "no");
 
 			sstream << endl;
 		}
@@ -179,23 +319,246 @@ string ListPlatformsDevices() {
 }
 
 cl::Context GetContext(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
+	const vector<DeviceInfo>& registry = GetDeviceRegistry();
 
-	cl::Platform::get(&platforms);
+	for (unsigned int i = 0; i < registry.size(); i++)
+	{
+		if ((registry[i].platform_id == platform_id) && (registry[i].device_id == device_id))
+			return cl::Context({ registry[i].device });
+	}
 
-	for (unsigned int i = 0; i < platforms.size(); i++)
+	return cl::Context();
+}
+
+// bitonic sort of (key, int value) pairs in place with the bitonic_*_<name> kernels, e.g. "kv" or "time"
+// n must be a power of 2 and a multiple of local_size, key_size is the size of one key in bytes
+// kernel events are appended to events (if given) for profiling
+void EnqueueBitonicSort(const cl::CommandQueue& queue, const cl::Program& program, const string& name,
+	const cl::Buffer& keys, const cl::Buffer& vals, size_t n, size_t key_size, size_t local_size, vector<cl::Event>* events = 0) {
+	cl::Event event;
+
+	// sort every workgroup chunk in local memory first
+	cl::Kernel kernel_sort_local(program, ("bitonic_sort_" + name + "_local").c_str());
+	kernel_sort_local.setArg(0, keys);
+	kernel_sort_local.setArg(1, vals);
+	kernel_sort_local.setArg(2, cl::Local(local_size * key_size));
+	kernel_sort_local.setArg(3, cl::Local(local_size * sizeof(cl_int)));
+
+	queue.enqueueNDRangeKernel(kernel_sort_local, cl::NullRange, cl::NDRange(n), cl::NDRange(local_size), NULL, &event);
+	if (events)
+		events->push_back(event);
+
+	cl::Kernel kernel_merge_global(program, ("bitonic_merge_" + name + "_global").c_str());
+	kernel_merge_global.setArg(0, keys);
+	kernel_merge_global.setArg(1, vals);
+
+	cl::Kernel kernel_merge_local(program, ("bitonic_merge_" + name + "_local").c_str());
+	kernel_merge_local.setArg(0, keys);
+	kernel_merge_local.setArg(1, vals);
+	kernel_merge_local.setArg(2, cl::Local(local_size * key_size));
+	kernel_merge_local.setArg(3, cl::Local(local_size * sizeof(cl_int)));
+
+	// merge the sorted chunks, distances larger than a workgroup go through global memory
+	// and the rest of each stage finishes in local memory
+	for (cl_int k = 2 * (cl_int)local_size; k <= (cl_int)n; k *= 2)
 	{
-		vector<cl::Device> devices;
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		for (cl_int j = k / 2; j >= (cl_int)local_size; j /= 2)
+		{
+			kernel_merge_global.setArg(2, k);
+			kernel_merge_global.setArg(3, j);
 
-		for (unsigned int j = 0; j < devices.size(); j++)
+			queue.enqueueNDRangeKernel(kernel_merge_global, cl::NullRange, cl::NDRange(n), cl::NDRange(local_size), NULL, &event);
+			if (events)
+				events->push_back(event);
+		}
+
+		kernel_merge_local.setArg(4, k);
+
+		queue.enqueueNDRangeKernel(kernel_merge_local, cl::NullRange, cl::NDRange(n), cl::NDRange(local_size), NULL, &event);
+		if (events)
+			events->push_back(event);
+	}
+}
+
+// size classed pool of the read-write device buffers of one context: a released buffer is handed out again for
+// later requests of the same class (the next power of two) instead of being freed, so after the first query a
+// process answering many of them stops allocating device memory
+// the contents of an acquired buffer are undefined, and releasing a buffer right after enqueuing the commands that
+// use it is only safe while its next user is enqueued on the same in-order queue
+class BufferPool {
+public:
+	BufferPool(const cl::Context& context) : context(context), allocated(0), inUse(0), highWaterMark(0), allocations(0), reuses(0) {}
+
+	cl::Buffer Acquire(size_t size) {
+		size_t class_size = 256;
+		while (class_size < size)
+			class_size *= 2;
+
+		cl::Buffer buffer;
+		vector<cl::Buffer>& free_list = freeBuffers[class_size];
+
+		if (free_list.empty())
+		{
+			buffer = cl::Buffer(context, CL_MEM_READ_WRITE, class_size);
+			allocated += class_size;
+			allocations++;
+		}
+		else
 		{
-			if ((i == platform_id) && (j == device_id))
-				return cl::Context({ devices[j] });
+			buffer = free_list.back();
+			free_list.pop_back();
+			reuses++;
 		}
+
+		inUse += class_size;
+		highWaterMark = std::max(highWaterMark, inUse);
+		return buffer;
 	}
 
-	return cl::Context();
+	void Release(const cl::Buffer& buffer) {
+		size_t class_size = buffer.getInfo<CL_MEM_SIZE>();
+
+		freeBuffers[class_size].push_back(buffer);
+		inUse -= class_size;
+	}
+
+	string Report() const {
+		stringstream sstream;
+		sstream << allocations << " allocations, " << reuses << " reuses, " << allocated << " [B] allocated, high-water mark " << highWaterMark << " [B]";
+		return sstream.str();
+	}
+
+	size_t Allocated() const { return allocated; }
+	size_t HighWaterMark() const { return highWaterMark; }
+
+private:
+	cl::Context context;
+	map<size_t, vector<cl::Buffer> > freeBuffers;
+	size_t allocated;
+	size_t inUse;
+	size_t highWaterMark;
+	int allocations;
+	int reuses;
+};
+
+// work-efficient prefix scan of the first n elements of in into out (may be the same buffer)
+// name picks the scan_reduce_<name>/scan_tiles_<name> kernel pair, e.g. "add_int" or "max_float"
+// every workgroup handles a tile of 2 * local_size elements, tile totals are scanned recursively
+// kernel events are appended to events (if given) for profiling, the tile offsets come from pool
+void EnqueueScan(BufferPool& pool, const cl::CommandQueue& queue, const cl::Program& program, const string& name,
+	const cl::Buffer& in, const cl::Buffer& out, size_t n, size_t element_size, size_t local_size, bool inclusive, vector<cl::Event>* events = 0) {
+	size_t tile = 2 * local_size;
+	size_t tiles = (n + tile - 1) / tile;
+	cl::Buffer offsets = in;
+	cl::Event event;
+
+	if (!n)
+		return;
+
+	if (tiles > 1) {
+		offsets = pool.Acquire(tiles * element_size);
+
+		cl::Kernel kernel_reduce(program, ("scan_reduce_" + name).c_str());
+		kernel_reduce.setArg(0, in);
+		kernel_reduce.setArg(1, offsets);
+		kernel_reduce.setArg(2, cl::Local(tile * element_size));
+		kernel_reduce.setArg(3, (cl_int)n);
+
+		queue.enqueueNDRangeKernel(kernel_reduce, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &event);
+		if (events)
+			events->push_back(event);
+
+		// exclusive scan of the tile totals gives the offset of every tile
+		EnqueueScan(pool, queue, program, name, offsets, offsets, tiles, element_size, local_size, false, events);
+	}
+
+	cl::Kernel kernel_scan(program, ("scan_tiles_" + name).c_str());
+	kernel_scan.setArg(0, in);
+	kernel_scan.setArg(1, out);
+	kernel_scan.setArg(2, offsets); // unused for a single tile
+	kernel_scan.setArg(3, cl::Local(tile * element_size));
+	kernel_scan.setArg(4, (cl_int)n);
+	kernel_scan.setArg(5, (cl_int)inclusive);
+	kernel_scan.setArg(6, (cl_int)(tiles > 1));
+
+	queue.enqueueNDRangeKernel(kernel_scan, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &event);
+	if (events)
+		events->push_back(event);
+
+	if (tiles > 1)
+		pool.Release(offsets);
+}
+
+// read-only buffer over size bytes of host data: on devices sharing memory with the host (CL_DEVICE_HOST_UNIFIED_MEMORY)
+// the buffer uses the page aligned data in place (CL_MEM_USE_HOST_PTR) and nothing is copied, the data must then
+// stay alive and unchanged while the buffer is used, other devices get their own copy written through the queue
+cl::Buffer CreateInputBuffer(const cl::Context& context, const cl::CommandQueue& queue, bool zero_copy, size_t size, void* data, vector<cl::Event>* events = 0) {
+	if (zero_copy)
+		return cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, size, data);
+
+	cl::Buffer buffer(context, CL_MEM_READ_ONLY, size);
+	cl::Event event;
+
+	queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, size, data, NULL, &event);
+	if (events)
+		events->push_back(event);
+
+	return buffer;
+}
+
+// values in each of the two level buffers of EnqueueReduction: one partial per work group of the first level,
+// padded to a whole number of work groups, which is all the later (smaller) levels need as well
+size_t ReductionLevelSize(size_t n, size_t local_size) {
+	size_t groups = (n + local_size - 1) / local_size;
+	return ((groups + local_size - 1) / local_size) * local_size;
+}
+
+// enqueues the tree reduction of the n values read by first (n a multiple of local_size), level after level,
+// without any blocking read in between: every level waits for the one before it through its event, so the
+// queue can be out-of-order and other work can run next to it
+// first writes one partial per work group into its argument first_output, the later levels run next (input 0, output 1)
+// the level outputs alternate between the two levels buffers of ReductionLevelSize values, the tail behind the partials
+// is filled with identity, result is the one holding the reduced value at [0] once the returned event is complete
+// and events gets the kernel of every level, T is the element type of the partials (float, or cl_int for the int kernels)
+template <typename T>
+cl::Event EnqueueReduction(const cl::CommandQueue& queue, cl::Kernel& first, int first_output, cl::Kernel& next, const cl::Buffer* levels,
+	size_t n, size_t local_size, T identity, const vector<cl::Event>& wait, cl::Buffer& result, vector<cl::Event>* events = 0) {
+	size_t groups = (n + local_size - 1) / local_size;
+	vector<cl::Event> deps = wait;
+	cl::Event event;
+	int out = 0;
+
+	first.setArg(first_output, levels[out]);
+
+	for (size_t count = n, level = 0; ; count = groups, groups = (count + local_size - 1) / local_size, out = 1 - out, level++)
+	{
+		size_t level_size = ((groups + local_size - 1) / local_size) * local_size;
+
+		if (groups < level_size)
+		{
+			// the tail the next level reads past the partials
+			queue.enqueueFillBuffer(levels[out], identity, groups * sizeof(T), (level_size - groups) * sizeof(T), &deps, &event);
+			deps.push_back(event);
+		}
+
+		if (level)
+		{
+			next.setArg(0, levels[1 - out]);
+			next.setArg(1, levels[out]);
+		}
+
+		queue.enqueueNDRangeKernel(level ? next : first, cl::NullRange, cl::NDRange(((count + local_size - 1) / local_size) * local_size), cl::NDRange(local_size), &deps, &event);
+		if (events)
+			events->push_back(event);
+
+		deps = vector<cl::Event>(1, event);
+
+		if (groups == 1)
+			break;
+	}
+
+	result = levels[out];
+	return event;
 }
 
 enum ProfilingResolution {
@@ -222,4 +585,158 @@ string GetFullProfilingInfo(const cl::Event& evnt, ProfilingResolution resolutio
 	}
 
 	return sstream.str();
-}
\ No newline at end of file
+}
+
+// sum of the execution times [ns] of a list of kernel events, waits for them to finish first
+cl_ulong GetKernelTime(const vector<cl::Event>& events) {
+	cl_ulong total = 0;
+
+	if (!events.empty())
+		cl::WaitForEvents(events);
+
+	for (unsigned int i = 0; i < events.size(); i++)
+		total += events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>() - events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+
+	return total;
+}
+
+// start/end of every event relative to the first start, the time any command was running and the average
+// number of commands running at once over that span, waits for the events to finish first
+string GetTimelineReport(const vector<string>& labels, const vector<cl::Event>& events) {
+	stringstream sstream;
+
+	if (events.empty())
+		return "";
+
+	cl::WaitForEvents(events);
+
+	vector<cl_ulong> start(events.size()), end(events.size());
+	cl_ulong first = ~(cl_ulong)0, last = 0, busy = 0;
+
+	for (unsigned int i = 0; i < events.size(); i++)
+	{
+		start[i] = events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		end[i] = events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		first = std::min(first, start[i]);
+		last = std::max(last, end[i]);
+		busy += end[i] - start[i];
+	}
+
+	// most commands running at the same time, from the sorted start and end points
+	vector<pair<cl_ulong, int> > points;
+	for (unsigned int i = 0; i < events.size(); i++)
+	{
+		points.push_back(make_pair(start[i], 1));
+		points.push_back(make_pair(end[i], -1));
+	}
+	sort(points.begin(), points.end());
+
+	int running = 0, most = 0;
+	for (unsigned int i = 0; i < points.size(); i++)
+	{
+		running += points[i].second;
+		most = std::max(most, running);
+	}
+
+	for (unsigned int i = 0; i < events.size(); i++)
+	{
+		sstream << labels[i] << "\t" << (start[i] - first) / PROF_US << " - " << (end[i] - first) / PROF_US << " [us]" << endl;
+	}
+
+	sstream << "span [us]: " << (last - first) / PROF_US << ", busy [us]: " << busy / PROF_US;
+	sstream << ", concurrency: " << (last > first ? (double)busy / (last - first) : 1.0) << ", most at once: " << most << endl;
+
+	return sstream.str();
+}
+// first index in [first, last) of an ascending cl_uint buffer whose value is not less than value
+// binary search reading a single element per step, so the buffer is never copied to the host
+size_t LowerBound(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t first, size_t last, cl_uint value) {
+	while (first < last)
+	{
+		size_t mid = first + (last - first) / 2;
+		cl_uint element;
+
+		queue.enqueueReadBuffer(buffer, CL_TRUE, mid * sizeof(cl_uint), sizeof(cl_uint), &element);
+
+		if (element < value)
+			first = mid + 1;
+		else
+			last = mid;
+	}
+
+	return first;
+}
+
+// 64-bit FNV-1a hash
+template <typename T>
+cl_ulong HashBytes(const T* data, size_t size, cl_ulong hash = 14695981039346656037ULL) {
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+// identifies a program binary: the hash of its sources, the build options and the device and driver it was compiled for
+string ProgramCacheKey(cl_ulong source_hash, const string& options, const cl::Device& device) {
+	cl_ulong hash = HashBytes(options.c_str(), options.size(), source_hash);
+
+	const DeviceInfo& info = GetDeviceInfo(device);
+	string device_id = info.name + info.version + info.driverVersion;
+	hash = HashBytes(device_id.c_str(), device_id.size(), hash);
+
+	stringstream sstream;
+	sstream << hex << setfill('0') << setw(16) << hash;
+	return sstream.str();
+}
+
+string ProgramCacheKey(const cl::Program::Sources& sources, const string& options, const cl::Device& device) {
+	cl_ulong hash = HashBytes("", 0);
+
+	for (unsigned int i = 0; i < sources.size(); i++)
+		hash = HashBytes(sources[i].first, sources[i].second, hash);
+
+	return ProgramCacheKey(hash, options, device);
+}
+
+// builds the program from a binary stored by SaveProgramBinary, false if there is none or the driver rejects it
+bool LoadProgramBinary(const cl::Context& context, const cl::Device& device, const string& file_name, const string& options, cl::Program& program) {
+	ifstream file(file_name.c_str(), ios::binary);
+	if (!file)
+		return false;
+
+	vector<char> binary((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	if (binary.empty())
+		return false;
+
+	try
+	{
+		vector<cl::Device> devices(1, device);
+		cl::Program::Binaries binaries(1, make_pair((const void*)&binary[0], binary.size()));
+
+		program = cl::Program(context, devices, binaries);
+		program.build(devices, options.c_str());
+	}
+	catch (const cl::Error&)
+	{
+		return false;
+	}
+	// e.g. CL_INVALID_BINARY after a driver update that kept the version string, the caller builds from source
+
+	return true;
+}
+
+// stores the binary of a program built for a single device
+void SaveProgramBinary(const cl::Program& program, const string& file_name) {
+	vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	if (sizes.size() != 1 || !sizes[0])
+		return;
+
+	vector<unsigned char> binary(sizes[0]);
+	unsigned char* binaries[1] = { &binary[0] };
+
+	if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS)
+		return;
+	// cl.hpp does not allocate the binaries itself, so the C API is used with preallocated storage
+
+	ofstream file(file_name.c_str(), ios::binary);
+	file.write((const char*)&binary[0], binary.size());
+}
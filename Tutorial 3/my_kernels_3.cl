@@ -1,4 +1,109 @@
 ﻿
+// ********** SHARED HELPERS **********
+// packed timestamp fields (see PackTimestamp in TempData.h) and float atomics, the generated query kernels
+// compile this section on its own as their prelude (see QueryPrelude in Query.h), so it must stay self-contained
+
+int ts_year(uint ts) { return ts >> 20; }
+int ts_month(uint ts) { return (ts >> 16) & 0xF; }
+int ts_day(uint ts) { return (ts >> 11) & 0x1F; }
+int ts_hour(uint ts) { return (ts >> 6) & 0x1F; }
+int ts_minute(uint ts) { return ts & 0x3F; }
+
+constant int days_before_month[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+// 0 based day of the year, 29th of February is day 59 and later days move by one in leap years
+int ts_day_of_year(uint ts)
+{
+	int year = ts_year(ts);
+	int month = ts_month(ts);
+	bool leap = ((year % 4 == 0) && (year % 100 != 0)) || (year % 400 == 0);
+
+	return days_before_month[month - 1] + ts_day(ts) - 1 + ((leap && month > 2) ? 1 : 0);
+}
+
+// OpenCL 1.2 has no float atomics, these emulate them with a compare-and-swap loop on the bit pattern
+void atomic_add_float_global(volatile global float* p, float v)
+{
+	uint old = as_uint(*p);
+	uint assumed;
+
+	do
+	{
+		assumed = old;
+		old = atomic_cmpxchg((volatile global uint*)p, assumed, as_uint(as_float(assumed) + v));
+	} while (old != assumed);
+}
+
+void atomic_min_float_global(volatile global float* p, float v)
+{
+	uint old = as_uint(*p);
+	uint assumed;
+
+	while (v < as_float(old))
+	{
+		assumed = old;
+		old = atomic_cmpxchg((volatile global uint*)p, assumed, as_uint(v));
+		if (old == assumed)
+			break;
+	}
+}
+
+void atomic_max_float_global(volatile global float* p, float v)
+{
+	uint old = as_uint(*p);
+	uint assumed;
+
+	while (v > as_float(old))
+	{
+		assumed = old;
+		old = atomic_cmpxchg((volatile global uint*)p, assumed, as_uint(v));
+		if (old == assumed)
+			break;
+	}
+}
+
+void atomic_add_float_local(volatile local float* p, float v)
+{
+	uint old = as_uint(*p);
+	uint assumed;
+
+	do
+	{
+		assumed = old;
+		old = atomic_cmpxchg((volatile local uint*)p, assumed, as_uint(as_float(assumed) + v));
+	} while (old != assumed);
+}
+
+void atomic_min_float_local(volatile local float* p, float v)
+{
+	uint old = as_uint(*p);
+	uint assumed;
+
+	while (v < as_float(old))
+	{
+		assumed = old;
+		old = atomic_cmpxchg((volatile local uint*)p, assumed, as_uint(v));
+		if (old == assumed)
+			break;
+	}
+}
+
+void atomic_max_float_local(volatile local float* p, float v)
+{
+	uint old = as_uint(*p);
+	uint assumed;
+
+	while (v > as_float(old))
+	{
+		assumed = old;
+		old = atomic_cmpxchg((volatile local uint*)p, assumed, as_uint(v));
+		if (old == assumed)
+			break;
+	}
+}
+
+// ********** END SHARED HELPERS **********
+
 //reduce using local memory + accumulation of local sums into a single location
 //works with any number of groups - not optimal!
 kernel void reduce_add_4(global const float* A, global float* B, local float* scratch) 
@@ -39,7 +144,8 @@ kernel void reduce_add_4(global const float* A, global float* B, local float* sc
 	}
 }
 
-kernel void reduce_max_4(global const float* A, global float* C, local float* scratch)
+// n is the number of real values, the padding behind them is read as the identity
+kernel void reduce_max_4(global const float* A, global float* C, local float* scratch, int n)
 {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
@@ -48,7 +154,7 @@ kernel void reduce_max_4(global const float* A, global float* C, local float* sc
 	int gid = get_group_id(0);
 
 	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+	scratch[lid] = id < n ? A[id] : -INFINITY;
 
 	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
 
@@ -72,7 +178,8 @@ kernel void reduce_max_4(global const float* A, global float* C, local float* sc
 	}
 }
 
-kernel void reduce_min_4(global const float* A, global float* D, local float* scratch)
+// n is the number of real values, the padding behind them is read as the identity
+kernel void reduce_min_4(global const float* A, global float* D, local float* scratch, int n)
 {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
@@ -81,7 +188,7 @@ kernel void reduce_min_4(global const float* A, global float* D, local float* sc
 	int gid = get_group_id(0);
 
 	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+	scratch[lid] = id < n ? A[id] : INFINITY;
 
 	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
 
@@ -107,7 +214,8 @@ kernel void reduce_min_4(global const float* A, global float* D, local float* sc
 	}
 }
 
-kernel void reduce_standDev_4(global const float* A, global float* B, global float* avgTotal, local float* scratch)
+// the mean is taken over the n real values only, the padding adds nothing to the sum of squares
+kernel void reduce_standDev_4(global const float* A, global float* B, global float* avgTotal, local float* scratch, int n)
 {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
@@ -115,10 +223,10 @@ kernel void reduce_standDev_4(global const float* A, global float* B, global flo
 	int N = get_global_size(0);
 	int gid = get_group_id(0);
 
-	float avg = avgTotal[0] / N; // getting mean value
+	float avg = avgTotal[0] / n; // getting mean value
 
 	//cache all N values from global memory to local memory
-	scratch[lid] =  ((A[id] - avg) * (A[id] - avg)); // claucualting stand dev
+	scratch[lid] = id < n ? ((A[id] - avg) * (A[id] - avg)) : 0.0f; // claucualting stand dev
 
 	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
 
@@ -238,3 +346,1273 @@ kernel void sort_oddeven(global float* A, global float* B)
 	}
 }
 
+// ********** ARGSORT **********
+// bitonic sort of (temperature, record index) pairs so sorted readings can be traced
+// back to their station and timestamp
+// the sorted length must be a power of 2 and a multiple of the workgroup size
+
+// compare-exchange of two pairs, ties are broken on the record index so the order is stable
+void cmpxchg_kv(float* keyA, int* valA, float* keyB, int* valB, bool ascending)
+{
+	bool greater = (*keyA > *keyB) || (*keyA == *keyB && *valA > *valB);
+
+	if (greater == ascending)
+	{
+		float tk = *keyA; *keyA = *keyB; *keyB = tk;
+		int tv = *valA; *valA = *valB; *valB = tv;
+	}
+}
+
+// copies the input into the key/value buffers, padding past n with +INFINITY keys that sort to the end
+kernel void init_argsort(global const float* A, global float* keys, global int* vals, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		keys[id] = A[id];
+		vals[id] = id;
+	}
+	else
+	{
+		keys[id] = INFINITY;
+		vals[id] = -1;
+	}
+}
+
+// compare-exchange of (station, timestamp) keys used to put the records in time order per station
+void cmpxchg_time(ulong* keyA, int* valA, ulong* keyB, int* valB, bool ascending)
+{
+	bool greater = (*keyA > *keyB) || (*keyA == *keyB && *valA > *valB);
+
+	if (greater == ascending)
+	{
+		ulong tk = *keyA; *keyA = *keyB; *keyB = tk;
+		int tv = *valA; *valA = *valB; *valB = tv;
+	}
+}
+
+// BITONIC_KERNELS instantiates the three sorting kernels for a key type K and its compare-exchange,
+// the host side is EnqueueBitonicSort in Utils.h
+//   bitonic_sort_<NAME>_local: sorts each workgroup chunk in local memory, neighbouring chunks alternate
+//     direction so that they form bitonic sequences for the following merge stages
+//   bitonic_merge_<NAME>_global: one merge step of stage k for a compare distance j that spans several workgroups
+//   bitonic_merge_<NAME>_local: remaining merge steps of stage k once the compare distance fits inside a workgroup
+
+#define BITONIC_STEP(CMPXCHG, K, k, j) \
+	{ \
+		int ixj = lid ^ j; \
+ \
+		if (ixj > lid) \
+		{ \
+			K keyA = lkeys[lid]; int valA = lvals[lid]; \
+			K keyB = lkeys[ixj]; int valB = lvals[ixj]; \
+			CMPXCHG(&keyA, &valA, &keyB, &valB, (id & k) == 0); \
+			lkeys[lid] = keyA; lvals[lid] = valA; \
+			lkeys[ixj] = keyB; lvals[ixj] = valB; \
+		} \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+	}
+
+#define BITONIC_KERNELS(NAME, K, CMPXCHG) \
+kernel void bitonic_sort_##NAME##_local(global K* keys, global int* vals, local K* lkeys, local int* lvals) \
+{ \
+	int id = get_global_id(0); \
+	int lid = get_local_id(0); \
+	int lN = get_local_size(0); \
+ \
+	lkeys[lid] = keys[id]; \
+	lvals[lid] = vals[id]; \
+ \
+	barrier(CLK_LOCAL_MEM_FENCE); \
+ \
+	for (int k = 2; k <= lN; k *= 2) \
+	{ \
+		for (int j = k / 2; j > 0; j /= 2) \
+			BITONIC_STEP(CMPXCHG, K, k, j) \
+	} \
+ \
+	keys[id] = lkeys[lid]; \
+	vals[id] = lvals[lid]; \
+} \
+ \
+kernel void bitonic_merge_##NAME##_global(global K* keys, global int* vals, int k, int j) \
+{ \
+	int id = get_global_id(0); \
+	int ixj = id ^ j; \
+ \
+	if (ixj > id) \
+	{ \
+		K keyA = keys[id]; int valA = vals[id]; \
+		K keyB = keys[ixj]; int valB = vals[ixj]; \
+		CMPXCHG(&keyA, &valA, &keyB, &valB, (id & k) == 0); \
+		keys[id] = keyA; vals[id] = valA; \
+		keys[ixj] = keyB; vals[ixj] = valB; \
+	} \
+} \
+ \
+kernel void bitonic_merge_##NAME##_local(global K* keys, global int* vals, local K* lkeys, local int* lvals, int k) \
+{ \
+	int id = get_global_id(0); \
+	int lid = get_local_id(0); \
+	int lN = get_local_size(0); \
+ \
+	lkeys[lid] = keys[id]; \
+	lvals[lid] = vals[id]; \
+ \
+	barrier(CLK_LOCAL_MEM_FENCE); \
+ \
+	for (int j = lN / 2; j > 0; j /= 2) \
+		BITONIC_STEP(CMPXCHG, K, k, j) \
+ \
+	keys[id] = lkeys[lid]; \
+	vals[id] = lvals[lid]; \
+}
+
+BITONIC_KERNELS(kv, float, cmpxchg_kv)
+BITONIC_KERNELS(time, ulong, cmpxchg_time)
+
+// picks the k coldest and k hottest readings out of the sorted pairs together with their station and timestamp
+// launched with 2k work items: outputs [0, k) are the coldest (ascending), [k, 2k) the hottest (descending)
+kernel void gather_extremes(global const float* keys, global const int* vals, global const int* station, global const uint* timestamp,
+	global float* outTemp, global int* outStation, global uint* outTime, int n)
+{
+	int id = get_global_id(0);
+	int k = get_global_size(0) / 2;
+
+	int src = (id < k) ? id : (n - 1 - (id - k));
+	int record = vals[src];
+
+	outTemp[id] = keys[src];
+	outStation[id] = station[record];
+	outTime[id] = timestamp[record];
+}
+
+// ********** TOP-K **********
+// keeps the TOPK largest (or smallest) readings of every workgroup chunk, the lists are merged
+// by further passes of merge_topk_4 until only TOPK values are left
+// TOPK is fixed at compile time through the build options (-DTOPK=k) and must be at most half the workgroup size
+// so that every merge pass shrinks the number of lists
+
+#ifndef TOPK
+#define TOPK 10
+#endif
+
+// sorts the workgroup chunk in local memory so that the TOPK wanted values come first, then writes them out
+void topk_local(local float* lkeys, local int* lvals, global float* B, global int* Bidx, int largest)
+{
+	int lid = get_local_id(0);
+	int lN = get_local_size(0);
+	int gid = get_group_id(0);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int k = 2; k <= lN; k *= 2)
+	{
+		for (int j = k / 2; j > 0; j /= 2)
+		{
+			int ixj = lid ^ j;
+
+			if (ixj > lid)
+			{
+				float keyA = lkeys[lid]; int valA = lvals[lid];
+				float keyB = lkeys[ixj]; int valB = lvals[ixj];
+				cmpxchg_kv(&keyA, &valA, &keyB, &valB, ((lid & k) == 0) != (largest != 0));
+				lkeys[lid] = keyA; lvals[lid] = valA;
+				lkeys[ixj] = keyB; lvals[ixj] = valB;
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+	}
+
+	if (lid < TOPK)
+	{
+		B[gid * TOPK + lid] = lkeys[lid];
+		Bidx[gid * TOPK + lid] = lvals[lid];
+	}
+}
+
+// first pass over the raw readings, the record index is the global id
+kernel void reduce_topk_4(global const float* A, global float* B, global int* Bidx, local float* lkeys, local int* lvals, int n, int largest)
+{
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+
+	lkeys[lid] = (id < n) ? A[id] : (largest ? -INFINITY : INFINITY);
+	lvals[lid] = (id < n) ? id : -1;
+
+	topk_local(lkeys, lvals, B, Bidx, largest);
+}
+
+// later passes merge the per-workgroup lists, keeping the record index of every value
+kernel void merge_topk_4(global const float* A, global const int* Aidx, global float* B, global int* Bidx, local float* lkeys, local int* lvals, int n, int largest)
+{
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+
+	lkeys[lid] = (id < n) ? A[id] : (largest ? -INFINITY : INFINITY);
+	lvals[lid] = (id < n) ? Aidx[id] : -1;
+
+	topk_local(lkeys, lvals, B, Bidx, largest);
+}
+
+// ********** GROUP-BY **********
+// every group is summarised by its count and MOMENTS floats: sum, sum of squares, min and max
+// stats[group * MOMENTS + MOMENT_*], the host reads the same layout back (see GroupStats in TempData.h)
+
+#define MOMENTS 4
+#define MOMENT_SUM 0
+#define MOMENT_SUMSQ 1
+#define MOMENT_MIN 2
+#define MOMENT_MAX 3
+
+// empty moments: zero sums, min/max at +/-INFINITY so the first reading replaces them
+void init_moments(float* stats)
+{
+	stats[MOMENT_SUM] = 0.0f;
+	stats[MOMENT_SUMSQ] = 0.0f;
+	stats[MOMENT_MIN] = INFINITY;
+	stats[MOMENT_MAX] = -INFINITY;
+}
+
+// one work item per group
+kernel void init_group_stats(global float* stats, global int* counts)
+{
+	int id = get_global_id(0);
+	float empty[MOMENTS];
+
+	init_moments(empty);
+	for (int m = 0; m < MOMENTS; m++)
+	{
+		stats[id * MOMENTS + m] = empty[m];
+	}
+	counts[id] = 0;
+}
+
+// adds the local moments of one group into the global table
+void merge_moments_global(global float* stats, global int* counts, local const float* lstats, local const int* lcounts, int group)
+{
+	atomic_add(&counts[group], lcounts[group]);
+	atomic_add_float_global(&stats[group * MOMENTS + MOMENT_SUM], lstats[group * MOMENTS + MOMENT_SUM]);
+	atomic_add_float_global(&stats[group * MOMENTS + MOMENT_SUMSQ], lstats[group * MOMENTS + MOMENT_SUMSQ]);
+	atomic_min_float_global(&stats[group * MOMENTS + MOMENT_MIN], lstats[group * MOMENTS + MOMENT_MIN]);
+	atomic_max_float_global(&stats[group * MOMENTS + MOMENT_MAX], lstats[group * MOMENTS + MOMENT_MAX]);
+}
+
+// sets the moments of nGroups groups in local memory to empty
+void init_moments_local(local float* lstats, local int* lcounts, int nGroups)
+{
+	int lid = get_local_id(0);
+	int lN = get_local_size(0);
+
+	for (int g = lid; g < nGroups; g += lN)
+	{
+		float empty[MOMENTS];
+		init_moments(empty);
+		for (int m = 0; m < MOMENTS; m++)
+		{
+			lstats[g * MOMENTS + m] = empty[m];
+		}
+		lcounts[g] = 0;
+	}
+}
+
+// adds one reading to the local moments of its group
+void accumulate_local(local float* lstats, local int* lcounts, int group, float t)
+{
+	atomic_inc(&lcounts[group]);
+	atomic_add_float_local(&lstats[group * MOMENTS + MOMENT_SUM], t);
+	atomic_add_float_local(&lstats[group * MOMENTS + MOMENT_SUMSQ], t * t);
+	atomic_min_float_local(&lstats[group * MOMENTS + MOMENT_MIN], t);
+	atomic_max_float_local(&lstats[group * MOMENTS + MOMENT_MAX], t);
+}
+
+// adds one reading straight into the global moments of its group
+void accumulate_global(global float* stats, global int* counts, int group, float t)
+{
+	atomic_inc(&counts[group]);
+	atomic_add_float_global(&stats[group * MOMENTS + MOMENT_SUM], t);
+	atomic_add_float_global(&stats[group * MOMENTS + MOMENT_SUMSQ], t * t);
+	atomic_min_float_global(&stats[group * MOMENTS + MOMENT_MIN], t);
+	atomic_max_float_global(&stats[group * MOMENTS + MOMENT_MAX], t);
+}
+
+// merges the non-empty local groups of the workgroup into the global table
+void merge_moments_local(global float* stats, global int* counts, local const float* lstats, local const int* lcounts, int nGroups)
+{
+	int lid = get_local_id(0);
+	int lN = get_local_size(0);
+
+	for (int g = lid; g < nGroups; g += lN)
+	{
+		if (lcounts[g])
+		{
+			merge_moments_global(stats, counts, lstats, lcounts, g);
+		}
+	}
+}
+
+// group-by on the station id column in a single read of the data
+// each workgroup accumulates the moments of every station in local memory, then adds them
+// into the global table (initialised by init_group_stats) with one atomic per station and moment
+kernel void reduce_station_stats(global const float* A, global const int* station, global float* stats, global int* counts,
+	local float* lstats, local int* lcounts, int n, int nStations)
+{
+	int id = get_global_id(0);
+
+	init_moments_local(lstats, lcounts, nStations);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < n)
+	{
+		accumulate_local(lstats, lcounts, station[id], A[id]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	merge_moments_local(stats, counts, lstats, lcounts, nStations);
+}
+
+// ********** CALENDAR GROUP-BY **********
+// dense group-by on keys derived from the packed timestamp column (see PackTimestamp in TempData.h)
+
+#define KEY_YEAR 0
+#define KEY_YEAR_MONTH 1
+#define KEY_DAY_OF_YEAR 2
+#define KEY_HOUR 3
+
+// bucket index of a timestamp for the given key, years count from firstYear
+int calendar_bucket(uint ts, int key, int firstYear)
+{
+	switch (key)
+	{
+	case KEY_YEAR: return ts_year(ts) - firstYear;
+	case KEY_YEAR_MONTH: return (ts_year(ts) - firstYear) * 12 + ts_month(ts) - 1;
+	case KEY_DAY_OF_YEAR: return ts_day_of_year(ts);
+	default: return ts_hour(ts);
+	}
+}
+
+// local memory privatised version, used when nBuckets groups of moments fit into local memory
+kernel void reduce_calendar_stats(global const float* A, global const uint* timestamp, global float* stats, global int* counts,
+	local float* lstats, local int* lcounts, int n, int key, int firstYear, int nBuckets)
+{
+	int id = get_global_id(0);
+
+	init_moments_local(lstats, lcounts, nBuckets);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < n)
+	{
+		accumulate_local(lstats, lcounts, calendar_bucket(timestamp[id], key, firstYear), A[id]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	merge_moments_local(stats, counts, lstats, lcounts, nBuckets);
+}
+
+// fallback for bucket counts that exceed local memory, every reading goes straight to the global table
+kernel void reduce_calendar_stats_global(global const float* A, global const uint* timestamp, global float* stats, global int* counts,
+	int n, int key, int firstYear)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		accumulate_global(stats, counts, calendar_bucket(timestamp[id], key, firstYear), A[id]);
+	}
+}
+
+// ********** HASH GROUP-BY **********
+// group-by on composite keys with too many groups for dense buckets (e.g. station x date)
+// open addressing hash table in global memory: keys[slot] is claimed with atomic_cmpxchg and the
+// moments of the slot are accumulated in stats/counts, compact_hash_groups then packs the used slots
+
+#define HASH_EMPTY 0xFFFFFFFF
+
+#define HKEY_STATION 0
+#define HKEY_STATION_YEAR 1
+#define HKEY_STATION_YEAR_MONTH 2
+#define HKEY_STATION_DATE 3
+
+// station in the top 11 bits, the remaining 21 bits are the date part of the packed timestamp
+// (year, month, day) with the parts below the requested resolution cleared
+uint composite_key(int station, uint ts, int keyType)
+{
+	uint date = ts >> 11;
+
+	switch (keyType)
+	{
+	case HKEY_STATION: date = 0; break;
+	case HKEY_STATION_YEAR: date &= 0xFFFFFE00; break;
+	case HKEY_STATION_YEAR_MONTH: date &= 0xFFFFFFE0; break;
+	default: break;
+	}
+
+	return ((uint)station << 21) | date;
+}
+
+// murmur3 finaliser, spreads neighbouring keys over the table
+uint hash_key(uint key)
+{
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
+	return key;
+}
+
+// capacity (mask + 1) must be a power of 2 larger than the number of groups
+kernel void hash_group_stats(global const float* A, global const int* station, global const uint* timestamp,
+	global uint* keys, global float* stats, global int* counts, int n, int keyType, uint mask)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		uint key = composite_key(station[id], timestamp[id], keyType);
+		uint slot = hash_key(key) & mask;
+
+		// linear probing until the slot holds our key or an empty slot is claimed for it
+		while (true)
+		{
+			uint prev = atomic_cmpxchg(&keys[slot], HASH_EMPTY, key);
+
+			if (prev == HASH_EMPTY || prev == key)
+			{
+				accumulate_global(stats, counts, slot, A[id]);
+				break;
+			}
+			slot = (slot + 1) & mask;
+		}
+	}
+}
+
+// one work item per slot, used slots are appended to the output table in no particular order
+kernel void compact_hash_groups(global const uint* keys, global const float* stats, global const int* counts,
+	global uint* outKeys, global float* outStats, global int* outCounts, global int* outGroups)
+{
+	int id = get_global_id(0);
+
+	if (keys[id] != HASH_EMPTY)
+	{
+		int row = atomic_inc(outGroups);
+
+		outKeys[row] = keys[id];
+		for (int m = 0; m < MOMENTS; m++)
+		{
+			outStats[row * MOMENTS + m] = stats[id * MOMENTS + m];
+		}
+		outCounts[row] = counts[id];
+	}
+}
+
+// ********** SCAN **********
+// work-efficient inclusive/exclusive prefix scan in three phases (reduce-then-scan), driven by EnqueueScan in Utils.h:
+//   1. scan_reduce_<name>: every workgroup reduces a tile of 2 * lN elements to one total
+//   2. the tile totals are scanned (recursively, by the same kernels) into per-tile offsets
+//   3. scan_tiles_<name>: every tile is scanned in local memory (Blelloch up/down-sweep) and its offset added
+// the operator only has to be associative, operands are always combined in input order
+// SCAN_KERNELS instantiates both kernels for an element type, operator and its identity
+
+#define OP_ADD(a, b) ((a) + (b))
+#define OP_MAX_INT(a, b) max((a), (b))
+#define OP_MIN_INT(a, b) min((a), (b))
+#define OP_MAX_FLOAT(a, b) fmax((a), (b))
+#define OP_MIN_FLOAT(a, b) fmin((a), (b))
+
+#define SCAN_UPSWEEP(OP) \
+	for (int d = lN; d > 0; d >>= 1) \
+	{ \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+		if (lid < d) \
+		{ \
+			int i = offset * (2 * lid + 1) - 1; \
+			int j = offset * (2 * lid + 2) - 1; \
+			scratch[j] = OP(scratch[i], scratch[j]); \
+		} \
+		offset *= 2; \
+	} \
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+#define SCAN_KERNELS(NAME, T, OP, IDENTITY) \
+kernel void scan_reduce_##NAME(global const T* A, global T* sums, local T* scratch, int n) \
+{ \
+	int lid = get_local_id(0); \
+	int lN = get_local_size(0); \
+	int base = get_group_id(0) * 2 * lN; \
+	int offset = 1; \
+ \
+	scratch[lid] = (base + lid < n) ? A[base + lid] : IDENTITY; \
+	scratch[lid + lN] = (base + lid + lN < n) ? A[base + lid + lN] : IDENTITY; \
+ \
+	SCAN_UPSWEEP(OP) \
+ \
+	if (!lid) \
+	{ \
+		sums[get_group_id(0)] = scratch[2 * lN - 1]; \
+	} \
+} \
+ \
+kernel void scan_tiles_##NAME(global const T* A, global T* B, global const T* offsets, local T* scratch, int n, int inclusive, int useOffsets) \
+{ \
+	int lid = get_local_id(0); \
+	int lN = get_local_size(0); \
+	int gid = get_group_id(0); \
+	int base = gid * 2 * lN; \
+	int offset = 1; \
+ \
+	T a0 = (base + lid < n) ? A[base + lid] : IDENTITY; \
+	T a1 = (base + lid + lN < n) ? A[base + lid + lN] : IDENTITY; \
+	scratch[lid] = a0; \
+	scratch[lid + lN] = a1; \
+ \
+	SCAN_UPSWEEP(OP) \
+ \
+	if (!lid) \
+	{ \
+		scratch[2 * lN - 1] = IDENTITY; \
+	} \
+ \
+	for (int d = 1; d < 2 * lN; d *= 2) \
+	{ \
+		offset >>= 1; \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+		if (lid < d) \
+		{ \
+			int i = offset * (2 * lid + 1) - 1; \
+			int j = offset * (2 * lid + 2) - 1; \
+			T t = scratch[i]; \
+			scratch[i] = scratch[j]; \
+			scratch[j] = OP(scratch[j], t); \
+		} \
+	} \
+	barrier(CLK_LOCAL_MEM_FENCE); \
+ \
+	T r0 = scratch[lid]; \
+	T r1 = scratch[lid + lN]; \
+	if (useOffsets) \
+	{ \
+		r0 = OP(offsets[gid], r0); \
+		r1 = OP(offsets[gid], r1); \
+	} \
+	if (inclusive) \
+	{ \
+		r0 = OP(r0, a0); \
+		r1 = OP(r1, a1); \
+	} \
+ \
+	if (base + lid < n) \
+		B[base + lid] = r0; \
+	if (base + lid + lN < n) \
+		B[base + lid + lN] = r1; \
+}
+
+SCAN_KERNELS(add_int, int, OP_ADD, 0)
+SCAN_KERNELS(add_float, float, OP_ADD, 0.0f)
+SCAN_KERNELS(max_int, int, OP_MAX_INT, INT_MIN)
+SCAN_KERNELS(min_int, int, OP_MIN_INT, INT_MAX)
+SCAN_KERNELS(max_float, float, OP_MAX_FLOAT, -INFINITY)
+SCAN_KERNELS(min_float, float, OP_MIN_FLOAT, INFINITY)
+
+// user operators are added through the build options, e.g.
+// -DSCAN_USER_T=float -DSCAN_USER_IDENTITY=1.0f "-DSCAN_USER_OP(a,b)=((a)*(b))" gives scan_reduce_user/scan_tiles_user
+#ifdef SCAN_USER_OP
+SCAN_KERNELS(user, SCAN_USER_T, SCAN_USER_OP, SCAN_USER_IDENTITY)
+#endif
+
+// ********** INT REDUCTIONS **********
+// int versions of reduce_add_4/reduce_max_4/reduce_min_4 for the benchmark, same arguments and same one
+// partial per work group, so EnqueueReduction drives them the same way (with an int identity)
+#define REDUCE_KERNEL(NAME, T, OP) \
+kernel void reduce_##NAME##_4(global const T* A, global T* B, local T* scratch) \
+{ \
+	int id = get_global_id(0); \
+	int lid = get_local_id(0); \
+	int lN = get_local_size(0); \
+ \
+	scratch[lid] = A[id]; \
+ \
+	barrier(CLK_LOCAL_MEM_FENCE); \
+ \
+	for (int stride = lN / 2; stride > 0; stride /= 2) \
+	{ \
+		if (lid < stride) \
+		{ \
+			scratch[lid] = OP(scratch[lid], scratch[lid + stride]); \
+		} \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+	} \
+ \
+	if (!lid) \
+	{ \
+		B[get_group_id(0)] = scratch[0]; \
+	} \
+}
+
+REDUCE_KERNEL(add_int, int, OP_ADD)
+REDUCE_KERNEL(max_int, int, OP_MAX_INT)
+REDUCE_KERNEL(min_int, int, OP_MIN_INT)
+
+// ********** TIME ORDER **********
+// the temperature file is not in time order, these put the records in (station, timestamp) order
+// using the bitonic_*_time kernels, so every station is one contiguous segment sorted by time
+
+// (station, timestamp) keys, padding past n with the largest key so it sorts to the end
+kernel void init_time_sort(global const int* station, global const uint* timestamp, global ulong* keys, global int* vals, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		keys[id] = ((ulong)station[id] << 32) | timestamp[id];
+		vals[id] = id;
+	}
+	else
+	{
+		keys[id] = 0xFFFFFFFFFFFFFFFFUL;
+		vals[id] = -1;
+	}
+}
+
+// permutes the columns into the sorted order
+kernel void gather_time_order(global const int* order, global const float* A, global const int* station, global const uint* timestamp,
+	global float* outTemp, global int* outStation, global uint* outTime, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		int record = order[id];
+
+		outTemp[id] = A[record];
+		outStation[id] = station[record];
+		outTime[id] = timestamp[record];
+	}
+}
+
+// ********** ROLLING WINDOWS **********
+// rolling mean, min and max over the last W readings of every station in time order
+// segments[s] is the first index of station s in the time ordered columns, segments[nSegments] = n
+// windows are cut at the start of a segment, so the first W - 1 windows of a station hold fewer readings
+
+// index of the segment holding element id
+int find_segment(global const int* segments, int nSegments, int id)
+{
+	int lo = 0;
+	int hi = nSegments - 1;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (segments[mid] <= id)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+// subtracts a bias (the mean temperature) before the prefix sum so the running total stays small
+// and the float differences in rolling_mean keep their precision
+kernel void subtract_bias(global const float* A, global float* B, float bias, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		B[id] = A[id] - bias;
+	}
+}
+
+// mean of the window ending at id from an inclusive prefix sum P of the biased values
+kernel void rolling_mean(global const float* P, global const int* segments, global float* mean, int nSegments, int W, float bias, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		int start = segments[find_segment(segments, nSegments, id)];
+		int lo = max(id - W + 1, start);
+		float sum = P[id] - ((lo > 0) ? P[lo - 1] : 0.0f);
+
+		mean[id] = sum / (id - lo + 1) + bias;
+	}
+}
+
+// van Herk/Gil-Werman: the segments are cut into blocks of W readings, g holds the running min/max from the
+// start of the block and h the running min/max to the end of the block
+// one work item per block, blockStarts[s] is the first block of segment s (blockStarts[nSegments] = total blocks)
+kernel void rolling_blocks(global const float* A, global const int* segments, global const int* blockStarts,
+	global float* gMin, global float* gMax, global float* hMin, global float* hMax, int nSegments, int W, int nBlocks)
+{
+	int b = get_global_id(0);
+
+	if (b < nBlocks)
+	{
+		int s = find_segment(blockStarts, nSegments, b);
+		int start = segments[s] + (b - blockStarts[s]) * W;
+		int end = min(start + W, segments[s + 1]);
+
+		float runMin = INFINITY;
+		float runMax = -INFINITY;
+		for (int i = start; i < end; i++)
+		{
+			runMin = fmin(runMin, A[i]);
+			runMax = fmax(runMax, A[i]);
+			gMin[i] = runMin;
+			gMax[i] = runMax;
+		}
+
+		runMin = INFINITY;
+		runMax = -INFINITY;
+		for (int i = end - 1; i >= start; i--)
+		{
+			runMin = fmin(runMin, A[i]);
+			runMax = fmax(runMax, A[i]);
+			hMin[i] = runMin;
+			hMax[i] = runMax;
+		}
+	}
+}
+
+// min/max of the window ending at id: a full window covers the tail of one block (h) and the head of the next (g)
+// a window that starts at its block start (or is cut at the segment start) lies in one block and is g alone
+kernel void rolling_minmax(global const float* gMin, global const float* gMax, global const float* hMin, global const float* hMax,
+	global const int* segments, global float* rollMin, global float* rollMax, global float* rollRange, int nSegments, int W, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		int start = segments[find_segment(segments, nSegments, id)];
+		int lo = max(id - W + 1, start);
+		float wMin = gMin[id];
+		float wMax = gMax[id];
+
+		if ((lo - start) / W != (id - start) / W)
+		{
+			wMin = fmin(hMin[lo], wMin);
+			wMax = fmax(hMax[lo], wMax);
+		}
+
+		rollMin[id] = wMin;
+		rollMax[id] = wMax;
+		rollRange[id] = wMax - wMin;
+	}
+}
+
+// ********** SEGMENTED SCAN **********
+// (head flag, value) pairs scanned with SCAN_KERNELS, a set head flag restarts the scan at that element
+// the pair operator is associative, so the three phase scan works unchanged; only inclusive scans are meaningful
+
+typedef struct
+{
+	int head;
+	float value;
+} seg_float;
+
+typedef struct
+{
+	int head;
+	int value;
+} seg_int;
+
+seg_float make_seg_float(int head, float value)
+{
+	seg_float r;
+	r.head = head;
+	r.value = value;
+	return r;
+}
+
+seg_int make_seg_int(int head, int value)
+{
+	seg_int r;
+	r.head = head;
+	r.value = value;
+	return r;
+}
+
+seg_float seg_max_float(seg_float a, seg_float b)
+{
+	return make_seg_float(a.head | b.head, b.head ? b.value : fmax(a.value, b.value));
+}
+
+seg_float seg_min_float(seg_float a, seg_float b)
+{
+	return make_seg_float(a.head | b.head, b.head ? b.value : fmin(a.value, b.value));
+}
+
+seg_int seg_add_int(seg_int a, seg_int b)
+{
+	return make_seg_int(a.head | b.head, b.head ? b.value : a.value + b.value);
+}
+
+SCAN_KERNELS(segmax_float, seg_float, seg_max_float, make_seg_float(0, -INFINITY))
+SCAN_KERNELS(segmin_float, seg_float, seg_min_float, make_seg_float(0, INFINITY))
+SCAN_KERNELS(segadd_int, seg_int, seg_add_int, make_seg_int(0, 0))
+
+// ********** STREAKS **********
+// runs of consecutive days above (heatwave) or below (cold streak) a threshold per station
+//   1. day_heads flags the first reading of every (station, day) in the time ordered columns, segmented
+//      max/min scans then leave the daily max/min on the last reading of the day
+//   2. compact_days writes one row per day, positions come from an inclusive scan of the day end flags
+//   3. run_heads flags the days that do not continue a run, segmented scans count the run length and its peak
+//   4. emit_runs writes one (station, start, length, peak) row per run, again positioned by a scan
+
+// days since 1970-01-01 of a civil date
+int days_from_civil(int y, int m, int d)
+{
+	y -= (m <= 2) ? 1 : 0;
+	int era = ((y >= 0) ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (m + ((m > 2) ? -3 : 9)) + 2) / 5 + d - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+int ts_days(uint ts)
+{
+	return days_from_civil(ts_year(ts), ts_month(ts), ts_day(ts));
+}
+
+// same station and same date
+bool same_day(global const int* station, global const uint* timestamp, int a, int b)
+{
+	return (station[a] == station[b]) && ((timestamp[a] >> 11) == (timestamp[b] >> 11));
+}
+
+kernel void day_heads(global const float* A, global const int* station, global const uint* timestamp,
+	global seg_float* dayMax, global seg_float* dayMin, global int* dayEnds, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		int head = (id == 0) || !same_day(station, timestamp, id, id - 1);
+
+		dayMax[id] = make_seg_float(head, A[id]);
+		dayMin[id] = make_seg_float(head, A[id]);
+		dayEnds[id] = (id == n - 1) || !same_day(station, timestamp, id, id + 1);
+	}
+}
+
+// dayIndex is the inclusive scan of dayEnds, so the day of a day end element is dayIndex - 1
+kernel void compact_days(global const seg_float* dayMax, global const seg_float* dayMin, global const int* dayEnds, global const int* dayIndex,
+	global const int* station, global const uint* timestamp, global float* outMax, global float* outMin, global int* outStation,
+	global uint* outDate, global int* outDays, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n && dayEnds[id])
+	{
+		int d = dayIndex[id] - 1;
+
+		outMax[d] = dayMax[id].value;
+		outMin[d] = dayMin[id].value;
+		outStation[d] = station[id];
+		outDate[d] = (timestamp[id] >> 11) << 11;
+		outDays[d] = ts_days(timestamp[id]);
+	}
+}
+
+// a day qualifies when its max is above the threshold (heat != 0) or its min is below it
+bool day_qualifies(global const float* dayMax, global const float* dayMin, int d, float threshold, int heat)
+{
+	return heat ? (dayMax[d] > threshold) : (dayMin[d] < threshold);
+}
+
+// day d qualifies and extends the run of the previous day (same station, next calendar day)
+bool day_continues(global const float* dayMax, global const float* dayMin, global const int* dayStation, global const int* dayDays,
+	int d, float threshold, int heat)
+{
+	return (d > 0) && day_qualifies(dayMax, dayMin, d, threshold, heat) && day_qualifies(dayMax, dayMin, d - 1, threshold, heat) &&
+		(dayStation[d] == dayStation[d - 1]) && (dayDays[d] == dayDays[d - 1] + 1);
+}
+
+kernel void run_heads(global const float* dayMax, global const float* dayMin, global const int* dayStation, global const int* dayDays,
+	global seg_int* runLength, global seg_float* runPeak, global int* runEnds, float threshold, int heat, int nDays)
+{
+	int d = get_global_id(0);
+
+	if (d < nDays)
+	{
+		bool q = day_qualifies(dayMax, dayMin, d, threshold, heat);
+		int head = !day_continues(dayMax, dayMin, dayStation, dayDays, d, threshold, heat);
+
+		runLength[d] = make_seg_int(head, q ? 1 : 0);
+		runPeak[d] = make_seg_float(head, heat ? dayMax[d] : dayMin[d]);
+		runEnds[d] = q && ((d == nDays - 1) || !day_continues(dayMax, dayMin, dayStation, dayDays, d + 1, threshold, heat));
+	}
+}
+
+// runIndex is the inclusive scan of runEnds
+kernel void emit_runs(global const seg_int* runLength, global const seg_float* runPeak, global const int* runEnds, global const int* runIndex,
+	global const int* dayStation, global const uint* dayDate, global int* outStation, global uint* outStart, global int* outLength,
+	global float* outPeak, int nDays)
+{
+	int d = get_global_id(0);
+
+	if (d < nDays && runEnds[d])
+	{
+		int r = runIndex[d] - 1;
+		int length = runLength[d].value;
+
+		outStation[r] = dayStation[d];
+		outStart[r] = dayDate[d - length + 1];
+		outLength[r] = length;
+		outPeak[r] = runPeak[d].value;
+	}
+}
+
+// ********** FILTER **********
+// predicates of the -f option, evaluated on the device into one selection flag per record of the blocks the zone
+// maps cannot decide, packed one after another: packed position id is record blocks[id / blockSize] * blockSize +
+// id % blockSize, an inclusive scan of the flags gives every selected record its position in the compacted columns
+
+// fields and comparisons, values match FilterField and FilterCompare in TempData.h
+#define FIELD_STATION 0
+#define FIELD_TEMP 1
+#define FIELD_YEAR 2
+#define FIELD_MONTH 3
+#define FIELD_DAY 4
+#define FIELD_HOUR 5
+#define FIELD_DATE 6
+
+#define CMP_EQ 0
+#define CMP_NE 1
+#define CMP_LT 2
+#define CMP_LE 3
+#define CMP_GT 4
+#define CMP_GE 5
+
+// same layout as the Predicate struct on the host
+typedef struct {
+	int field;
+	int op;
+	float value;
+} predicate;
+
+// all fields are small integers apart from the temperature, so they compare exactly as floats
+float field_value(global const float* A, global const int* station, global const uint* timestamp, int id, int field)
+{
+	switch (field)
+	{
+	case FIELD_STATION: return (float)station[id];
+	case FIELD_TEMP: return A[id];
+	case FIELD_YEAR: return (float)ts_year(timestamp[id]);
+	case FIELD_MONTH: return (float)ts_month(timestamp[id]);
+	case FIELD_DAY: return (float)ts_day(timestamp[id]);
+	case FIELD_HOUR: return (float)ts_hour(timestamp[id]);
+	default: return (float)(timestamp[id] >> 11);
+	}
+}
+
+bool compare_value(float x, int op, float value)
+{
+	switch (op)
+	{
+	case CMP_EQ: return x == value;
+	case CMP_NE: return x != value;
+	case CMP_LT: return x < value;
+	case CMP_LE: return x <= value;
+	case CMP_GT: return x > value;
+	default: return x >= value;
+	}
+}
+
+// record of packed position id, n (past the data) for the tail of a short last block
+int block_record(global const int* blocks, int blockSize, int id, int n)
+{
+	return min(blocks[id / blockSize] * blockSize + id % blockSize, n);
+}
+
+// flags[id] = 1 when the record of packed position id satisfies all nPreds predicates, the moments of the
+// selected records are summed into group 0 of stats/counts (initialised by init_group_stats)
+kernel void filter_blocks(global const float* A, global const int* station, global const uint* timestamp, constant predicate* preds,
+	int nPreds, global const int* blocks, int blockSize, global int* flags, global float* stats, global int* counts,
+	local float* lstats, local int* lcounts, int m, int n)
+{
+	int id = get_global_id(0);
+
+	init_moments_local(lstats, lcounts, 1);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < m)
+	{
+		int i = block_record(blocks, blockSize, id, n);
+		int selected = i < n;
+
+		for (int p = 0; p < nPreds && selected; p++)
+		{
+			selected = compare_value(field_value(A, station, timestamp, i, preds[p].field), preds[p].op, preds[p].value);
+		}
+
+		flags[id] = selected;
+		if (selected)
+		{
+			accumulate_local(lstats, lcounts, 0, A[i]);
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	merge_moments_local(stats, counts, lstats, lcounts, 1);
+}
+
+// selectIndex is the inclusive scan of the packed flags, blockDelta[p] moves the records of packed block p
+// behind the fully matching blocks before it, so the selected records keep their order
+kernel void compact_blocks(global const int* flags, global const int* selectIndex, global const int* blocks, global const int* blockDelta,
+	int blockSize, global const float* A, global const int* station, global const uint* timestamp, global float* outTemp,
+	global int* outStation, global uint* outTime, int m, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < m && flags[id])
+	{
+		int i = block_record(blocks, blockSize, id, n);
+		int s = blockDelta[id / blockSize] + selectIndex[id] - 1;
+
+		outTemp[s] = A[i];
+		outStation[s] = station[i];
+		outTime[s] = timestamp[i];
+	}
+}
+
+// station and timestamp of k records given by their index
+kernel void gather_records(global const int* index, global const int* station, global const uint* timestamp, global int* outStation,
+	global uint* outTime, int k)
+{
+	int i = get_global_id(0);
+
+	if (i < k)
+	{
+		outStation[i] = station[index[i]];
+		outTime[i] = timestamp[index[i]];
+	}
+}
+
+// ********** ZONE MAPS **********
+// count, sum, sum of squares, min and max of the temperature and the timestamp range of every block of
+// blockSize records, one workgroup per block so no atomics are needed
+// the filter uses them to skip blocks no record of which can match and to answer fully matching blocks
+// from the summary, only the blocks on the boundary of the predicates are scanned
+// the maps are stored next to the data file, workgroup g summarises block firstBlock + g into entry g,
+// so only the blocks of appended rows are summarised again
+kernel void zone_maps(global const float* A, global const uint* timestamp, global float* stats, global int* counts, global uint* zoneTime,
+	local float* lstats, local uint* ltime, int n, int blockSize, int firstBlock)
+{
+	int lid = get_local_id(0);
+	int lN = get_local_size(0);
+	int gid = get_group_id(0);
+	int block = firstBlock + gid;
+
+	int start = block * blockSize;
+	int end = min(start + blockSize, n);
+
+	float moments[MOMENTS];
+	uint first = UINT_MAX;
+	uint last = 0;
+
+	init_moments(moments);
+
+	// every work item strides over the block
+	for (int i = start + lid; i < end; i += lN)
+	{
+		moments[MOMENT_SUM] += A[i];
+		moments[MOMENT_SUMSQ] += A[i] * A[i];
+		moments[MOMENT_MIN] = min(moments[MOMENT_MIN], A[i]);
+		moments[MOMENT_MAX] = max(moments[MOMENT_MAX], A[i]);
+		first = min(first, timestamp[i]);
+		last = max(last, timestamp[i]);
+	}
+
+	for (int m = 0; m < MOMENTS; m++)
+	{
+		lstats[lid * MOMENTS + m] = moments[m];
+	}
+	ltime[2 * lid] = first;
+	ltime[2 * lid + 1] = last;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = lN / 2; stride > 0; stride /= 2)
+	{
+		if (lid < stride)
+		{
+			int other = lid + stride;
+
+			lstats[lid * MOMENTS + MOMENT_SUM] += lstats[other * MOMENTS + MOMENT_SUM];
+			lstats[lid * MOMENTS + MOMENT_SUMSQ] += lstats[other * MOMENTS + MOMENT_SUMSQ];
+			lstats[lid * MOMENTS + MOMENT_MIN] = min(lstats[lid * MOMENTS + MOMENT_MIN], lstats[other * MOMENTS + MOMENT_MIN]);
+			lstats[lid * MOMENTS + MOMENT_MAX] = max(lstats[lid * MOMENTS + MOMENT_MAX], lstats[other * MOMENTS + MOMENT_MAX]);
+			ltime[2 * lid] = min(ltime[2 * lid], ltime[2 * other]);
+			ltime[2 * lid + 1] = max(ltime[2 * lid + 1], ltime[2 * other + 1]);
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (!lid)
+	{
+		for (int m = 0; m < MOMENTS; m++)
+		{
+			stats[gid * MOMENTS + m] = lstats[m];
+		}
+		counts[gid] = max(end - start, 0);
+		zoneTime[2 * gid] = ltime[0];
+		zoneTime[2 * gid + 1] = ltime[1];
+	}
+}
+
+// ********** BITMAP INDEX **********
+// one bit per record for every station, month and hour of day, packed into 32-bit words so that
+// boolean combinations run one work item per word, i.e. 32 records at a time
+// bitmap b occupies words [b * nWords, (b + 1) * nWords), stations first, then months 1..12, then hours 0..23
+
+#define BITMAP_WORD_BITS 32
+
+// sets the station, month and hour bit of every record, the bitmaps have to be zeroed beforehand
+kernel void build_bitmaps(global const int* station, global const uint* timestamp, global uint* bitmaps, int nWords, int nStations, int n)
+{
+	int id = get_global_id(0);
+
+	if (id < n)
+	{
+		int word = id / BITMAP_WORD_BITS;
+		uint bit = 1u << (id % BITMAP_WORD_BITS);
+
+		atomic_or(&bitmaps[station[id] * nWords + word], bit);
+		atomic_or(&bitmaps[(nStations + ts_month(timestamp[id]) - 1) * nWords + word], bit);
+		atomic_or(&bitmaps[(nStations + 12 + ts_hour(timestamp[id])) * nWords + word], bit);
+	}
+}
+
+// mask = AND over the clauses of (OR over the bitmaps of the clause)
+// clause c lists the bitmap ids ids[clauseStart[c]] .. ids[clauseStart[c + 1] - 1]
+kernel void combine_bitmaps(global const uint* bitmaps, constant int* ids, constant int* clauseStart, int nClauses, global uint* mask, int nWords)
+{
+	int w = get_global_id(0);
+
+	if (w < nWords)
+	{
+		uint result = 0xFFFFFFFF;
+
+		for (int c = 0; c < nClauses && result; c++)
+		{
+			uint any = 0;
+			for (int i = clauseStart[c]; i < clauseStart[c + 1]; i++)
+			{
+				any |= bitmaps[ids[i] * nWords + w];
+			}
+			result &= any;
+		}
+
+		mask[w] = result;
+	}
+}
+
+// reduce_station_stats restricted to the records whose bit is set in mask
+kernel void reduce_masked_stats(global const float* A, global const int* station, global const uint* mask, global float* stats,
+	global int* counts, local float* lstats, local int* lcounts, int n, int nStations)
+{
+	int id = get_global_id(0);
+
+	init_moments_local(lstats, lcounts, nStations);
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < n && (mask[id / BITMAP_WORD_BITS] & (1u << (id % BITMAP_WORD_BITS))))
+	{
+		accumulate_local(lstats, lcounts, station[id], A[id]);
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	merge_moments_local(stats, counts, lstats, lcounts, nStations);
+}
+
+// ********** AGGREGATE CUBE **********
+// moments of every (station, year, month) cell in one pass, see AggregateCube in TempData.h
+// the cube is too large to privatise in local memory, but the records are stored by station and time so
+// a workgroup usually falls into a single cell: it is then reduced in local memory and merged with one
+// set of atomics, mixed workgroups fall back to per-record global atomics
+// a global offset restricts the pass to rows appended since the cube was stored
+kernel void reduce_cube_stats(global const float* A, global const int* station, global const uint* timestamp, global float* stats,
+	global int* counts, local float* scratch, int n, int firstYear, int nYears)
+{
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int lN = get_local_size(0);
+
+	local int first_cell;
+	local int uniform;
+
+	int cell = -1;
+	if (id < n)
+	{
+		cell = (station[id] * nYears + ts_year(timestamp[id]) - firstYear) * 12 + ts_month(timestamp[id]) - 1;
+	}
+
+	if (!lid)
+	{
+		first_cell = cell;
+		uniform = 1;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (cell != first_cell)
+	{
+		uniform = 0;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (!uniform || cell < 0)
+	{
+		if (cell >= 0)
+		{
+			accumulate_global(stats, counts, cell, A[id]);
+		}
+		return;
+	}
+	// the whole workgroup takes the same branch, so the barriers below are reached by all work items
+
+	scratch[lid * MOMENTS + MOMENT_SUM] = A[id];
+	scratch[lid * MOMENTS + MOMENT_SUMSQ] = A[id] * A[id];
+	scratch[lid * MOMENTS + MOMENT_MIN] = A[id];
+	scratch[lid * MOMENTS + MOMENT_MAX] = A[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int stride = lN / 2; stride > 0; stride /= 2)
+	{
+		if (lid < stride)
+		{
+			int other = lid + stride;
+
+			scratch[lid * MOMENTS + MOMENT_SUM] += scratch[other * MOMENTS + MOMENT_SUM];
+			scratch[lid * MOMENTS + MOMENT_SUMSQ] += scratch[other * MOMENTS + MOMENT_SUMSQ];
+			scratch[lid * MOMENTS + MOMENT_MIN] = min(scratch[lid * MOMENTS + MOMENT_MIN], scratch[other * MOMENTS + MOMENT_MIN]);
+			scratch[lid * MOMENTS + MOMENT_MAX] = max(scratch[lid * MOMENTS + MOMENT_MAX], scratch[other * MOMENTS + MOMENT_MAX]);
+		}
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (!lid)
+	{
+		atomic_add(&counts[cell], lN);
+		atomic_add_float_global(&stats[cell * MOMENTS + MOMENT_SUM], scratch[MOMENT_SUM]);
+		atomic_add_float_global(&stats[cell * MOMENTS + MOMENT_SUMSQ], scratch[MOMENT_SUMSQ]);
+		atomic_min_float_global(&stats[cell * MOMENTS + MOMENT_MIN], scratch[MOMENT_MIN]);
+		atomic_max_float_global(&stats[cell * MOMENTS + MOMENT_MAX], scratch[MOMENT_MAX]);
+	}
+}